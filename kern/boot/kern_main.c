@@ -30,4 +30,11 @@ void kmain(void) {
 	// Start driver and initialisation processes
 
 	// Run scheduler
+
+	// Idle loop: perform background work, then wait for interrupts
+	while(1) {
+		while(vm_idle());
+
+		platform_cpu_idle();
+	}
 }
\ No newline at end of file
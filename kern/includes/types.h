@@ -27,6 +27,8 @@ extern "C" {
 #include "types/hashmap.h"
 #include "types/list.h"
 #include "types/ordered_array.h"
+#include "types/bitmap.h"
+#include "types/rbtree.h"
 
 // locks and friends
 #include "stdlib/locks.h"
@@ -1,13 +1,41 @@
 #ifndef PLATFORM_BOOTARG_H
 #define PLATFORM_BOOTARG_H
 
+// Maximum number of physical memory regions passed by the bootloader
+#define	PLATFORM_BOOTARG_MAX_REGIONS	32
+
+/**
+ * Types of physical memory regions.
+ */
+typedef enum {
+	kMemoryUsable,
+	kMemoryReserved,
+	kMemoryACPIReclaimable,
+	kMemoryACPINVS,
+	kMemoryBad,
+} platform_mem_type_t;
+
+/**
+ * A range of physical memory, as reported by the firmware.
+ */
+typedef struct {
+	uint64_t base;
+	uint64_t length;
+
+	platform_mem_type_t type;
+} platform_mem_region_t;
+
 /**
  * This structure contains information on boot arguments.
  */
 struct platform_bootargs {
-	unsigned int total_mem; // in kilobytes
+	unsigned int total_mem; // usable memory, in kilobytes
 	uintptr_t load_address_phys;
 
+	// physical memory map, sorted by base address
+	unsigned int num_mem_regions;
+	platform_mem_region_t mem_regions[PLATFORM_BOOTARG_MAX_REGIONS];
+
 	char boot_params[512];
 
 	struct {
@@ -6,4 +6,15 @@
  */
 extern void platform_init(void);
 
+/**
+ * Returns the index of the processor executing the caller. This is in the
+ * range 0 to PLATFORM_MAX_CPUS - 1, and is stable while interrupts are masked.
+ */
+extern unsigned int platform_cpu_id(void);
+
+/**
+ * Puts the processor into a low power state until the next interrupt.
+ */
+extern void platform_cpu_idle(void);
+
 #endif
\ No newline at end of file
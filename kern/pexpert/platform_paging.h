@@ -1,6 +1,12 @@
 #ifndef PLATFORM_PAGING_H
 #define PLATFORM_PAGING_H
 
+/**
+ * A physical address. This may be wider than a pointer, as platforms can often
+ * address more physical memory than fits into the virtual address space.
+ */
+typedef uint64_t phys_addr_t;
+
 /**
  * Pagetables can have various flags associated with them. These bitfields can
  * be logically ORed together to specify the behaviour of a certain range of
@@ -13,6 +19,7 @@
  * User: This page may be accessed by user code.
  * Global: Page will not be evicted from TLB when pagetable switches.
  * NotPresent: Page raises a page fault when accessed.
+ * Dirty: Page is mapped as accessed and written to already.
  */
 typedef unsigned int platform_page_flags_t;
 
@@ -24,6 +31,24 @@ enum {
 	kPlatformPageUser = (1 << 4),
 	kPlatformPageGlobal = (1 << 5),
 	kPlatformPageNotPresent = (1 << 6),
+	kPlatformPageDirty = (1 << 7),
+};
+
+/**
+ * The state of a page, as reported by platform_pm_scan.
+ *
+ * Present: The page is mapped.
+ * Writable: The page may be written to.
+ * Accessed: The page has been read or written since its bit was cleared.
+ * Dirty: The page has been written to since its bit was cleared.
+ */
+typedef uint8_t platform_page_state_t;
+
+enum {
+	kPlatformPageStatePresent = (1 << 0),
+	kPlatformPageStateWritable = (1 << 1),
+	kPlatformPageStateAccessed = (1 << 2),
+	kPlatformPageStateDirty = (1 << 3),
 };
 
 /**
@@ -42,6 +67,12 @@ typedef void* platform_pagetable_t;
  */
 void platform_pm_init(void);
 
+/**
+ * Returns the first physical address that can not be mapped. Memory above it
+ * is not used.
+ */
+phys_addr_t platform_pm_phys_limit(void);
+
 /**
  * Returns the kernel pagetable. This is stored in the BSS section, as it is
  * very hard to allocate memory for a page table before a working paging setup
@@ -50,15 +81,28 @@ void platform_pm_init(void);
 platform_pagetable_t platform_pm_get_kernel_table(void);
 
 /**
- * Creates a new pagetable, with no pages mapped. For example, on x86, this
- * creates the page directory only.
+ * Returns the end of the kernel memory mapped by the boot pagetables. Memory
+ * allocated before the kernel pagetable is active must lie below it.
+ */
+uintptr_t platform_pm_boot_map_end(void);
+
+/**
+ * Creates a new pagetable, with no pages mapped other than those of the kernel.
+ * For example, on x86, this creates the page directory only.
  */
 platform_pagetable_t platform_pm_new(void);
 
+/**
+ * Releases a pagetable created by platform_pm_new, as well as any structures
+ * used to map user space in it. Mapped pages are not released. The pagetable
+ * must not be active on any processor.
+ */
+void platform_pm_destroy(platform_pagetable_t table);
+
 /**
  * Maps a given virtual address range to a given physical address range.
  */
-void platform_pm_map(platform_pagetable_t table, uintptr_t virt, uintptr_t phys, 
+void platform_pm_map(platform_pagetable_t table, uintptr_t virt, phys_addr_t phys,
 					 platform_page_flags_t flags);
 
 /**
@@ -67,10 +111,54 @@ void platform_pm_map(platform_pagetable_t table, uintptr_t virt, uintptr_t phys,
  */
 void platform_pm_unmap(platform_pagetable_t table, uintptr_t virt);
 
+/**
+ * Maps pages contiguous pages, starting at virt, to the physically contiguous
+ * memory starting at phys. If the pagetable is active, the TLB is updated.
+ */
+void platform_pm_map_range(platform_pagetable_t table, uintptr_t virt,
+						   phys_addr_t phys, size_t pages,
+						   platform_page_flags_t flags);
+
+/**
+ * Unmaps pages contiguous pages, starting at virt. If the pagetable is active,
+ * the TLB is updated. Whatever physical memory that backs them is not released.
+ */
+void platform_pm_unmap_range(platform_pagetable_t table, uintptr_t virt,
+							 size_t pages);
+
 /**
  * Translates a virtual address in a given pagetable to a physical address.
  */
-uintptr_t platform_pm_virt_to_phys(platform_pagetable_t table, uintptr_t virt);
+phys_addr_t platform_pm_virt_to_phys(platform_pagetable_t table, uintptr_t virt);
+
+/**
+ * A range of virtual memory that is backed by physically contiguous memory.
+ */
+typedef struct platform_pm_extent {
+	uintptr_t virt;
+	phys_addr_t phys;
+
+	size_t length;
+} platform_pm_extent_t;
+
+/**
+ * Translates size bytes, starting at virt, into a list of physically
+ * contiguous extents, in a single walk of the pagetable. Unmapped pages are
+ * skipped. Returns the number of extents written, at most max: if the list is
+ * full, the translation can be resumed at the end of the last extent.
+ */
+size_t platform_pm_translate(platform_pagetable_t table, uintptr_t virt,
+							 size_t size, platform_pm_extent_t *extents,
+							 size_t max);
+
+/**
+ * Reports the state of pages contiguous pages, starting at virt, in a single
+ * walk of the pagetable, writing one entry per page into states. The accessed
+ * and dirty bits given in clear are reset atomically as they are read.
+ */
+void platform_pm_scan(platform_pagetable_t table, uintptr_t virt, size_t pages,
+					  platform_page_state_t *states,
+					  platform_page_state_t clear);
 
 /**
  * Check whether a given page has been accessed, i.e. check the dirty bit. If
@@ -101,4 +189,10 @@ void platform_pm_switchto(platform_pagetable_t table);
  */
 void platform_pm_invalidate(void* m);
 
+/**
+ * Invalidates pages contiguous pages, starting at m, in the MMU's TLB. Large
+ * ranges may cause the entire TLB to be flushed instead.
+ */
+void platform_pm_invalidate_range(void* m, size_t pages);
+
 #endif
\ No newline at end of file
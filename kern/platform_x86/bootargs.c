@@ -7,6 +7,85 @@ void *x86_platform_multiboot_struct_addr;
 // memory structure
 static platform_bootargs_t bootargs;
 
+/**
+ * Adds a region to the memory map, keeping it sorted by base address.
+ */
+static void bootarg_add_region(uint64_t base, uint64_t length, platform_mem_type_t type) {
+	if(!length) {
+		return;
+	}
+
+	if(bootargs.num_mem_regions == PLATFORM_BOOTARG_MAX_REGIONS) {
+		KERROR("Too many memory regions\n");
+		return;
+	}
+
+	// find the insertion point, and move everything after it up by one
+	unsigned int i = bootargs.num_mem_regions;
+
+	while(i > 0 && bootargs.mem_regions[i - 1].base > base) {
+		bootargs.mem_regions[i] = bootargs.mem_regions[i - 1];
+		i--;
+	}
+
+	bootargs.mem_regions[i].base = base;
+	bootargs.mem_regions[i].length = length;
+	bootargs.mem_regions[i].type = type;
+
+	bootargs.num_mem_regions++;
+
+	if(type == kMemoryUsable) {
+		bootargs.total_mem += length / 1024;
+	}
+}
+
+/**
+ * Converts the memory map provided by the bootloader into a list of regions.
+ * If there is no memory map, the lower and upper memory sizes are used.
+ */
+static void bootarg_parse_mmap(multiboot_info_t *info) {
+	if(!(info->flags & MULTIBOOT_INFO_MEM_MAP)) {
+		bootarg_add_region(0, info->mem_lower * 1024, kMemoryUsable);
+		bootarg_add_region(0x100000, info->mem_upper * 1024, kMemoryUsable);
+		return;
+	}
+
+	uintptr_t entry = info->mmap_addr;
+	uintptr_t end = info->mmap_addr + info->mmap_length;
+
+	while(entry < end) {
+		multiboot_memory_map_t *mmap = (multiboot_memory_map_t *) entry;
+		platform_mem_type_t type;
+
+		switch(mmap->type) {
+			case MULTIBOOT_MEMORY_AVAILABLE:
+				type = kMemoryUsable;
+				break;
+
+			case MULTIBOOT_MEMORY_ACPI_RECLAIMABLE:
+				type = kMemoryACPIReclaimable;
+				break;
+
+			case MULTIBOOT_MEMORY_NVS:
+				type = kMemoryACPINVS;
+				break;
+
+			case MULTIBOOT_MEMORY_BADRAM:
+				type = kMemoryBad;
+				break;
+
+			default:
+				type = kMemoryReserved;
+				break;
+		}
+
+		bootarg_add_region(mmap->addr, mmap->len, type);
+
+		// the size field does not include itself
+		entry += mmap->size + sizeof(mmap->size);
+	}
+}
+
 /**
  * Parses the boot argument structure. This assumes that the bootup/init handler
  * fetched appropriate information.
@@ -15,7 +94,7 @@ extern void platform_bootarg_parse(void) {
 	multiboot_info_t *info = (multiboot_info_t *) x86_platform_multiboot_struct_addr;
 
 	// available mem
-	bootargs.total_mem = info->mem_upper;
+	bootarg_parse_mmap(info);
 	strncpy((char *) &bootargs.boot_params, (char *) info->cmdline, 512);
 
 	// physical load address (fixed for x86 with multiboot)
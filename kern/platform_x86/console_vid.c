@@ -86,10 +86,8 @@ void platform_console_vid_map(void) {
 	// get base of framebuffer
 	lfb_base = args->framebuffer.base;
 
-	// now, map the LFB into the platform region
-	for (int i = 0; i < 0x800000; i += 0x1000) {
-		platform_pm_map(platform_pm_get_kernel_table(), i + 0xF0000000, lfb_base + i, VM_FLAGS_KERNEL);
-	}
+	// now, map the LFB into the platform region (with large pages if aligned)
+	platform_pm_map_range(platform_pm_get_kernel_table(), 0xF0000000, lfb_base, 0x800, VM_FLAGS_KERNEL);
 
 	int heightSub = (CONSOLE_HEIGHT / 4) * 3;
 
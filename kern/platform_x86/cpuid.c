@@ -348,4 +348,22 @@ static void cpuid_detect_extensions(x86_cpu_t *cpu) {
 	cpu->extensions.mmx = edx & (1 << 23);
 	cpu->extensions.sse1 = edx & (1 << 25);
 	cpu->extensions.sse2 = edx & (1 << 26);
+
+	// No-execute pages and physical address width are extended features
+	unsigned int extended;
+	cpuid(0x80000000, extended, unused, unused, unused);
+
+	cpu->extensions.nx = false;
+	cpu->phys_addr_bits = cpu->extensions.pae ? 36 : 32;
+
+	if(extended >= 0x80000001) {
+		cpuid(0x80000001, unused, unused, ecx, edx);
+		cpu->extensions.nx = edx & (1 << 20);
+	}
+
+	if(extended >= 0x80000008) {
+		unsigned int eax;
+		cpuid(0x80000008, eax, unused, unused, unused);
+		cpu->phys_addr_bits = eax & 0xFF;
+	}
 }
\ No newline at end of file
@@ -59,11 +59,15 @@ typedef struct {
 	struct {
 		bool apic;
 		bool pae;
+		bool nx;
 
 		bool mmx;
 		bool sse1;
 		bool sse2;
 	} extensions;
+
+	// Number of bits in physical addresses
+	unsigned int phys_addr_bits;
 } x86_cpu_t;
 
 /**
@@ -5,6 +5,7 @@
 #define	MSR_IA32_SYSENTER_CS	0x174 // base selector for CS/SS
 #define	MSR_IA32_SYSENTER_ESP	0x175 // %esp for sysenter
 #define	MSR_IA32_SYSENTER_EIP	0x176 // %eip for sysenter
+#define	MSR_IA32_EFER			0xC0000080 // extended features, such as no-execute
 
 ////////////////////////////////// AMD MSRs ///////////////////////////////////
 #define	MSR_AMD_SYSCALL_STAR	0xC0000081 // syscall %eip in low 32 bits, CS/SS for high 32
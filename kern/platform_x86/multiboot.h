@@ -7,6 +7,9 @@
 
 #define MULTIBOOT_MEMORY_AVAILABLE		1
 #define MULTIBOOT_MEMORY_RESERVED		2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE	3
+#define MULTIBOOT_MEMORY_NVS			4
+#define MULTIBOOT_MEMORY_BADRAM			5
 
 // How many bytes from the start of the file we search for the header.
 #define MULTIBOOT_SEARCH				8192
@@ -1,17 +1,243 @@
 #include "x86.h"
+#include "cpuid.h"
 #include "paging_types.h"
 
 #include "vm/kmalloc.h"
+#include "vm/physical.h"
+#include "vm/map.h"
+#include "vm/vmalloc.h"
 
 #define	PAGE_SIZE 4096
 
-// Kernel page directory in BSS
-static __attribute__((__section__(".pagetable"))) page_directory_t x86_system_pagedir;
+/*
+ * Two formats of pagetables are supported: classic 32-bit paging, and PAE,
+ * which is used if the processor supports it. PAE entries are 64 bits wide,
+ * so frames above 4G can be mapped, and pages can be marked as no-execute.
+ *
+ * With PAE, a table holds 512 entries and thus maps 2M, rather than 4M. The
+ * four page directories that cover the address space are kept together, and
+ * accessed as one directory with 2048 entries: both formats then consist of a
+ * directory of entries, each of which maps a block of the address space with
+ * either a page table or a large page.
+ */
+
+// Bits in a page table entry
+#define	PTE_PRESENT			(1 << 0)
+#define	PTE_RW				(1 << 1)
+#define	PTE_USER			(1 << 2)
+#define	PTE_WRITETHROUGH	(1 << 3)
+#define	PTE_NOCACHE			(1 << 4)
+#define	PTE_ACCESSED		(1 << 5)
+#define	PTE_DIRTY			(1 << 6)
+#define	PTE_GLOBAL			(1 << 8)
+#define	PTE_NX				(1ULL << 63)
+
+// Directory entries with this bit map a large page directly
+#define	PDE_LARGE			(1 << 7)
+
+// Bits that are carried over from a large page when it is split
+#define	PTE_LARGE_BITS		(PTE_PRESENT | PTE_RW | PTE_USER | PTE_WRITETHROUGH | \
+							 PTE_NOCACHE | PTE_GLOBAL | PTE_NX)
+
+/*
+ * Ranges larger than this many pages are invalidated by flushing the entire
+ * TLB, rather than with one invlpg per page.
+ */
+#define	TLB_FLUSH_THRESHOLD	32
+
+// Directory entries pointing to page tables; pages set the actual permissions
+#define	PDE_TABLE			(PTE_PRESENT | PTE_RW | PTE_USER)
+
+// Control register bits
+#define	CR4_PSE				(1 << 4)
+#define	CR4_PAE				(1 << 5)
+#define	CR4_PGE				(1 << 7)
+
+#define	EFER_NXE			(1 << 11)
+
+// An entry in either format; legacy entries only use the low 32 bits
+typedef uint64_t x86_pte_t;
+
+// Whether PAE is used, and whether the no-execute bit is enabled
+static bool x86_pm_pae = false;
+static bool x86_pm_nx = false;
+
+// Number of physical address bits the processor supports
+static unsigned int x86_pm_phys_bits = 32;
+
+// Number of entries in a table, and the log2 of the memory one table maps
+static unsigned int x86_pm_entries = 1024;
+static unsigned int x86_pm_shift = 22;
+
+// Number of pages holding the directory: four with PAE
+static unsigned int x86_pm_dir_pages = 1;
+
+// Memory mapped by one directory entry, and the directory entry for an address
+#define	BLOCK_SIZE			(1U << x86_pm_shift)
+#define	BLOCK_OF(addr)		((addr) >> x86_pm_shift)
+#define	BLOCK_OFFSET(addr)	((addr) & (BLOCK_SIZE - 1))
+
+// Index of the entry mapping an address in its page table
+#define	TABLE_INDEX(addr)	(((addr) / PAGE_SIZE) & (x86_pm_entries - 1))
+
+// Number of directory entries
+#define	DIR_ENTRIES			(x86_pm_entries * x86_pm_dir_pages)
+
+// First directory entry of the kernel half of the address space
+#define	KERNEL_FIRST_BLOCK	BLOCK_OF(VM_KERNEL_BASE)
+#define	KERNEL_NUM_BLOCKS	(DIR_ENTRIES - KERNEL_FIRST_BLOCK)
+
+/*
+ * Every page directory maps itself as a page table at the start of the
+ * pagetable mapping area (taking up one entry per page of the directory). The
+ * page tables of the current address space thus appear at RECURSIVE_BASE, in
+ * order, and its directory appears as the page tables that map RECURSIVE_BASE.
+ */
+#define	RECURSIVE_BASE		0xC2000000U
+#define	RECURSIVE_BLOCK		BLOCK_OF(RECURSIVE_BASE)
+#define	RECURSIVE_DIR		((void *) (RECURSIVE_BASE + (RECURSIVE_BLOCK * PAGE_SIZE)))
+
+/*
+ * Page tables and directories of other address spaces are mapped temporarily
+ * into a set of pages per processor at this address.
+ */
+#define	TEMP_BASE			0xC2800000U
+
+enum {
+	// Pages of the directory; up to four
+	kTempSlotDirectory = 0,
+	// A page table
+	kTempSlotTable = 4,
+	// The page directory pointer table, with PAE
+	kTempSlotPointers = 5,
+
+	kTempSlotsPerCPU = 8
+};
+
+/*
+ * Kernel page directory in BSS: PAE uses all four pages, classic paging only
+ * the first. With PAE, the directory pointer table is at the start of another
+ * page, which can double as a classic page directory when switching modes.
+ */
+static __attribute__((__section__(".pagetable"), __aligned__(PAGE_SIZE))) uint8_t x86_system_pagedir[4 * PAGE_SIZE];
+static __attribute__((__section__(".pagetable"), __aligned__(PAGE_SIZE))) uint32_t x86_system_pdpt[1024];
+
+// Physical address that CR3 is loaded with for the kernel pagetable
+static uintptr_t x86_system_table_phys;
+
+// Page tables for the kernel half, shared by all page directories
+static uint8_t *x86_kernel_tables;
+static phys_addr_t x86_kernel_tables_phys;
+
+// Set once page directories have copied the kernel's directory entries
+static bool x86_kernel_shared = false;
+
+// Set once one of our own directories has been loaded
+static bool x86_pm_switched = false;
+
+// Protects the temporary mappings, and directory entries of user space
+static mutex_t x86_pm_lock;
+
+/**
+ * A pagetable, as it is being accessed: the directory entries are reachable at
+ * dir, and current indicates whether its page tables are reachable through
+ * the recursive mapping.
+ */
+typedef struct {
+	uintptr_t phys;
+	void *dir;
+
+	bool current;
+} x86_pm_view_t;
+
+/**
+ * Reads the entry at the given index of a table.
+ */
+static inline x86_pte_t x86_pm_read(void *table, unsigned int i) {
+	if(x86_pm_pae) {
+		volatile uint32_t *entry = &((uint32_t *) table)[i * 2];
+		return (((x86_pte_t) entry[1]) << 32) | entry[0];
+	}
+
+	return ((volatile uint32_t *) table)[i];
+}
+
+/**
+ * Writes the entry at the given index of a table. PAE entries are written in
+ * two halves: the low half, with the present bit, is cleared first and written
+ * last, so the processor never sees a mix of the old and new entry.
+ */
+static inline void x86_pm_write(void *table, unsigned int i, x86_pte_t value) {
+	if(x86_pm_pae) {
+		volatile uint32_t *entry = &((uint32_t *) table)[i * 2];
+
+		entry[0] = 0;
+		entry[1] = (uint32_t) (value >> 32);
+		entry[0] = (uint32_t) value;
+	} else {
+		((volatile uint32_t *) table)[i] = (uint32_t) value;
+	}
+}
+
+/**
+ * Reads the low half of an entry, which holds all status bits, and resets the
+ * given bits in it. The processor may set the accessed and dirty bits
+ * concurrently, so this must be atomic.
+ */
+static inline uint32_t x86_pm_fetch_clear(void *table, unsigned int i, uint32_t bits) {
+	uint32_t *entry = &((uint32_t *) table)[x86_pm_pae ? (i * 2) : i];
+	uint32_t old;
+
+	do {
+		old = *entry;
+
+		if(!(old & bits)) {
+			break;
+		}
+	} while(sync_cmpxchg(entry, old, old & ~bits) != old);
+
+	return old;
+}
+
+/**
+ * Gets the physical address an entry points to.
+ */
+static inline phys_addr_t x86_pm_entry_addr(x86_pte_t entry) {
+	return entry & (x86_pm_pae ? 0x000FFFFFFFFFF000ULL : 0xFFFFF000ULL);
+}
+
+/**
+ * Gets the physical address of a large page mapped by a directory entry.
+ */
+static inline phys_addr_t x86_pm_large_addr(x86_pte_t entry) {
+	return x86_pm_entry_addr(entry) & ~((phys_addr_t) BLOCK_SIZE - 1);
+}
 
 /**
  * Initialises the physical memory manager.
+ *
+ * PAE is used if the processor supports it. The kernel pagetable is set up in
+ * the chosen format, but only loaded on the first switch.
+ *
+ * This allocates every page table for the kernel half of the address space, so
+ * that its directory entries never change: page directories created later can
+ * then simply copy them, and still see all kernel mappings. The only exception
+ * is the recursive mapping, which each directory points back at itself.
  */
 void platform_pm_init(void) {
+	x86_cpu_t cpu = x86_detect_cpu();
+
+	if(cpu.extensions.pae) {
+		x86_pm_pae = true;
+		x86_pm_nx = cpu.extensions.nx;
+
+		x86_pm_phys_bits = (cpu.phys_addr_bits > 52) ? 52 : cpu.phys_addr_bits;
+
+		x86_pm_entries = 512;
+		x86_pm_shift = 21;
+		x86_pm_dir_pages = 4;
+	}
+
 	/*
 	 * Enable global addresses. This helps with minimising the TLB flush
 	 * overhead when performing a context switch, as kernel pages can stay in
@@ -19,12 +245,61 @@ void platform_pm_init(void) {
 	 */
 	uint32_t cr4;
 	__asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
-	cr4 |= (1 << 7);
+	cr4 |= CR4_PGE;
+
+	// Large pages are already enabled by the boot code, but be sure of it
+	cr4 |= CR4_PSE;
 	__asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
 
-	x86_system_pagedir.physAddr = (((uintptr_t) &x86_system_pagedir.tablesPhysical) - 0xC0000000);
+	// The no-execute bit is reserved unless enabled
+	if(x86_pm_nx) {
+		msr_write(MSR_IA32_EFER, msr_read(MSR_IA32_EFER) | EFER_NXE);
+	}
+
+	uintptr_t dir_phys = ((uintptr_t) &x86_system_pagedir) - 0xC0000000;
+
+	// Allocate the kernel page tables in one go
+	x86_kernel_tables = kmalloc_ext(KERNEL_NUM_BLOCKS * PAGE_SIZE,
+									kMallocZero | kMallocAligned | kMallocContiguous,
+									&x86_kernel_tables_phys);
+	ASSERT(x86_kernel_tables);
+
+	for(unsigned int i = 0; i < KERNEL_NUM_BLOCKS; i++) {
+		x86_pm_write(x86_system_pagedir, KERNEL_FIRST_BLOCK + i,
+					 (x86_kernel_tables_phys + (i * PAGE_SIZE)) | PDE_TABLE);
+	}
+
+	for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+		uintptr_t page = dir_phys + (i * PAGE_SIZE);
+
+		x86_pm_write(x86_system_pagedir, RECURSIVE_BLOCK + i, page | PTE_PRESENT | PTE_RW);
+
+		if(x86_pm_pae) {
+			((x86_pte_t *) x86_system_pdpt)[i] = page | PTE_PRESENT;
+		}
+	}
+
+	if(x86_pm_pae) {
+		x86_system_table_phys = ((uintptr_t) &x86_system_pdpt) - 0xC0000000;
+	} else {
+		x86_system_table_phys = dir_phys;
+	}
+}
+
+/**
+ * Returns the first physical address that can not be mapped. Classic paging is
+ * limited to 4G; PAE to the processor's physical address width.
+ */
+phys_addr_t platform_pm_phys_limit(void) {
+	return ((phys_addr_t) 1) << x86_pm_phys_bits;
+}
 
-	//KDEBUG("table 0x%X 0x%X\n", (unsigned int) &x86_system_pagedir, (unsigned int) x86_system_pagedir.physAddr);
+/**
+ * Returns the end of the kernel memory mapped by the boot pagetables: init.s
+ * maps the first 8M of physical memory at the kernel's base.
+ */
+uintptr_t platform_pm_boot_map_end(void) {
+	return VM_KERNEL_BASE + 0x800000;
 }
 
 /**
@@ -33,60 +308,409 @@ void platform_pm_init(void) {
  * is in place.
  */
 platform_pagetable_t platform_pm_get_kernel_table(void) {
-	// set up the physical address
-	return (platform_pagetable_t) &x86_system_pagedir;
+	return (platform_pagetable_t) x86_system_table_phys;
+}
+
+/**
+ * Takes the paging lock, with interrupts masked, so that the temporary
+ * mappings of this processor can't be clobbered.
+ */
+static inline bool x86_pm_lock_take(void) {
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	mutex_take_spin(&x86_pm_lock);
+
+	return enabled;
 }
 
 /**
- * Creates a new pagetable, with no pages mapped. For example, on x86, this
- * creates the page directory only.
+ * Releases the paging lock, and restores the interrupt state.
+ */
+static inline void x86_pm_lock_give(bool enabled) {
+	mutex_give(&x86_pm_lock);
+
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+}
+
+/**
+ * Returns the kernel's page table for a block in the kernel half.
+ */
+static inline void *x86_pm_kernel_table(unsigned int block) {
+	return x86_kernel_tables + ((block - KERNEL_FIRST_BLOCK) * PAGE_SIZE);
+}
+
+/**
+ * Returns the physical address of the kernel's page table for a block.
+ */
+static inline phys_addr_t x86_pm_kernel_table_phys(unsigned int block) {
+	return x86_kernel_tables_phys + ((block - KERNEL_FIRST_BLOCK) * PAGE_SIZE);
+}
+
+/**
+ * Maps the given frame into one of the processor's temporary slots, and
+ * returns its virtual address. The paging lock must be held.
+ */
+static void *x86_pm_temp_map(unsigned int slot, phys_addr_t phys) {
+	// the temporary slots only exist in our own directories
+	ASSERT(x86_pm_switched);
+
+	unsigned int page = (platform_cpu_id() * kTempSlotsPerCPU) + slot;
+	uintptr_t virt = TEMP_BASE + (page * PAGE_SIZE);
+
+	void *table = x86_pm_kernel_table(BLOCK_OF(virt));
+	x86_pm_write(table, TABLE_INDEX(virt), x86_pm_entry_addr(phys) | PTE_PRESENT | PTE_RW);
+
+	platform_pm_invalidate((void *) virt);
+
+	return (void *) virt;
+}
+
+/**
+ * Checks whether the pagetable with the given physical address is loaded.
+ */
+static inline bool x86_pm_is_current(uintptr_t phys) {
+	uintptr_t cr3;
+	__asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
+
+	return ((cr3 & ~(PAGE_SIZE - 1)) == phys);
+}
+
+/**
+ * Makes the directory entries of a pagetable accessible. The kernel's are
+ * always in BSS, those of the current pagetable are in the recursive mapping,
+ * and all others are mapped temporarily. The paging lock must be held.
+ */
+static void x86_pm_view(platform_pagetable_t t_in, x86_pm_view_t *v) {
+	v->phys = (uintptr_t) t_in;
+	v->current = x86_pm_switched && x86_pm_is_current(v->phys);
+
+	if(v->phys == x86_system_table_phys) {
+		v->dir = x86_system_pagedir;
+	} else if(v->current) {
+		v->dir = RECURSIVE_DIR;
+	} else if(x86_pm_pae) {
+		// map the directories listed in the pointer table in order
+		x86_pte_t *pdpt = x86_pm_temp_map(kTempSlotPointers, v->phys);
+
+		for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+			x86_pm_temp_map(kTempSlotDirectory + i, pdpt[i]);
+		}
+
+		v->dir = (void *) (TEMP_BASE + (platform_cpu_id() * kTempSlotsPerCPU * PAGE_SIZE));
+	} else {
+		v->dir = x86_pm_temp_map(kTempSlotDirectory, v->phys);
+	}
+}
+
+/**
+ * Checks whether the given block belongs to the kernel's shared page tables.
+ */
+static inline bool x86_pm_is_kernel_block(unsigned int block) {
+	return block >= KERNEL_FIRST_BLOCK &&
+		   (block < RECURSIVE_BLOCK || block >= (RECURSIVE_BLOCK + x86_pm_dir_pages));
+}
+
+/**
+ * Checks whether the given block is mapped with a single large page.
+ */
+static inline bool x86_pm_is_large(x86_pm_view_t *v, unsigned int block) {
+	return (x86_pm_read(v->dir, block) & (PDE_LARGE | PTE_PRESENT)) == (PDE_LARGE | PTE_PRESENT);
+}
+
+/**
+ * Checks whether the given block has a page table.
+ */
+static inline bool x86_pm_has_table(x86_pm_view_t *v, unsigned int block) {
+	return (x86_pm_read(v->dir, block) & (PDE_LARGE | PTE_PRESENT)) == PTE_PRESENT;
+}
+
+/**
+ * Returns the page table for a block, which must exist. Kernel page tables
+ * are accessed directly; all others through the recursive mapping, or a
+ * temporary mapping if the pagetable isn't current.
+ */
+static void *x86_pm_table(x86_pm_view_t *v, unsigned int block) {
+	if(x86_pm_is_kernel_block(block)) {
+		return x86_pm_kernel_table(block);
+	} else if(v->current) {
+		return (void *) (RECURSIVE_BASE + (block * PAGE_SIZE));
+	} else {
+		return x86_pm_temp_map(kTempSlotTable, x86_pm_read(v->dir, block));
+	}
+}
+
+/**
+ * Checks whether a large page may be placed in the given block: the block
+ * must not have a page table, unless it is one of the kernel's page tables,
+ * which is empty, and not shared with other page directories yet.
+ */
+static bool x86_pm_can_map_large(x86_pm_view_t *v, unsigned int block) {
+	if(!x86_pm_has_table(v, block)) {
+		return !x86_pm_is_kernel_block(block) || !x86_kernel_shared;
+	}
+
+	if(!x86_pm_is_kernel_block(block) || x86_kernel_shared) {
+		return false;
+	}
+
+	void *table = x86_pm_table(v, block);
+
+	for(unsigned int i = 0; i < x86_pm_entries; i++) {
+		if(x86_pm_read(table, i)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Returns the page table that maps the given block. If it does not exist yet,
+ * a frame is allocated for it when create is set, or NULL is returned. If the
+ * block is mapped with a large page, it is split into a page table that maps
+ * the same memory.
+ */
+static void *x86_pm_get_table(x86_pm_view_t *v, unsigned int block, bool create) {
+	if(x86_pm_has_table(v, block)) {
+		return x86_pm_table(v, block);
+	}
+
+	bool large = x86_pm_is_large(v, block);
+
+	if(!large && !create) {
+		return NULL;
+	}
+
+	x86_pte_t pde = x86_pm_read(v->dir, block);
+	phys_addr_t table_phys;
+
+	if(x86_pm_is_kernel_block(block)) {
+		/*
+		 * Every kernel block has a page table, unless it is mapped with a large
+		 * page; those are all split before the directory entries are shared.
+		 */
+		ASSERT(large && !x86_kernel_shared);
+		table_phys = x86_pm_kernel_table_phys(block);
+	} else {
+		table_phys = vm_allocate_phys();
+
+		if(unlikely(!table_phys)) {
+			KERROR("Couldn't allocate page table for 0x%08X\n", block << x86_pm_shift);
+			return NULL;
+		}
+	}
+
+	x86_pm_write(v->dir, block, table_phys | PDE_TABLE);
+
+	void *table = x86_pm_table(v, block);
+
+	// the recursive mapping of this table changed
+	if(v->current) {
+		platform_pm_invalidate(table);
+	}
+
+	if(large) {
+		// carry over the mapping of the large page
+		x86_pte_t bits = pde & PTE_LARGE_BITS;
+		phys_addr_t phys = x86_pm_large_addr(pde);
+
+		for(unsigned int i = 0; i < x86_pm_entries; i++) {
+			x86_pm_write(table, i, (phys + (i * PAGE_SIZE)) | bits);
+		}
+
+		// the large page may still be cached in the TLB
+		if(v->current || x86_pm_is_kernel_block(block)) {
+			platform_pm_invalidate((void *) (block << x86_pm_shift));
+		}
+	} else {
+		memclr(table, PAGE_SIZE);
+	}
+
+	return table;
+}
+
+/**
+ * Splits every large page in the kernel half of the kernel's pagetable into
+ * the page table preallocated for its block. This is done before the kernel's
+ * directory entries are first copied into another directory: they can't
+ * change after that, so a large page left in place could never be partially
+ * remapped or unmapped. The paging lock must be held.
+ */
+static void x86_pm_split_kernel_large(void) {
+	x86_pm_view_t v;
+	x86_pm_view((platform_pagetable_t) x86_system_table_phys, &v);
+
+	for(unsigned int block = KERNEL_FIRST_BLOCK; block < DIR_ENTRIES; block++) {
+		if(x86_pm_is_kernel_block(block) && x86_pm_is_large(&v, block)) {
+			x86_pm_get_table(&v, block, false);
+		}
+	}
+}
+
+/**
+ * Creates a new pagetable, with no pages mapped other than those of the kernel.
+ * For example, on x86, this creates the page directory only.
+ *
+ * The kernel half of the directory refers to the kernel's own page tables, so
+ * kernel mappings are visible without ever having to be synchronised. With
+ * PAE, CR3 points to a directory pointer table, which must be below 4G.
  */
 platform_pagetable_t platform_pm_new(void) {
-	// allocate physical memory for the page table. this needn't be page aligned
-	return NULL;
+	phys_addr_t pages[4];
+	uintptr_t phys = 0;
+
+	if(x86_pm_pae) {
+		phys = vm_allocate_phys_below(0x100000000ULL);
+
+		if(unlikely(!phys)) {
+			return NULL;
+		}
+	}
+
+	for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+		pages[i] = vm_allocate_phys();
+
+		if(unlikely(!pages[i])) {
+			while(i--) {
+				vm_deallocate_phys(pages[i]);
+			}
+
+			if(phys) {
+				vm_deallocate_phys(phys);
+			}
+
+			return NULL;
+		}
+	}
+
+	if(!x86_pm_pae) {
+		phys = pages[0];
+	}
+
+	bool irq = x86_pm_lock_take();
+
+	if(!x86_kernel_shared) {
+		x86_pm_split_kernel_large();
+	}
+
+	if(x86_pm_pae) {
+		x86_pte_t *pdpt = x86_pm_temp_map(kTempSlotPointers, phys);
+		memclr(pdpt, PAGE_SIZE);
+
+		for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+			pdpt[i] = pages[i] | PTE_PRESENT;
+		}
+	}
+
+	x86_pm_view_t v;
+	x86_pm_view((platform_pagetable_t) phys, &v);
+
+	// share the kernel's page tables, and map the directory onto itself
+	size_t entry_size = x86_pm_pae ? sizeof(uint64_t) : sizeof(uint32_t);
+
+	memclr(v.dir, KERNEL_FIRST_BLOCK * entry_size);
+	memcpy(((uint8_t *) v.dir) + (KERNEL_FIRST_BLOCK * entry_size),
+		   x86_system_pagedir + (KERNEL_FIRST_BLOCK * entry_size),
+		   KERNEL_NUM_BLOCKS * entry_size);
+
+	for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+		x86_pm_write(v.dir, RECURSIVE_BLOCK + i, pages[i] | PTE_PRESENT | PTE_RW);
+	}
+
+	x86_kernel_shared = true;
+
+	x86_pm_lock_give(irq);
+
+	return (platform_pagetable_t) phys;
 }
 
 /**
- * Maps a given virtual address range to a given physical address range.
+ * Releases a pagetable created by platform_pm_new, and all page tables for the
+ * user half of the address space. Mapped pages are not released. The pagetable
+ * must not be active on any processor.
  */
-void platform_pm_map(platform_pagetable_t t_in, uintptr_t virt, uintptr_t phys,
-					 platform_page_flags_t flags) {
-	// is there a page table for the 4MB region this falls under?
-	page_directory_t *d = (page_directory_t *) t_in;
+void platform_pm_destroy(platform_pagetable_t t_in) {
+	phys_addr_t pages[4];
+
+	ASSERT((uintptr_t) t_in != x86_system_table_phys);
+
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	ASSERT(!v.current);
+
+	for(unsigned int block = 0; block < KERNEL_FIRST_BLOCK; block++) {
+		if(x86_pm_has_table(&v, block)) {
+			vm_deallocate_phys(x86_pm_entry_addr(x86_pm_read(v.dir, block)));
+		}
+	}
 
-	unsigned int block = virt / 0x400000;
-	if(!d->tables[block]) {
-		// allocate a table
-		uintptr_t tmp;
-		page_table_t *table = kmalloc_ap(sizeof(page_table_t), &tmp);
+	// the recursive mapping lists the pages of the directory itself
+	for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+		pages[i] = x86_pm_entry_addr(x86_pm_read(v.dir, RECURSIVE_BLOCK + i));
+	}
+
+	x86_pm_lock_give(irq);
 
-		d->tables[block] = table;
-		d->tablesPhysical[block] = tmp | 0x00000005; // USER | PRESENT
+	for(unsigned int i = 0; i < x86_pm_dir_pages; i++) {
+		vm_deallocate_phys(pages[i]);
+	}
 
-		// ensure this table is clared
-		memset(table, 0x00, sizeof(page_table_t));
+	if(x86_pm_pae) {
+		vm_deallocate_phys(v.phys);
 	}
+}
+
+/**
+ * Converts platform page flags to the bits in a page table entry.
+ */
+static x86_pte_t x86_pm_pte_bits(platform_page_flags_t flags) {
+	x86_pte_t bits = 0;
+
+	if(!(flags & kPlatformPageNotPresent)) bits |= PTE_PRESENT;
+	if(!(flags & kPlatformPageReadOnly)) bits |= PTE_RW;
+	if(flags & kPlatformPageUser) bits |= PTE_USER;
+	if(flags & kPlatformPageWritethrough) bits |= PTE_WRITETHROUGH;
+	if(flags & kPlatformPageUncachable) bits |= PTE_NOCACHE;
+	if(flags & kPlatformPageGlobal) bits |= PTE_GLOBAL;
+	if(flags & kPlatformPageDirty) bits |= PTE_ACCESSED | PTE_DIRTY;
+	if((flags & kPlatformPageNoExecute) && x86_pm_nx) bits |= PTE_NX;
+
+	return bits;
+}
+
+/**
+ * Checks whether changes to the given address in a pagetable must be
+ * invalidated in the TLB: kernel mappings are shared by all pagetables.
+ */
+static inline bool x86_pm_needs_invalidate(x86_pm_view_t *v, uintptr_t virt) {
+	return v->current || virt >= VM_KERNEL_BASE;
+}
 
-	// configure the pagetable entry
-	page_table_t *table = d->tables[block];
-	int table_entry = (virt & 0x3FFFFF) / 0x1000;
+/**
+ * Maps a given virtual address range to a given physical address range.
+ */
+void platform_pm_map(platform_pagetable_t t_in, uintptr_t virt, phys_addr_t phys,
+					 platform_page_flags_t flags) {
+	bool irq = x86_pm_lock_take();
 
-	// set up physical address
-	table->pages[table_entry].frame = phys >> 12;
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
 
-	// flags
-	table->pages[table_entry].global = flags & kPlatformPageGlobal;
-	table->pages[table_entry].cache = flags & kPlatformPageUncachable;
-	table->pages[table_entry].writethrough = flags & kPlatformPageWritethrough;
-	table->pages[table_entry].user = flags & kPlatformPageUser;
-	table->pages[table_entry].rw = !(flags & kPlatformPageReadOnly);
+	// is there a page table for the block this falls under?
+	void *table = x86_pm_get_table(&v, BLOCK_OF(virt), true);
 
-	// reset some state (dirty, accessed)
-	table->pages[table_entry].dirty = 0;
-	table->pages[table_entry].accessed = 0;
+	if(likely(table)) {
+		// this also resets the dirty and accessed bits
+		x86_pm_write(table, TABLE_INDEX(virt), x86_pm_entry_addr(phys) | x86_pm_pte_bits(flags));
+	}
 
-	// assume the page is present in memory
-	table->pages[table_entry].present = !(flags & kPlatformPageNotPresent);
+	x86_pm_lock_give(irq);
 }
 
 /**
@@ -94,72 +718,403 @@ void platform_pm_map(platform_pagetable_t t_in, uintptr_t virt, uintptr_t phys,
  * memory that backs them is not released.
  */
 void platform_pm_unmap(platform_pagetable_t t_in, uintptr_t virt) {
-	// is there a page table for the 4MB region this falls under?
-	page_directory_t *d = (page_directory_t *) t_in;
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
 
-	unsigned int block = virt / 0x400000;
-	ASSERT(d->tables[block]);
+	unsigned int block = BLOCK_OF(virt);
+	ASSERT(x86_pm_read(v.dir, block) & PTE_PRESENT);
 
 	// configure the pagetable entry: not present, address 0
-	page_table_t *table = d->tables[block];
-	int table_entry = (virt & 0x3FFFFF) / 0x1000;
+	void *table = x86_pm_get_table(&v, block, false);
+
+	if(likely(table)) {
+		x86_pm_write(table, TABLE_INDEX(virt), 0);
+	}
 
-	table->pages[table_entry].frame = 0;
-	table->pages[table_entry].present = 0;
+	x86_pm_lock_give(irq);
 }
 
 /**
- * Translates a virtual address in a given pagetable to a physical address.
+ * Maps pages contiguous pages, starting at virt, to the physically contiguous
+ * memory starting at phys. If the pagetable is active, the TLB is updated.
+ *
+ * Entries are written a page table at a time, with the flags converted once.
+ */
+void platform_pm_map_range(platform_pagetable_t t_in, uintptr_t virt,
+						   phys_addr_t phys, size_t pages,
+						   platform_page_flags_t flags) {
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	x86_pte_t bits = x86_pm_pte_bits(flags);
+	uintptr_t addr = virt;
+	size_t left = pages;
+
+	phys = x86_pm_entry_addr(phys);
+
+	while(left) {
+		unsigned int block = BLOCK_OF(addr);
+
+		// Map whole, aligned blocks with a single large page, if possible
+		if(!BLOCK_OFFSET(addr) && !(phys & (BLOCK_SIZE - 1)) && left >= x86_pm_entries &&
+		   (bits & PTE_PRESENT) && x86_pm_can_map_large(&v, block)) {
+			x86_pm_write(v.dir, block, phys | bits | PDE_LARGE);
+
+			addr += BLOCK_SIZE;
+			phys += BLOCK_SIZE;
+			left -= x86_pm_entries;
+
+			continue;
+		}
+
+		void *table = x86_pm_get_table(&v, block, true);
+
+		if(unlikely(!table)) {
+			break;
+		}
+
+		// fill entries until the end of this page table
+		unsigned int entry = TABLE_INDEX(addr);
+		size_t count = x86_pm_entries - entry;
+
+		if(count > left) {
+			count = left;
+		}
+
+		for(size_t i = 0; i < count; i++) {
+			x86_pm_write(table, entry + i, phys | bits);
+			phys += PAGE_SIZE;
+		}
+
+		addr += count * PAGE_SIZE;
+		left -= count;
+	}
+
+	if(x86_pm_needs_invalidate(&v, virt)) {
+		platform_pm_invalidate_range((void *) virt, pages);
+	}
+
+	x86_pm_lock_give(irq);
+}
+
+/**
+ * Unmaps pages contiguous pages, starting at virt. If the pagetable is active,
+ * the TLB is updated. Whatever physical memory that backs them is not released.
+ */
+void platform_pm_unmap_range(platform_pagetable_t t_in, uintptr_t virt,
+							 size_t pages) {
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	uintptr_t addr = virt;
+	size_t left = pages;
+
+	while(left) {
+		unsigned int block = BLOCK_OF(addr);
+
+		unsigned int entry = TABLE_INDEX(addr);
+		size_t count = x86_pm_entries - entry;
+
+		if(count > left) {
+			count = left;
+		}
+
+		// large pages are removed entirely if the whole block is unmapped
+		if(x86_pm_is_large(&v, block) && count == x86_pm_entries) {
+			if(x86_pm_is_kernel_block(block)) {
+				/*
+				 * Put back the (empty) kernel page table it replaced. Large kernel
+				 * pages are split before the kernel's entries are shared, so this
+				 * can only happen while booting.
+				 */
+				ASSERT(!x86_kernel_shared);
+				x86_pm_write(v.dir, block, x86_pm_kernel_table_phys(block) | PDE_TABLE);
+			} else {
+				x86_pm_write(v.dir, block, 0);
+			}
+
+			addr += BLOCK_SIZE;
+			left -= x86_pm_entries;
+
+			continue;
+		}
+
+		// nothing is mapped in blocks without a page table
+		void *table = x86_pm_get_table(&v, block, false);
+
+		if(table) {
+			for(size_t i = 0; i < count; i++) {
+				x86_pm_write(table, entry + i, 0);
+			}
+		}
+
+		addr += count * PAGE_SIZE;
+		left -= count;
+	}
+
+	if(x86_pm_needs_invalidate(&v, virt)) {
+		platform_pm_invalidate_range((void *) virt, pages);
+	}
+
+	x86_pm_lock_give(irq);
+}
+
+/**
+ * Finds the entry that maps the given address: the page table entry, or the
+ * directory entry of a large page. Returns false if the address is in a block
+ * without page table. The paging lock must be held.
  */
-uintptr_t platform_pm_virt_to_phys(platform_pagetable_t t_in, uintptr_t virt) {
-	// find the page table that maps this 4M range
-	page_directory_t *dir = (page_directory_t *) t_in;
-	unsigned int dir_offset = virt / 0x400000;
+static bool x86_pm_lookup(x86_pm_view_t *v, uintptr_t virt, void **table,
+						  unsigned int *index) {
+	unsigned int block = BLOCK_OF(virt);
 
-	// is the table mapped, first of all?
-	if(!dir->tablesPhysical[dir_offset]) {
-		return 0;
+	if(x86_pm_is_large(v, block)) {
+		*table = v->dir;
+		*index = block;
+	} else if(x86_pm_has_table(v, block)) {
+		*table = x86_pm_table(v, block);
+		*index = TABLE_INDEX(virt);
+	} else {
+		return false;
 	}
 
-	// get the pagetable and check if this region is mapped
-	page_table_t *table = dir->tables[dir_offset];
-	unsigned int table_offset = (virt & 0x3FFFFF) / PAGE_SIZE;
+	return true;
+}
+
+/**
+ * Translates a virtual address in a given pagetable to a physical address.
+ */
+phys_addr_t platform_pm_virt_to_phys(platform_pagetable_t t_in, uintptr_t virt) {
+	phys_addr_t physical = 0;
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	void *table;
+	unsigned int index;
+
+	if(x86_pm_lookup(&v, virt, &table, &index)) {
+		x86_pte_t entry = x86_pm_read(table, index);
 
-	if(!table->pages[table_offset].present) {
-		return 0;
+		if(!(entry & PTE_PRESENT)) {
+			// not mapped
+		} else if(table == v.dir) {
+			// large pages map the entire block
+			physical = x86_pm_large_addr(entry) + BLOCK_OFFSET(virt);
+		} else {
+			physical = x86_pm_entry_addr(entry) + (virt & (PAGE_SIZE - 1));
+		}
 	}
 
-	// get the table's physical frame
-	uintptr_t physical = table->pages[table_offset].frame << 12;
-	physical += virt & ~(PAGE_SIZE - 1);
+	x86_pm_lock_give(irq);
 
 	return physical;
 }
 
+/**
+ * Appends the physically contiguous memory at virt to the list of extents,
+ * merging it with the last extent if possible. Returns false if the list is
+ * full.
+ */
+static inline bool x86_pm_extent_add(platform_pm_extent_t *extents, size_t *num,
+									 size_t max, uintptr_t virt, phys_addr_t phys,
+									 size_t length) {
+	if(*num) {
+		platform_pm_extent_t *last = &extents[*num - 1];
+
+		if((last->virt + last->length) == virt && (last->phys + last->length) == phys) {
+			last->length += length;
+			return true;
+		}
+	}
+
+	if(*num == max) {
+		return false;
+	}
+
+	extents[*num].virt = virt;
+	extents[*num].phys = phys;
+	extents[*num].length = length;
+	(*num)++;
+
+	return true;
+}
+
+/**
+ * Translates size bytes, starting at virt, into a list of physically
+ * contiguous extents, in a single walk of the pagetable. Unmapped pages are
+ * skipped. Returns the number of extents written, at most max: if the list is
+ * full, the translation can be resumed at the end of the last extent.
+ */
+size_t platform_pm_translate(platform_pagetable_t t_in, uintptr_t virt,
+							 size_t size, platform_pm_extent_t *extents,
+							 size_t max) {
+	size_t num = 0;
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	uintptr_t addr = virt;
+	uintptr_t end = virt + size;
+
+	while(addr < end) {
+		unsigned int block = BLOCK_OF(addr);
+
+		uintptr_t block_end = (addr - BLOCK_OFFSET(addr)) + BLOCK_SIZE;
+
+		// stop at the end of the range, or the address space
+		if(!block_end || block_end > end) {
+			block_end = end;
+		}
+
+		if(x86_pm_is_large(&v, block)) {
+			phys_addr_t phys = x86_pm_large_addr(x86_pm_read(v.dir, block)) + BLOCK_OFFSET(addr);
+
+			if(!x86_pm_extent_add(extents, &num, max, addr, phys, block_end - addr)) {
+				goto done;
+			}
+		} else if(x86_pm_has_table(&v, block)) {
+			void *table = x86_pm_table(&v, block);
+
+			while(addr < block_end) {
+				x86_pte_t entry = x86_pm_read(table, TABLE_INDEX(addr));
+				uintptr_t page_end = (addr & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+
+				if(page_end > block_end || !page_end) {
+					page_end = block_end;
+				}
+
+				if(entry & PTE_PRESENT) {
+					phys_addr_t phys = x86_pm_entry_addr(entry) + (addr & (PAGE_SIZE - 1));
+
+					if(!x86_pm_extent_add(extents, &num, max, addr, phys, page_end - addr)) {
+						goto done;
+					}
+				}
+
+				addr = page_end;
+			}
+		}
+
+		addr = block_end;
+	}
+
+done:
+	x86_pm_lock_give(irq);
+
+	return num;
+}
+
+/**
+ * Converts the bits of a page table entry to a page's state.
+ */
+static inline platform_page_state_t x86_pm_pte_state(uint32_t entry) {
+	platform_page_state_t state = 0;
+
+	if(entry & PTE_PRESENT) state |= kPlatformPageStatePresent;
+	if(entry & PTE_RW) state |= kPlatformPageStateWritable;
+	if(entry & PTE_ACCESSED) state |= kPlatformPageStateAccessed;
+	if(entry & PTE_DIRTY) state |= kPlatformPageStateDirty;
+
+	return state;
+}
+
+/**
+ * Reports the state of pages contiguous pages, starting at virt, in a single
+ * walk of the pagetable, writing one entry per page into states. The accessed
+ * and dirty bits given in clear are reset atomically as they are read.
+ *
+ * Large pages only have a single set of bits, which is reported for each of
+ * their pages.
+ */
+void platform_pm_scan(platform_pagetable_t t_in, uintptr_t virt, size_t pages,
+					  platform_page_state_t *states,
+					  platform_page_state_t clear) {
+	uint32_t clear_bits = 0;
+	bool cleared = false;
+
+	if(clear & kPlatformPageStateAccessed) clear_bits |= PTE_ACCESSED;
+	if(clear & kPlatformPageStateDirty) clear_bits |= PTE_DIRTY;
+
+	bool irq = x86_pm_lock_take();
+
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	uintptr_t addr = virt;
+	size_t done = 0;
+
+	while(done < pages) {
+		unsigned int block = BLOCK_OF(addr);
+
+		unsigned int entry = TABLE_INDEX(addr);
+		size_t count = x86_pm_entries - entry;
+
+		if(count > (pages - done)) {
+			count = pages - done;
+		}
+
+		if(x86_pm_is_large(&v, block)) {
+			uint32_t pde = x86_pm_fetch_clear(v.dir, block, clear_bits);
+			memset(&states[done], x86_pm_pte_state(pde), count);
+
+			cleared |= (pde & clear_bits);
+		} else if(x86_pm_has_table(&v, block)) {
+			void *table = x86_pm_table(&v, block);
+
+			for(size_t i = 0; i < count; i++) {
+				uint32_t old = x86_pm_fetch_clear(table, entry + i, clear_bits);
+				states[done + i] = x86_pm_pte_state(old);
+
+				cleared |= (old & clear_bits);
+			}
+		} else {
+			memclr(&states[done], count);
+		}
+
+		addr += count * PAGE_SIZE;
+		done += count;
+	}
+
+	// the TLB may cache entries with the bits still set
+	if(cleared && x86_pm_needs_invalidate(&v, virt)) {
+		platform_pm_invalidate_range((void *) virt, pages);
+	}
+
+	x86_pm_lock_give(irq);
+}
+
 /**
  * Check whether a given page has been accessed, i.e. check the dirty bit. If
  * hardware does not support this, this function will return false.
  */
 bool platform_pm_is_dirty(platform_pagetable_t t_in, uintptr_t virt) {
-	// find the page table that maps this 4M range
-	page_directory_t *dir = (page_directory_t *) t_in;
-	unsigned int dir_offset = virt / 0x400000;
+	bool dirty = false;
+	bool irq = x86_pm_lock_take();
 
-	// is the table mapped, first of all?
-	if(!dir->tablesPhysical[dir_offset]) {
-		return false;
-	}
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
 
-	// get the pagetable and check if this region is mapped
-	page_table_t *table = dir->tables[dir_offset];
-	unsigned int table_offset = (virt & 0x3FFFFF) / PAGE_SIZE;
+	// large pages have their dirty bit in the directory entry
+	void *table;
+	unsigned int index;
 
-	if(!table->pages[table_offset].present) {
-		return false;
+	if(x86_pm_lookup(&v, virt, &table, &index)) {
+		x86_pte_t entry = x86_pm_read(table, index);
+		dirty = (entry & PTE_PRESENT) && (entry & PTE_DIRTY);
 	}
 
-	// get the dirty bit's status
-	return table->pages[table_offset].dirty;
+	x86_pm_lock_give(irq);
+
+	return dirty;
 }
 
 /**
@@ -167,47 +1122,68 @@ bool platform_pm_is_dirty(platform_pagetable_t t_in, uintptr_t virt) {
  * nothing happens.
  */
 void platform_pm_clear_dirty(platform_pagetable_t t_in, uintptr_t virt) {
-	// find the page table that maps this 4M range
-	page_directory_t *dir = (page_directory_t *) t_in;
-	unsigned int dir_offset = virt / 0x400000;
+	bool irq = x86_pm_lock_take();
 
-	// is the table mapped, first of all?
-	if(!dir->tablesPhysical[dir_offset]) {
-		return;
-	}
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
 
-	// get the pagetable and check if this region is mapped
-	page_table_t *table = dir->tables[dir_offset];
-	unsigned int table_offset = (virt & 0x3FFFFF) / PAGE_SIZE;
+	void *table;
+	unsigned int index;
 
-	if(!table->pages[table_offset].present) {
-		return;
+	if(x86_pm_lookup(&v, virt, &table, &index) && (x86_pm_read(table, index) & PTE_PRESENT)) {
+		x86_pm_fetch_clear(table, index, PTE_DIRTY);
 	}
 
-	// clear dirty bit
-	table->pages[table_offset].dirty = false;
+	x86_pm_lock_give(irq);
 }
 
 /**
- * Checks if a given address is valid in a page table. This can be evaluated 
+ * Checks if a given address is valid in a page table. This can be evaluated
  * for either user or kernel privileges.
  */
 bool platform_pm_is_valid(platform_pagetable_t t_in, uintptr_t virt, bool user) {
-	// find the page table that maps this 4M range
-	page_directory_t *dir = (page_directory_t *) t_in;
-	unsigned int dir_offset = virt / 0x400000;
+	bool valid = false;
+	bool irq = x86_pm_lock_take();
 
-	// is the table mapped, first of all?
-	if(!dir->tablesPhysical[dir_offset]) {
-		return false;
+	x86_pm_view_t v;
+	x86_pm_view(t_in, &v);
+
+	// large pages carry their permissions in the directory entry
+	void *table;
+	unsigned int index;
+
+	if(x86_pm_lookup(&v, virt, &table, &index)) {
+		x86_pte_t entry = x86_pm_read(table, index);
+		valid = user ? ((entry & PTE_PRESENT) && (entry & PTE_USER)) : (entry & PTE_PRESENT);
 	}
 
-	// get the pagetable and check if this region is mapped
-	page_table_t *table = dir->tables[dir_offset];
-	unsigned int table_offset = (virt & 0x3FFFFF) / PAGE_SIZE;
+	x86_pm_lock_give(irq);
 
-	// is the address valid?
-	return user ? (table->pages[table_offset].present & table->pages[table_offset].user) : table->pages[table_offset].present;
+	return valid;
+}
+
+/**
+ * Switches from the boot code's classic page directory to PAE. The kernel's
+ * directory pointer table shares its page with a classic page directory, into
+ * which the kernel half of the boot directory is copied: CR3 can then point to
+ * it in either mode, and the mode is switched by setting the PAE bit in CR4.
+ */
+static void x86_pm_enable_pae(void) {
+	uintptr_t cr3;
+	__asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
+
+	uint32_t *boot_dir = (uint32_t *) ((cr3 & ~(PAGE_SIZE - 1)) + 0xC0000000);
+
+	for(unsigned int i = (VM_KERNEL_BASE / 0x400000); i < 1024; i++) {
+		x86_system_pdpt[i] = boot_dir[i];
+	}
+
+	__asm__ volatile("mov %0, %%cr3" : : "r" (x86_system_table_phys) : "memory");
+
+	// this also loads the directory pointers from CR3
+	uint32_t cr4;
+	__asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
+	__asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PAE) : "memory");
 }
 
 /**
@@ -215,9 +1191,17 @@ bool platform_pm_is_valid(platform_pagetable_t t_in, uintptr_t virt, bool user)
  * it is the responsibility of the caller to do so.
  */
 void platform_pm_switchto(platform_pagetable_t table) {
-	page_directory_t *d = (page_directory_t *) table;
-	unsigned int addr = d->physAddr;
-	__asm__ volatile("mov %0, %%cr3" : : "r" (addr));
+	uintptr_t addr = (uintptr_t) table;
+
+	if(unlikely(!x86_pm_switched && x86_pm_pae)) {
+		ASSERT(addr == x86_system_table_phys);
+		x86_pm_enable_pae();
+	} else {
+		__asm__ volatile("mov %0, %%cr3" : : "r" (addr) : "memory");
+	}
+
+	// the recursive mapping and temporary slots are now usable
+	x86_pm_switched = true;
 }
 
 /**
@@ -225,7 +1209,38 @@ void platform_pm_switchto(platform_pagetable_t table) {
  */
 void platform_pm_invalidate(void* m) {
     // add memory to clobber list: force optimiser off
-    __asm__ volatile("invlpg %0" : : "m"(m) : "memory");
+    __asm__ volatile("invlpg (%0)" : : "r"(m) : "memory");
+}
+
+/**
+ * Invalidates pages contiguous pages, starting at m, in the MMU's TLB. Large
+ * ranges cause the entire TLB to be flushed instead.
+ */
+void platform_pm_invalidate_range(void* m, size_t pages) {
+	if(pages <= TLB_FLUSH_THRESHOLD) {
+		uintptr_t addr = (uintptr_t) m;
+
+		for(size_t i = 0; i < pages; i++) {
+			__asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+			addr += PAGE_SIZE;
+		}
+	} else {
+		/*
+		 * Reloading CR3 leaves global pages (all kernel mappings) in the
+		 * TLB, so toggle global pages in CR4 instead, which flushes it all.
+		 */
+		uint32_t cr4;
+		__asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
+
+		if(cr4 & (1 << 7)) {
+			__asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~(1 << 7)) : "memory");
+			__asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+		} else {
+			uint32_t cr3;
+			__asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
+			__asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+		}
+	}
 }
 
 /**
@@ -236,9 +1251,21 @@ void x86_pagefault_handler(x86_registers_t reg) {
 	uintptr_t faulting_address;
 	__asm__ volatile("mov %%cr2, %0" : "=r" (faulting_address));
 
-//	bool isUser = reg.err_code & 0x4;
-//	bool isWrite = reg.err_code & 0x2;
-//	bool isPresent = reg.err_code & 0x1;
+	bool isUser = reg.err_code & 0x4;
+	bool isWrite = reg.err_code & 0x2;
+
+	// fetching instructions from a present no-execute page is never valid
+	bool isNoExecute = (reg.err_code & 0x10) && (reg.err_code & 0x1);
+
+	// demand paging and copy-on-write faults are resolved by the VM manager
+	if(!isNoExecute && vm_map_fault(vm_map_current(), faulting_address, isWrite, isUser)) {
+		return;
+	}
+
+	// as are faults on lazily backed kernel memory
+	if(!isNoExecute && !isUser && vmalloc_fault(faulting_address)) {
+		return;
+	}
 
 	KDEBUG("Page fault! (error %u at 0x%X)\n", (unsigned int) reg.err_code, (unsigned int) faulting_address);
 	KERROR("EAX: %08X EBX: %08X ECX: %08X EDX: %08X\n", (unsigned int) reg.eax, (unsigned int) reg.ebx, (unsigned int) reg.ecx, (unsigned int) reg.edx);
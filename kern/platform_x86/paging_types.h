@@ -30,20 +30,15 @@ typedef struct page_table {
 } page_table_t;
 
 /**
- * This structure represents a page table for the x86 architecture. It contains
- * the page directory, as well as some metadata to keep track of the table's
- * whereabouts in physical memory.
+ * An x86 page directory, containing one entry per 4M of the address space.
+ * Each entry holds the physical address of a page table, or maps a 4M page.
  *
- * Note that the first entry in tablesPhysical is not actually a physical
- * pointer to a page table, but rather, the physical location of the array.
+ * Directories are referenced by their physical address: their page tables are
+ * reached through the recursive mapping, rather than through virtual pointers
+ * kept alongside the directory.
  */
 typedef struct page_directory {
-	// Array of pointers to page_table structs.
-	page_table_t* tables[1024];
-	// Physiocal address of tables pointed to by above. See for disclaimer	
-	uintptr_t tablesPhysical[1024];
-
-	uintptr_t physAddr;
+	uint32_t entries[1024];
 } page_directory_t;
 
-#endif
\ No newline at end of file
+#endif
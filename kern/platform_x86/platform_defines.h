@@ -4,4 +4,7 @@
 #define	VM_KERNEL_BASE 0xC0000000
 #define	VM_KERNEL_HEAP_BASE 0xE0000000
 
+// Maximum number of processors that may execute kernel code
+#define	PLATFORM_MAX_CPUS 8
+
 #endif
\ No newline at end of file
@@ -15,6 +15,22 @@ void platform_init(void) {
 	KINFO("Family: %i:%i\n", cpu.manufacturer_info.intel.family, cpu.manufacturer_info.intel.extendedFamily);*/
 }
 
+/**
+ * Returns the index of the processor executing the caller. Application
+ * processors are not started yet, so all kernel code runs on the bootstrap
+ * processor.
+ */
+unsigned int platform_cpu_id(void) {
+	return 0;
+}
+
+/**
+ * Puts the processor into a low power state until the next interrupt.
+ */
+void platform_cpu_idle(void) {
+	__asm__ volatile("hlt");
+}
+
 /**
  * x86 error handler
  */
@@ -1,7 +1,7 @@
 #include "scheduler.h"
 
 #include "vm/kmalloc.h"
-#include "vm/physical.h"
+#include "vm/vmalloc.h"
 
 // this is the shared scheduler lock
 static mutex_t scheduler_lock;
@@ -10,14 +10,6 @@ static mutex_t scheduler_lock;
 static scheduler_pid_t next_pid;
 static scheduler_tid_t next_tid;
 
-// A bitmap indicating which 4K blocks are available for structures.
-static unsigned int* frames;
-static unsigned int nframes;
-
-// Macros used in the bitset algorithms.
-#define INDEX_FROM_BIT(a) (a/(8*4))
-#define OFFSET_FROM_BIT(a) (a%(8*4))
-
 /**
  * Allocates a new process ID. This depends on the scheduler lock.
  */
@@ -40,65 +32,12 @@ static scheduler_tid_t scheduler_new_tid(void) {
 	return next_tid;
 }
 
-/**
- * Set a bit in the frames bitset as used.
- *
- * @param frame Offset into the array
- */
-static inline void set_frame(unsigned int frame) {
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	frames[idx] |= (0x1 << off);
-}
-
-/**
- * Sets a bit in the frames bitset as unused.
- *
- * @param frame Offset in the array.
- */
-/*static void clear_frame(unsigned int frame) {
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	frames[idx] &= ~(0x1 << off);
-}*/
-
-/**
- * Find the first free frame that can be allocated for a structure.
- *
- * @return Offset into the bitset
- */
-static unsigned int find_free_frame() {
-	unsigned int i, j;
-	for(i = 0; i < INDEX_FROM_BIT(nframes); i++) {
-		if(frames[i] != 0xFFFFFFFF) { // nothing free, check next
-			// At least one bit is free here
-			for (j = 0; j < 32; j++) {
-				unsigned int toTest = 0x1 << j;
-
-				// If this frame is free, return
-				if (!(frames[i] & toTest)) {
-					return i*4*8+j;
-				}
-			}
-		}
-	}
-
-	return -1;
-}
-
 /**
  * Initialises the scheduler. This sets up several required data structures and
  * memory segments, and sets up the scheduler to be ready to begin executing.
  */
 void scheduler_init(void) {
-	// Allocate frameset
-	unsigned int nframes = (TCB_END + 1) - TCB_START;
-	nframes /= 0x1000;
-
-	KDEBUG("Scheduler supports %u threads max (sizeof(scheduler_tcb_t) = %u)\n", nframes, (unsigned int) sizeof(scheduler_tcb_t));
-
-	frames = (unsigned int *) kmalloc(INDEX_FROM_BIT(nframes));
-	memclr(frames, INDEX_FROM_BIT(nframes));
+	KDEBUG("sizeof(scheduler_tcb_t) = %u\n", (unsigned int) sizeof(scheduler_tcb_t));
 }
 
 /**
@@ -106,18 +45,13 @@ void scheduler_init(void) {
  * but with no information populated.
  */
 scheduler_pcb_t *scheduler_new_process(void) {
-	unsigned int frame = find_free_frame();
-	set_frame(frame);
-
-	frame *= 0x1000;
-	frame += TCB_START;
+	// allocate the memory for this structure, with guard pages around it
+	scheduler_pcb_t *pcb = (scheduler_pcb_t *) vmalloc(sizeof(scheduler_pcb_t), kVMAllocGuard);
 
-	// allocate the memory for this structure
-	uintptr_t phys = vm_allocate_phys();
-	platform_pm_map(platform_pm_get_kernel_table(), frame, phys, VM_FLAGS_KERNEL);
+	if(unlikely(!pcb)) {
+		return NULL;
+	}
 
-	// allocate the process struct here
-	scheduler_pcb_t *pcb = (scheduler_pcb_t *) frame;
 	pcb->process_id = scheduler_new_pid();
 
 	// allocate a TCB
@@ -136,18 +70,13 @@ scheduler_pcb_t *scheduler_new_process(void) {
  * to the linked list of threads for the given process.
  */
 scheduler_tcb_t *scheduler_new_tcb(scheduler_pcb_t *process) {
-	unsigned int frame = find_free_frame();
-	set_frame(frame);
+	// allocate a thread struct, with guard pages around it
+	scheduler_tcb_t *tcb = (scheduler_tcb_t *) vmalloc(sizeof(scheduler_tcb_t), kVMAllocGuard);
 
-	frame *= 0x1000;
-	frame += TCB_START;
-
-	// allocate the memory for this structure
-	uintptr_t phys = vm_allocate_phys();
-	platform_pm_map(platform_pm_get_kernel_table(), frame, phys, VM_FLAGS_KERNEL);
+	if(unlikely(!tcb)) {
+		return NULL;
+	}
 
-	// allocate a thread struct
-	scheduler_tcb_t *tcb = (scheduler_tcb_t *) frame;
 	tcb->thread_id = scheduler_new_tid();
 
 	// add it to the linked list of threads
@@ -4,9 +4,6 @@
 #include "types.h"
 #include "scheduler_types.h"
 
-#define	TCB_START	0xC4000000
-#define	TCB_END		0xCFFFFFFF
-
 #define MAX_THREADS	4096
 
 /**
@@ -157,12 +157,13 @@ static inline int atomic_add_unless(atomic_t *v, int addend, int u) {
  * Attempts to take a mutex. If the mutex could not be taken, returns -1.
  */
 static inline int mutex_take(mutex_t *m) {
+	// test first, so contended spinning does not keep the bus locked
 	if(atomic_read(m)) {
 		return -1;
-	} else {
-		atomic_xchg(m, 1);
-		return 0;
 	}
+
+	// the exchange is atomic: only one taker can see the mutex as free
+	return atomic_xchg(m, 1) ? -1 : 0;
 }
 
 /**
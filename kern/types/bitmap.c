@@ -0,0 +1,248 @@
+#include <types.h>
+#include "bitmap.h"
+
+#include "vm/kmalloc.h"
+
+// Number of words needed to hold a given number of bits
+#define WORDS_FOR_BITS(a) (((a) + 31) / 32)
+
+/*
+ * Sets the bits past the end of a level, so they never appear to be free.
+ */
+static void bitmap_pad_level(bitmap_t *b, unsigned int level) {
+	unsigned int bits = b->bits[level];
+
+	if(bits % 32) {
+		b->levels[level][bits / 32] |= ~((0x1U << (bits % 32)) - 1);
+	}
+}
+
+/*
+ * Finds the first clear bit in a level, at or after pos. Full words are skipped
+ * by looking for the next non-full word in the level above.
+ */
+static unsigned int bitmap_find_in_level(bitmap_t *b, unsigned int level, unsigned int pos) {
+	if(pos >= b->bits[level]) {
+		return BITMAP_NOT_FOUND;
+	}
+
+	uint32_t *map = b->levels[level];
+	unsigned int w = pos / 32;
+
+	// ignore bits below pos in its word
+	uint32_t word = map[w] | ((0x1U << (pos % 32)) - 1);
+
+	if(word != 0xFFFFFFFF) {
+		return (w * 32) + __builtin_ctz(~word);
+	}
+
+	// the top level is only a single word, so there is nowhere else to look
+	if(level == (b->num_levels - 1)) {
+		return BITMAP_NOT_FOUND;
+	}
+
+	w = bitmap_find_in_level(b, level + 1, w + 1);
+
+	if(w == BITMAP_NOT_FOUND) {
+		return BITMAP_NOT_FOUND;
+	}
+
+	return (w * 32) + __builtin_ctz(~map[w]);
+}
+
+/*
+ * Allocates storage for a bitmap of nbits bits, with all of them either set or
+ * clear. Returns false if memory could not be allocated.
+ */
+bool bitmap_init(bitmap_t *b, unsigned int nbits, bool set) {
+	memclr(b, sizeof(bitmap_t));
+
+	// build levels until the top level fits into a single word
+	unsigned int level = 0;
+	unsigned int total_words = WORDS_FOR_BITS(nbits);
+
+	b->bits[0] = nbits;
+
+	while(WORDS_FOR_BITS(b->bits[level]) > 1 && (level + 1) < BITMAP_MAX_LEVELS) {
+		b->bits[level + 1] = WORDS_FOR_BITS(b->bits[level]);
+		level++;
+
+		total_words += WORDS_FOR_BITS(b->bits[level]);
+	}
+
+	b->num_levels = level + 1;
+
+	// allocate one chunk of memory for all levels
+	uint32_t *storage = (uint32_t *) kmalloc(total_words * sizeof(uint32_t));
+
+	if(!storage) {
+		return false;
+	}
+
+	for(level = 0; level < b->num_levels; level++) {
+		b->levels[level] = storage;
+		storage += WORDS_FOR_BITS(b->bits[level]);
+	}
+
+	// fill the bits, then build each summary level from the one below it
+	memset(b->levels[0], set ? 0xFF : 0x00, WORDS_FOR_BITS(nbits) * sizeof(uint32_t));
+	bitmap_pad_level(b, 0);
+
+	for(level = 1; level < b->num_levels; level++) {
+		memclr(b->levels[level], WORDS_FOR_BITS(b->bits[level]) * sizeof(uint32_t));
+
+		for(unsigned int w = 0; w < b->bits[level]; w++) {
+			if(b->levels[level - 1][w] == 0xFFFFFFFF) {
+				b->levels[level][w / 32] |= (0x1U << (w % 32));
+			}
+		}
+
+		bitmap_pad_level(b, level);
+	}
+
+	return true;
+}
+
+/*
+ * Returns the number of bytes of storage bitmap_init allocates for a bitmap of
+ * nbits bits, including its summary levels.
+ */
+size_t bitmap_storage_size(unsigned int nbits) {
+	unsigned int bits = nbits;
+	unsigned int total_words = WORDS_FOR_BITS(bits);
+
+	for(unsigned int level = 1; WORDS_FOR_BITS(bits) > 1 && level < BITMAP_MAX_LEVELS; level++) {
+		bits = WORDS_FOR_BITS(bits);
+		total_words += WORDS_FOR_BITS(bits);
+	}
+
+	return total_words * sizeof(uint32_t);
+}
+
+/*
+ * Releases the storage of a bitmap.
+ */
+void bitmap_destroy(bitmap_t *b) {
+	kfree(b->levels[0]);
+	memclr(b, sizeof(bitmap_t));
+}
+
+/*
+ * Sets a bit. If this fills up its word, the word is marked as full in the
+ * summary above it, and so on.
+ */
+void bitmap_set(bitmap_t *b, unsigned int bit) {
+	for(unsigned int level = 0; level < b->num_levels; level++) {
+		unsigned int w = bit / 32;
+		b->levels[level][w] |= (0x1U << (bit % 32));
+
+		if(b->levels[level][w] != 0xFFFFFFFF) {
+			break;
+		}
+
+		bit = w;
+	}
+}
+
+/*
+ * Clears a bit. If its word was full, the summary levels are updated to
+ * indicate the word has free bits.
+ */
+void bitmap_clear(bitmap_t *b, unsigned int bit) {
+	for(unsigned int level = 0; level < b->num_levels; level++) {
+		unsigned int w = bit / 32;
+		bool was_full = (b->levels[level][w] == 0xFFFFFFFF);
+
+		b->levels[level][w] &= ~(0x1U << (bit % 32));
+
+		if(!was_full) {
+			break;
+		}
+
+		bit = w;
+	}
+}
+
+/*
+ * Sets count bits, beginning with start.
+ */
+void bitmap_set_range(bitmap_t *b, unsigned int start, unsigned int count) {
+	for(unsigned int i = start; i < (start + count); i++) {
+		bitmap_set(b, i);
+	}
+}
+
+/*
+ * Clears count bits, beginning with start.
+ */
+void bitmap_clear_range(bitmap_t *b, unsigned int start, unsigned int count) {
+	for(unsigned int i = start; i < (start + count); i++) {
+		bitmap_clear(b, i);
+	}
+}
+
+/*
+ * Returns the index of the first clear bit, or BITMAP_NOT_FOUND.
+ */
+unsigned int bitmap_find_clear(bitmap_t *b) {
+	return bitmap_find_in_level(b, 0, 0);
+}
+
+/*
+ * Returns the index of the first clear bit at or after start, or
+ * BITMAP_NOT_FOUND.
+ */
+unsigned int bitmap_find_clear_from(bitmap_t *b, unsigned int start) {
+	return bitmap_find_in_level(b, 0, start);
+}
+
+/*
+ * Returns the index of the first set bit in [start, limit), or limit if all of
+ * those bits are clear.
+ */
+static unsigned int bitmap_find_set_before(bitmap_t *b, unsigned int start, unsigned int limit) {
+	unsigned int i = start;
+
+	while(i < limit) {
+		unsigned int w = i / 32;
+		uint32_t word = b->levels[0][w] >> (i % 32);
+
+		if(word) {
+			i += __builtin_ctz(word);
+			return (i < limit) ? i : limit;
+		}
+
+		i = (w + 1) * 32;
+	}
+
+	return limit;
+}
+
+/*
+ * Finds the first run of count consecutive clear bits, and returns the index
+ * of the first bit in the run, or BITMAP_NOT_FOUND.
+ */
+unsigned int bitmap_find_clear_run(bitmap_t *b, unsigned int count) {
+	unsigned int pos = 0;
+
+	if(unlikely(!count)) {
+		return BITMAP_NOT_FOUND;
+	}
+
+	while(true) {
+		unsigned int start = bitmap_find_in_level(b, 0, pos);
+
+		if(start == BITMAP_NOT_FOUND || (start + count) > b->bits[0]) {
+			return BITMAP_NOT_FOUND;
+		}
+
+		// is the run long enough? if not, continue after the bit that ended it
+		unsigned int end = bitmap_find_set_before(b, start, start + count);
+
+		if(end == (start + count)) {
+			return start;
+		}
+
+		pos = end + 1;
+	}
+}
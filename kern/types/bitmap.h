@@ -0,0 +1,53 @@
+/*
+ * Bitmap with a hierarchy of summary levels, for quickly finding clear bits.
+ *
+ * Level 0 holds the bits themselves. Each bit in level n + 1 is set when the
+ * corresponding 32-bit word in level n is completely full, so finding the next
+ * clear bit only needs one bsf per level, rather than a scan over the entire
+ * bitmap. Levels are added until the topmost level is a single word.
+ */
+#ifndef TYPES_BITMAP_H
+#define TYPES_BITMAP_H
+
+#include <types.h>
+
+// Maximum number of levels; enough for 2^32 bits.
+#define	BITMAP_MAX_LEVELS	7
+
+// Returned by the search functions if no suitable bits could be found.
+#define	BITMAP_NOT_FOUND	0xFFFFFFFF
+
+typedef struct bitmap {
+	// words making up each level, with level 0 being the actual bits
+	uint32_t *levels[BITMAP_MAX_LEVELS];
+
+	// number of valid bits in each level
+	unsigned int bits[BITMAP_MAX_LEVELS];
+
+	unsigned int num_levels;
+} bitmap_t;
+
+// Initialisation and deallocation
+bool bitmap_init(bitmap_t *b, unsigned int nbits, bool set);
+void bitmap_destroy(bitmap_t *b);
+size_t bitmap_storage_size(unsigned int nbits);
+
+// Bit manipulation
+void bitmap_set(bitmap_t *b, unsigned int bit);
+void bitmap_clear(bitmap_t *b, unsigned int bit);
+void bitmap_set_range(bitmap_t *b, unsigned int start, unsigned int count);
+void bitmap_clear_range(bitmap_t *b, unsigned int start, unsigned int count);
+
+// Searching
+unsigned int bitmap_find_clear(bitmap_t *b);
+unsigned int bitmap_find_clear_from(bitmap_t *b, unsigned int start);
+unsigned int bitmap_find_clear_run(bitmap_t *b, unsigned int count);
+
+/*
+ * Tests whether a bit is set.
+ */
+static inline bool bitmap_test(bitmap_t *b, unsigned int bit) {
+	return (b->levels[0][bit / 32] & (0x1 << (bit % 32))) != 0;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #import <types.h>
 
 #import "hashmap.h"
+#import "vm/kmalloc.h"
 
 /*
  * The default hash function used by the hash table implementation. Based on the
@@ -205,7 +206,8 @@ void* hashmap_get(hashmap_t* hashmap, void* key) {
 
 /*
  * Removes an entry from the hashmap, releasing the memory associated with the
- * key as well.
+ * key as well. Returns 0 if the entry was removed, or -1 if the key wasn't in
+ * the hashmap.
  */
 int hashmap_delete(hashmap_t* hashmap, void* key) {
 	ASSERT(hashmap);
@@ -238,5 +240,5 @@ int hashmap_delete(hashmap_t* hashmap, void* key) {
 	}
 
 	// The key couldn't be found in the hashmap
-	return ENOTFOUND;
+	return -1;
 }
\ No newline at end of file
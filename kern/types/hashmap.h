@@ -54,4 +54,6 @@ void hashmap_release(hashmap_t*);
 // Hashmap's content manipulation
 void hashmap_insert(hashmap_t*, void*, void*);
 void* hashmap_get(hashmap_t*, void*);
+
+// Returns 0 on success, or -1 if the key isn't in the hashmap
 int hashmap_delete(hashmap_t*, void*);
\ No newline at end of file
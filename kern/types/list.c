@@ -1,5 +1,6 @@
 #import <types.h>
 #import "list.h"
+#import "vm/kmalloc.h"
 
 /*
  * Traverses the list for the first free entry.
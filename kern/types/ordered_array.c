@@ -1,5 +1,6 @@
 #import <types.h>
 #import "ordered_array.h"
+#import "vm/kmalloc.h"
 
 int8_t standard_lessthan_predicate(type_t a, type_t b) {
 	return (a < b) ? 1 : 0;
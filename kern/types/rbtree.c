@@ -0,0 +1,326 @@
+#include <types.h>
+#include "rbtree.h"
+
+/*
+ * Replaces the link from old's parent (or the root) to old with one to new.
+ */
+static inline void rbtree_replace_child(rbtree_t *tree, rbtree_node_t *old,
+										rbtree_node_t *new, rbtree_node_t *parent) {
+	if(!parent) {
+		tree->root = new;
+	} else if(parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+}
+
+/*
+ * Rotates the subtree at node to the left: its right child takes its place.
+ */
+static void rbtree_rotate_left(rbtree_t *tree, rbtree_node_t *node) {
+	rbtree_node_t *child = node->right;
+
+	node->right = child->left;
+
+	if(child->left) {
+		child->left->parent = node;
+	}
+
+	child->parent = node->parent;
+	rbtree_replace_child(tree, node, child, node->parent);
+
+	child->left = node;
+	node->parent = child;
+}
+
+/*
+ * Rotates the subtree at node to the right: its left child takes its place.
+ */
+static void rbtree_rotate_right(rbtree_t *tree, rbtree_node_t *node) {
+	rbtree_node_t *child = node->left;
+
+	node->left = child->right;
+
+	if(child->right) {
+		child->right->parent = node;
+	}
+
+	child->parent = node->parent;
+	rbtree_replace_child(tree, node, child, node->parent);
+
+	child->right = node;
+	node->parent = child;
+}
+
+/*
+ * Links a node into the tree at the given link, which is either &parent->left
+ * or &parent->right (or &tree->root if parent is NULL) and must be empty, then
+ * rebalances the tree.
+ */
+void rbtree_insert(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent,
+				   rbtree_node_t **link) {
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->red = true;
+
+	*link = node;
+
+	// fix up any red node with a red parent
+	while((parent = node->parent) && parent->red) {
+		rbtree_node_t *grandparent = parent->parent;
+
+		if(parent == grandparent->left) {
+			rbtree_node_t *uncle = grandparent->right;
+
+			// red uncle: recolour, and continue further up
+			if(uncle && uncle->red) {
+				parent->red = uncle->red = false;
+				grandparent->red = true;
+
+				node = grandparent;
+				continue;
+			}
+
+			// node is an inner child: rotate it to the outside first
+			if(node == parent->right) {
+				rbtree_rotate_left(tree, parent);
+
+				node = parent;
+				parent = node->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			rbtree_rotate_right(tree, grandparent);
+		} else {
+			rbtree_node_t *uncle = grandparent->left;
+
+			if(uncle && uncle->red) {
+				parent->red = uncle->red = false;
+				grandparent->red = true;
+
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->left) {
+				rbtree_rotate_right(tree, parent);
+
+				node = parent;
+				parent = node->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			rbtree_rotate_left(tree, grandparent);
+		}
+	}
+
+	tree->root->red = false;
+}
+
+/*
+ * Restores the tree's balance after a black node was removed from below
+ * parent, leaving node (which may be NULL) one black node short.
+ */
+static void rbtree_remove_fixup(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent) {
+	while(node != tree->root && (!node || !node->red)) {
+		if(node == parent->left) {
+			rbtree_node_t *sibling = parent->right;
+
+			if(sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rbtree_rotate_left(tree, parent);
+
+				sibling = parent->right;
+			}
+
+			if((!sibling->left || !sibling->left->red) &&
+			   (!sibling->right || !sibling->right->red)) {
+				sibling->red = true;
+
+				node = parent;
+				parent = node->parent;
+			} else {
+				if(!sibling->right || !sibling->right->red) {
+					sibling->left->red = false;
+					sibling->red = true;
+					rbtree_rotate_right(tree, sibling);
+
+					sibling = parent->right;
+				}
+
+				sibling->red = parent->red;
+				parent->red = false;
+				sibling->right->red = false;
+				rbtree_rotate_left(tree, parent);
+
+				node = tree->root;
+			}
+		} else {
+			rbtree_node_t *sibling = parent->left;
+
+			if(sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rbtree_rotate_right(tree, parent);
+
+				sibling = parent->left;
+			}
+
+			if((!sibling->left || !sibling->left->red) &&
+			   (!sibling->right || !sibling->right->red)) {
+				sibling->red = true;
+
+				node = parent;
+				parent = node->parent;
+			} else {
+				if(!sibling->left || !sibling->left->red) {
+					sibling->right->red = false;
+					sibling->red = true;
+					rbtree_rotate_left(tree, sibling);
+
+					sibling = parent->left;
+				}
+
+				sibling->red = parent->red;
+				parent->red = false;
+				sibling->left->red = false;
+				rbtree_rotate_right(tree, parent);
+
+				node = tree->root;
+			}
+		}
+	}
+
+	if(node) {
+		node->red = false;
+	}
+}
+
+/*
+ * Removes a node from the tree, and rebalances it.
+ */
+void rbtree_remove(rbtree_t *tree, rbtree_node_t *node) {
+	rbtree_node_t *child, *parent;
+	bool red;
+
+	if(node->left && node->right) {
+		// two children: the in-order successor takes the node's place
+		rbtree_node_t *next = node->right;
+
+		while(next->left) {
+			next = next->left;
+		}
+
+		child = next->right;
+		parent = next->parent;
+		red = next->red;
+
+		// unlink the successor from its old position
+		if(parent == node) {
+			parent = next;
+		} else {
+			if(child) {
+				child->parent = parent;
+			}
+
+			parent->left = child;
+
+			next->right = node->right;
+			node->right->parent = next;
+		}
+
+		// and put it where the node was
+		next->parent = node->parent;
+		next->left = node->left;
+		next->red = node->red;
+
+		node->left->parent = next;
+		rbtree_replace_child(tree, node, next, node->parent);
+	} else {
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		red = node->red;
+
+		if(child) {
+			child->parent = parent;
+		}
+
+		rbtree_replace_child(tree, node, child, parent);
+	}
+
+	if(!red) {
+		rbtree_remove_fixup(tree, child, parent);
+	}
+}
+
+/*
+ * Returns the first (leftmost) node in the tree, or NULL if it is empty.
+ */
+rbtree_node_t *rbtree_first(rbtree_t *tree) {
+	rbtree_node_t *node = tree->root;
+
+	while(node && node->left) {
+		node = node->left;
+	}
+
+	return node;
+}
+
+/*
+ * Returns the last (rightmost) node in the tree, or NULL if it is empty.
+ */
+rbtree_node_t *rbtree_last(rbtree_t *tree) {
+	rbtree_node_t *node = tree->root;
+
+	while(node && node->right) {
+		node = node->right;
+	}
+
+	return node;
+}
+
+/*
+ * Returns the node following the given node, or NULL if it is the last.
+ */
+rbtree_node_t *rbtree_next(rbtree_node_t *node) {
+	if(node->right) {
+		node = node->right;
+
+		while(node->left) {
+			node = node->left;
+		}
+
+		return node;
+	}
+
+	while(node->parent && node == node->parent->right) {
+		node = node->parent;
+	}
+
+	return node->parent;
+}
+
+/*
+ * Returns the node preceding the given node, or NULL if it is the first.
+ */
+rbtree_node_t *rbtree_prev(rbtree_node_t *node) {
+	if(node->left) {
+		node = node->left;
+
+		while(node->right) {
+			node = node->right;
+		}
+
+		return node;
+	}
+
+	while(node->parent && node == node->parent->left) {
+		node = node->parent;
+	}
+
+	return node->parent;
+}
@@ -0,0 +1,43 @@
+/*
+ * Intrusive red-black tree.
+ *
+ * Nodes are embedded in the structures that are kept in the tree, so the tree
+ * never allocates memory. The tree does not know how nodes are ordered: to
+ * insert a node, the caller walks down from the root to find the empty link it
+ * belongs in, and then calls rbtree_insert to link it and rebalance. Lookups
+ * are done the same way, so any key (or ranges of keys) can be used.
+ */
+#ifndef TYPES_RBTREE_H
+#define TYPES_RBTREE_H
+
+#include <types.h>
+
+typedef struct rbtree_node rbtree_node_t;
+
+struct rbtree_node {
+	rbtree_node_t *parent;
+	rbtree_node_t *left, *right;
+
+	bool red;
+};
+
+typedef struct rbtree {
+	rbtree_node_t *root;
+} rbtree_t;
+
+// Gets the structure that contains the given node
+#define	rbtree_entry(node, type, member) \
+		((type *) (((char *) (node)) - __builtin_offsetof(type, member)))
+
+// Tree manipulation
+void rbtree_insert(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent,
+				   rbtree_node_t **link);
+void rbtree_remove(rbtree_t *tree, rbtree_node_t *node);
+
+// Traversal in order
+rbtree_node_t *rbtree_first(rbtree_t *tree);
+rbtree_node_t *rbtree_last(rbtree_t *tree);
+rbtree_node_t *rbtree_next(rbtree_node_t *node);
+rbtree_node_t *rbtree_prev(rbtree_node_t *node);
+
+#endif
@@ -1,18 +1,82 @@
 #include "kheap.h"
+#include "kmalloc.h"
 
 #include "vm.h"
 #include "physical.h"
+#include "slab.h"
+#include "vmalloc.h"
 
 #include "pexpert/platform.h"
 
 #define DEBUG_NULL_FREE 0
 #define DEBUG_PAGE_ALLOCATION 0
 
+// Record the call sites of allocations
+#define KHEAP_PROFILE 1
+
+// Check allocations for corruption: this may also be set from the build flags
+#ifndef KHEAP_HARDEN
+#define KHEAP_HARDEN 0
+#endif
+
 //#define DEBUG 1
 
 // end of kernel address
 extern char __kern_end;
 
+// Number of physical extents translated at once when releasing memory
+#define	ALLOCATOR_FREE_EXTENTS	8
+
+/*
+ * Empty major blocks of the default size are kept for reuse, up to this many,
+ * rather than released right away, so that a heap that hovers around a block
+ * boundary doesn't map and unmap pages on every other allocation. Those that
+ * go unused for this many idle passes of the processor are released anyway.
+ */
+#define	ALLOCATOR_RETAIN_MAJORS	2
+#define	ALLOCATOR_RETAIN_IDLE	64
+
+/*
+ * Each CPU records allocations in its own hash table of call sites, so that
+ * profiling needs neither locks nor atomic operations. Sites that can't be
+ * placed within a few probes of their hash are counted together.
+ */
+#define	KHEAP_PROFILE_BITS		6
+#define	KHEAP_PROFILE_SITES		(1 << KHEAP_PROFILE_BITS)
+#define	KHEAP_PROFILE_PROBES	4
+
+// Number of sites printed by kheap_dump_stats
+#define	KHEAP_DUMP_SITES		8
+
+/*
+ * In hardened mode, objects that aren't page aligned are surrounded by
+ * redzones, which are checked when they are freed. Freed objects are poisoned
+ * and held in a quarantine for a while before they are really released; the
+ * poison is checked then, to catch writes after free. One in about every
+ * KHEAP_GUARD_SAMPLE allocations instead gets a page of its own, placed right
+ * before an unmapped guard page, which stays reserved, but unmapped, while the
+ * object is in quarantine: overruns and uses after free fault right away.
+ */
+#define	KHEAP_REDZONE			16
+#define	KHEAP_REDZONE_BYTE		0xFB
+#define	KHEAP_REDZONE_WORD		0xFBFBFBFB
+#define	KHEAP_POISON_BYTE		0x6B
+#define	KHEAP_POISON_WORD		0x6B6B6B6B
+
+#define	KHEAP_MAGIC_LIVE		'LIVE'
+#define	KHEAP_MAGIC_GUARD		'GARD'
+#define	KHEAP_MAGIC_FREE		'FREE'
+
+#define	KHEAP_QUARANTINE_SIZE	32
+#define	KHEAP_GUARD_SAMPLE		1024
+#define	KHEAP_GUARD_MAX			32
+
+/*
+ * Requests of at least this many bytes are given whole pages of their own,
+ * straight from vmalloc, rather than being carved out of a major block.
+ */
+#define	KHEAP_LARGE_SIZE		0x1000
+
 // Config options for allocator
 // Alignment enforced for memory
 #define ALIGNMENT		16ul
@@ -62,6 +126,11 @@ struct allocator_major {
 	unsigned int size;
 	unsigned int usage;
 	struct allocator_minor *first;
+
+	// memory is still zeroed, as the block has never been used
+	bool zeroed;
+	// idle passes for which the block has been retained while empty
+	unsigned int idle;
 };
 
 /*
@@ -80,6 +149,8 @@ struct allocator_minor {
 // Allocator state
 static struct allocator_major *l_memRoot = NULL; // root memory vlock from system
 static struct allocator_major *l_bestBet = NULL; // Major block with most free memory
+static struct allocator_major *l_retained = NULL; // Empty blocks kept for reuse
+static unsigned int l_numRetained = 0; // number of retained blocks
 
 static unsigned int l_pageSize = 4096; // size of a page
 static unsigned int l_pageCount = 16; // pages to request per chunk
@@ -90,15 +161,19 @@ static long long l_warningCount = 0; // warnings
 static long long l_errorCount = 0; // errors
 static long long l_possibleOverruns = 0; // possible overruns
 
-// Bitmap macros
-#define INDEX_FROM_BIT(a) (a/(8*4))
-#define OFFSET_FROM_BIT(a) (a%(8*4))
-
 // Internal functions
-void *kheap_smart_alloc(size_t size, bool aligned, uintptr_t *phys);
+void *kheap_smart_alloc(size_t size, kmalloc_flags_t flags, phys_addr_t *phys);
+
+// Page allocator
+static int allocator_free(void *mem, size_t pages);
+
+// Heap hardening
+#if KHEAP_HARDEN
+static bool kheap_harden_free(void *, void *);
+#endif
 
 // Memory allocator
-static void *lalloc_malloc(size_t);
+static void *lalloc_malloc(size_t, bool *);
 static void *lalloc_realloc(void *, size_t);
 static void *lalloc_calloc(size_t, size_t);
 static void lalloc_free(void *);
@@ -108,7 +183,65 @@ heap_t *kernel_heap = NULL;
 platform_pagetable_t kernel_table;
 
 static unsigned int nframes;
-static uint32_t *heap_frames;
+static bitmap_t heap_frames;
+
+// Bitmap of heap pages that are owned by the slab allocator
+static bitmap_t slab_frames;
+
+#if KHEAP_HARDEN
+/*
+ * Header in front of every object with redzones. Its last word is part of the
+ * redzone in front of the object; the object is followed by KHEAP_REDZONE
+ * bytes of redzone, or, for guarded objects, by the rest of the page.
+ */
+typedef struct {
+	// call site that allocated the object
+	void *site;
+	// bytes requested
+	uint32_t size;
+
+	uint32_t magic;
+	uint32_t redzone;
+} kheap_header_t;
+
+// Quarantine and sampling state, one per CPU; updated with interrupts masked
+typedef struct {
+	// freed objects, oldest first starting at next
+	void *quarantine[KHEAP_QUARANTINE_SIZE];
+	unsigned int next;
+
+	// allocations left until the next guarded one, and the sampling PRNG
+	unsigned int countdown;
+	uint32_t random;
+
+	// guarded objects allocated less those released, on this CPU
+	int guarded;
+
+	// objects allocated with guard pages
+	unsigned int guarded_total;
+
+	// damaged redzones or poison, and frees of objects that aren't live
+	unsigned int corruptions;
+	unsigned int bad_frees;
+} kheap_harden_cpu_t;
+
+static kheap_harden_cpu_t kheap_harden[PLATFORM_MAX_CPUS];
+#endif
+
+#if KHEAP_PROFILE
+// Call site tables, one per CPU, and the allocations that fit in none
+static struct {
+	kheap_site_stats_t sites[KHEAP_PROFILE_SITES];
+	kheap_site_stats_t other;
+} kheap_profiles[PLATFORM_MAX_CPUS];
+#endif
+
+/*
+ * Protects liballoc's blocks and the heap's page bitmaps, along with the
+ * interrupt state of the processor holding it.
+ */
+static mutex_t heap_lock;
+static bool heap_lock_irq;
 
 /**
  * Overall state of the memory allocator. This encapsulates the state of both
@@ -131,20 +264,25 @@ static struct {
 static void set_frame(unsigned int frame_addr) {
 	// kprintf("set_frame 0x%08X ", frame_addr);
 
-	unsigned int frame = frame_addr / 0x1000;
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	heap_frames[idx] |= (0x1 << off);
+	bitmap_set(&heap_frames, frame_addr / 0x1000);
 }
 
 /*
  * Clear a bit in the heap_frames bitset
  */
 static void clear_frame(unsigned int frame_addr) {
-	unsigned int frame = frame_addr / 0x1000;
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	heap_frames[idx] &= ~(0x1 << off);
+	bitmap_clear(&heap_frames, frame_addr / 0x1000);
+}
+
+/*
+ * Checks whether an address on the kernel heap lies in a slab page.
+ */
+static inline bool is_slab_page(uintptr_t address) {
+	if(unlikely(address < kernel_heap->start_address || address > kernel_heap->end_address)) {
+		return false;
+	}
+
+	return bitmap_test(&slab_frames, (address - kernel_heap->start_address) / 0x1000);
 }
 
 /*
@@ -168,67 +306,90 @@ void kheap_install() {
 	unsigned int size = 0x10000000;
 	nframes = size / 0x1000;
 
-	heap_frames = kmalloc(INDEX_FROM_BIT(nframes));
-	memclr(heap_frames, INDEX_FROM_BIT(nframes));
+	bool allocated = bitmap_init(&heap_frames, nframes, false);
+	allocated &= bitmap_init(&slab_frames, nframes, false);
+	ASSERT(allocated);
 
 	// Start address
-	heap->start_address = 0xE0000000;
-	heap->end_address = 0xEFFFFFFF;
+	heap->start_address = VM_KERNEL_HEAP_BASE;
+	heap->end_address = VM_KERNEL_HEAP_BASE + size - 1;
 
 	// Finish.
 	kernel_heap = heap;
 
 	// Enable the smart allocator
 	state.use_smart_mapper = true;
+
+	// Set up the small object caches
+	slab_init();
+
+	// Large allocations are served directly by vmalloc
+	vmalloc_init();
 }
 
 /*
  * Allocates a continuous block of memory on the specified heap.
  *
  * @param size Number of bytes to allocate
- * @param aligned Whether the allocation should be aligned to page boundaries
+ * @param flags Requirements the memory must satisfy
  * @param phys Pointer to memory to store the physical address in
  * @return Pointer to memory, or NULL if error.
  */
-void *kheap_smart_alloc(size_t size, bool aligned, uintptr_t *phys) {
+void *kheap_smart_alloc(size_t size, kmalloc_flags_t flags, phys_addr_t *phys) {
 	uintptr_t ptr;
 
-	// Handle unaligned memory accesses
-	if(likely(!aligned)) {
-		ptr = (uintptr_t) lalloc_malloc(size);
-		memclr((void *) ptr, size);
+	/*
+	 * Multi-page and aligned requests get pages of their own: these are
+	 * page aligned, and backed by frames that are already zeroed if needed.
+	 * Objects from liballoc may straddle pages, so they can't be used if the
+	 * memory must be physically contiguous; slab objects never do.
+	 */
+	if(unlikely((flags & kMallocAligned) || size >= KHEAP_LARGE_SIZE ||
+				((flags & kMallocContiguous) && size > SLAB_MAX_SIZE))) {
+		vmalloc_flags_t vflags = 0;
+
+		if(!(flags & kMallocZero)) vflags |= kVMAllocNoZero;
+		if(flags & kMallocContiguous) vflags |= kVMAllocContiguous;
+
+		ptr = (uintptr_t) vmalloc(size, vflags);
 
-		// Handle an out of memory condition
 		if(!ptr) {
 			return NULL;
 		}
+	} else {
+		bool fresh = false;
 
-		// KWARNING("SCHREIBKUGEL ALLOC sized 0x%08X at 0x%08X", size, ptr);
-	} else { // This allocation must be aligned
-		// First, try to see if the allocation we get back is already page aligned
-		ptr = (uintptr_t) lalloc_malloc(size);
+		// Small objects come from the slab caches
+		if(likely(size <= SLAB_MAX_SIZE)) {
+			ptr = (uintptr_t) slab_alloc_sized(size);
+		} else {
+			ptr = (uintptr_t) lalloc_malloc(size, &fresh);
+		}
 
-		// If it isn't, re-allocate it plus 0x1000
-		if(likely(ptr & 0x00000FFF)) {
-			ptr = (uintptr_t) krealloc((void *) ptr, size + 0x1000);
-			memclr((void *) ptr, size + 0x1000);
+		// Handle an out of memory condition
+		if(!ptr) {
+			return NULL;
+		}
 
-			ptr += 0x1000;
-			ptr &= 0xFFFFF000;
-		} else {
+		// memory in a brand new major block is still zeroed
+		if((flags & kMallocZero) && !fresh) {
 			memclr((void *) ptr, size);
 		}
+
+		// KWARNING("SCHREIBKUGEL ALLOC sized 0x%08X at 0x%08X", size, ptr);
 	}
 
 	// Do we want the physical address?
 	if(phys) {
-		uintptr_t physical = platform_pm_virt_to_phys(kernel_table, ptr & 0xFFFFF000);
+		phys_addr_t physical = platform_pm_virt_to_phys(kernel_table, ptr & 0xFFFFF000);
 		*phys = physical | (ptr & 0x00000FFF);
 	}
 
 	return (void *) ptr;
 }
 
+static void kheap_free(void *address);
+
 /*
  * Deallocates a chunk of previously-allocated memory.
  *
@@ -243,129 +404,518 @@ void kfree(void* address) {
 	}
 #endif
 
+#if KHEAP_HARDEN
+	if(address && kheap_harden_free(address, __builtin_return_address(0))) {
+		return;
+	}
+#endif
+
+	kheap_free(address);
+}
+
+/*
+ * Returns memory to whichever allocator it came from.
+ */
+static void kheap_free(void *address) {
+	// small objects go back to their slab
+	if(likely(is_slab_page((uintptr_t) address))) {
+		slab_free(address);
+		return;
+	}
+
+	// large objects were allocated by vmalloc
+	if(vmalloc_owns(address)) {
+		vfree(address);
+		return;
+	}
+
 	// liballoc
 	lalloc_free(address);
 //	KERROR("SCHREIBKUGEL DEALLOC at 0x%08X\n", (unsigned int) address);
 }
-/**
- * Allocates a chunk of memory, at least s bytes in size. Returns NULL if the
- * memory could not be made available.
+/*
+ * Allocates memory from the dumb heap, directly following the kernel. This
+ * memory is never released, and is always physically contiguous.
  */
-void *kmalloc(size_t s) {
-	if(likely(state.use_smart_mapper)) {
-		return kheap_smart_alloc(s, false, NULL);
-	} else {
-		// is the start placement address configured?
-		if(!state.s.dumb.start_placement) {
-			state.s.dumb.start_placement = (uintptr_t) &__kern_end;
-		}
+static void *kheap_dumb_alloc(size_t s, kmalloc_flags_t flags, phys_addr_t *physical) {
+	// is the start placement address configured?
+	if(!state.s.dumb.start_placement) {
+		state.s.dumb.start_placement = (uintptr_t) &__kern_end;
+	}
 
-		// align s on 16-byte boundaries
-		if(s & 0x0F) {
-			s &= 0xFFFFFFF0;
-			s += 0x10;
-		}
+	// align size on 16-byte boundaries
+	if(s & 0x0F) {
+		s &= 0xFFFFFFF0;
+		s += 0x10;
+	}
+
+	// align to page bounds, if requested
+	if((flags & kMallocAligned) && (state.s.dumb.start_placement & 0xFFF)) {
+		state.s.dumb.start_placement += 0x1000 - (state.s.dumb.start_placement & 0xFFF);
+	}
 
-		// get address and increment
-		uintptr_t address = state.s.dumb.start_placement;
+	// get address and increment
+	uintptr_t address = state.s.dumb.start_placement;
 
-		state.s.dumb.start_placement += s;
-		state.s.dumb.bytes_allocated += s;
+	state.s.dumb.start_placement += s;
+	state.s.dumb.bytes_allocated += s;
 
-		return (void *) address;
+	// anything past the boot mapping would wrap around onto low memory
+	ASSERT(state.s.dumb.start_placement <= platform_pm_boot_map_end());
+
+	// convert to physical
+	if(physical) {
+		*physical = address - 0xC0000000;
 	}
 
-	return NULL;
+	if(flags & kMallocZero) {
+		memclr((void *) address, s);
+	}
+
+	return (void *) address;
 }
 
+#if KHEAP_PROFILE
 /*
- * Allocates a chunk of memory and gets physical address.
- *
- * @param sz Size of memory to allocate
- * @param phys Pointer to memory to place physical address in
+ * Records an allocation of size bytes, made from the given call site, in the
+ * current CPU's table.
  */
-void *kmalloc_p(size_t s, uintptr_t *physical) {
-	if(likely(state.use_smart_mapper)) {
-		return kheap_smart_alloc(s, false, physical);		
-	} else {
-		// is the start placement address configured?
-		if(!state.s.dumb.start_placement) {
-			state.s.dumb.start_placement = (uintptr_t) &__kern_end;
-		}
+static void kheap_profile(void *site, size_t size) {
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
 
-		// align size on 16-byte boundaries
-		if(s & 0x0F) {
-			s &= 0xFFFFFFF0;
-			s += 0x10;
+	kheap_site_stats_t *entry = &kheap_profiles[platform_cpu_id()].other;
+	kheap_site_stats_t *sites = kheap_profiles[platform_cpu_id()].sites;
+
+	// multiplicative hash of the return address
+	unsigned int hash = (((uintptr_t) site) * 2654435761U) >> (32 - KHEAP_PROFILE_BITS);
+
+	for(unsigned int i = 0; i < KHEAP_PROFILE_PROBES; i++) {
+		kheap_site_stats_t *slot = &sites[(hash + i) & (KHEAP_PROFILE_SITES - 1)];
+
+		if(slot->site == site || !slot->site) {
+			slot->site = site;
+			entry = slot;
+			break;
 		}
+	}
+
+	entry->count++;
+	entry->bytes += size;
+
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+}
+#endif
+
+#if KHEAP_HARDEN
+/*
+ * Checks whether an object has a header in front of it: everything but page
+ * aligned allocations from vmalloc does.
+ */
+static inline bool kheap_harden_owns(void *address) {
+	return !vmalloc_owns(address) || ((uintptr_t) address & 0xFFF);
+}
+
+/*
+ * Decides whether the next allocation on this CPU gets guard pages. The gap
+ * between them varies randomly around KHEAP_GUARD_SAMPLE, so that allocation
+ * patterns that repeat don't always dodge sampling.
+ */
+static bool kheap_harden_sample(void) {
+	bool sample = false;
+
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	kheap_harden_cpu_t *cpu = &kheap_harden[platform_cpu_id()];
+
+	/*
+	 * The first allocation on a CPU only starts the countdown: on the boot
+	 * CPU, it is made while vmalloc is still being set up.
+	 */
+	bool first = !cpu->countdown;
 
-		// get address and increment
-		uintptr_t address = state.s.dumb.start_placement;
+	if(first || !--cpu->countdown) {
+		// xorshift, seeded differently on each CPU
+		uint32_t x = cpu->random ? cpu->random : (0x9E3779B9 + platform_cpu_id());
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		cpu->random = x;
 
-		state.s.dumb.start_placement += s;
-		state.s.dumb.bytes_allocated += s;
+		cpu->countdown = (KHEAP_GUARD_SAMPLE / 2) + (x % KHEAP_GUARD_SAMPLE);
 
-		// convert to physical
-		if(physical) {
-			*physical = address - 0xC0000000;
+		// the number of guarded objects is bounded, as each takes a page
+		int guarded = 0;
+
+		for(unsigned int i = 0; i < PLATFORM_MAX_CPUS; i++) {
+			guarded += kheap_harden[i].guarded;
 		}
 
-		return (void *) address;		
+		sample = !first && (guarded < KHEAP_GUARD_MAX);
+	}
+
+	if(enabled) {
+		platform_int_set_mask(true);
 	}
+
+	return sample;
 }
 
 /*
- * Allocates a page-aligned chunk of memory.
- *
- * @param sz Size of memory to allocate
+ * Returns the bytes a guarded object takes up at the end of its page: objects
+ * stay 16 byte aligned, and the few bytes of slack are a redzone.
  */
-void *kmalloc_a(size_t sz) {
-	return kmalloc_ap(sz, NULL);
+static inline size_t kheap_guarded_size(size_t s) {
+	return s ? ((s + 15) & ~15) : 16;
 }
 
-/**
- * Allocates a chunk of page allocated memory, s bytes in size, and stores the
- * physical address of the page in the specified memory, if not NULL. Returns
- * NULL if memory could not be allocated.
+/*
+ * Allocates a page for an object, which is placed at its end, right before
+ * the guard page that follows it. Returns NULL if there was no memory.
  */
-void *kmalloc_ap(size_t s, uintptr_t *physical) {
-	if(likely(state.use_smart_mapper)) {
-		return kheap_smart_alloc(s, true, physical);
+static void *kheap_guarded_alloc(size_t s, kmalloc_flags_t flags, void *site) {
+	vmalloc_flags_t vflags = kVMAllocGuard;
+
+	if(!(flags & kMallocZero)) vflags |= kVMAllocNoZero;
+
+	uintptr_t page = (uintptr_t) vmalloc(0x1000, vflags);
+
+	if(unlikely(!page)) {
+		return NULL;
+	}
+
+	size_t used = kheap_guarded_size(s);
+	uintptr_t ptr = page + 0x1000 - used;
+
+	kheap_header_t *header = (kheap_header_t *) (ptr - sizeof(kheap_header_t));
+	header->site = site;
+	header->size = s;
+	header->magic = KHEAP_MAGIC_GUARD;
+	header->redzone = KHEAP_REDZONE_WORD;
+
+	memset((void *) (ptr + s), KHEAP_REDZONE_BYTE, used - s);
+
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	kheap_harden[platform_cpu_id()].guarded++;
+	kheap_harden[platform_cpu_id()].guarded_total++;
+
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+
+	return (void *) ptr;
+}
+
+/*
+ * Allocates an object with redzones, or on a guarded page if it is sampled.
+ * Requests that must be page aligned, or that would be served by vmalloc once
+ * the header and redzone are added, are passed on without them.
+ */
+static void *kheap_harden_alloc(size_t s, kmalloc_flags_t flags,
+								phys_addr_t *physical, void *site) {
+	size_t total = sizeof(kheap_header_t) + s + KHEAP_REDZONE;
+	uintptr_t ptr;
+
+	/*
+	 * Objects without a header are told apart by being page aligned vmalloc
+	 * allocations; forcing alignment makes sure that requests which would
+	 * otherwise still fit into liballoc or a slab come out that way too.
+	 */
+	if((flags & kMallocAligned) || total >= KHEAP_LARGE_SIZE ||
+	   ((flags & kMallocContiguous) && total > SLAB_MAX_SIZE)) {
+		return kheap_smart_alloc(s, flags | kMallocAligned, physical);
+	}
+
+	// guarded objects may straddle pages, so they can't be contiguous
+	if(!(flags & kMallocContiguous) && unlikely(kheap_harden_sample())) {
+		ptr = (uintptr_t) kheap_guarded_alloc(s, flags, site);
 	} else {
-		// is the start placement address configured?
-		if(!state.s.dumb.start_placement) {
-			state.s.dumb.start_placement = (uintptr_t) &__kern_end;
+		ptr = 0;
+	}
+
+	if(likely(!ptr)) {
+		uintptr_t raw = (uintptr_t) kheap_smart_alloc(total, flags, NULL);
+
+		if(unlikely(!raw)) {
+			return NULL;
 		}
 
-		// align size on 16-byte boundaries
-		if(s & 0x0F) {
-			s &= 0xFFFFFFF0;
-			s += 0x10;
+		kheap_header_t *header = (kheap_header_t *) raw;
+		header->site = site;
+		header->size = s;
+		header->magic = KHEAP_MAGIC_LIVE;
+		header->redzone = KHEAP_REDZONE_WORD;
+
+		ptr = raw + sizeof(kheap_header_t);
+		memset((void *) (ptr + s), KHEAP_REDZONE_BYTE, KHEAP_REDZONE);
+	}
+
+	if(physical) {
+		phys_addr_t phys = platform_pm_virt_to_phys(kernel_table, ptr & 0xFFFFF000);
+		*physical = phys | (ptr & 0x00000FFF);
+	}
+
+	return (void *) ptr;
+}
+
+/*
+ * Checks that count bytes starting at ptr all have the given value. Returns
+ * the offset of the first one that doesn't, or count.
+ */
+static size_t kheap_harden_scan(uintptr_t ptr, size_t count, uint8_t byte, uint32_t word) {
+	size_t off = 0;
+
+	// compare whole words where possible
+	for(; off + 4 <= count && !(((uintptr_t) ptr + off) & 3); off += 4) {
+		if(*((uint32_t *) (ptr + off)) != word) {
+			break;
 		}
+	}
 
-		// is placement already page aligned?
-		if(!(state.s.dumb.start_placement & 0xFFF)) {
+	for(; off < count; off++) {
+		if(*((uint8_t *) (ptr + off)) != byte) {
+			break;
+		}
+	}
+
+	return off;
+}
 
+/*
+ * Checks the header and redzones of a live object. Returns false, after
+ * reporting the problem, if it isn't a live object or it has been damaged.
+ */
+static bool kheap_harden_check(void *address, const char *what, void *site) {
+	uintptr_t ptr = (uintptr_t) address;
+	kheap_header_t *header = (kheap_header_t *) (ptr - sizeof(kheap_header_t));
+	kheap_harden_cpu_t *cpu = &kheap_harden[platform_cpu_id()];
+
+	if(unlikely(header->magic != KHEAP_MAGIC_LIVE && header->magic != KHEAP_MAGIC_GUARD)) {
+		if(header->magic == KHEAP_MAGIC_FREE) {
+			KERROR("kheap: %s of freed object 0x%08X from 0x%08X (allocated at 0x%08X)\n",
+				   what, (unsigned int) ptr, (unsigned int) site, (unsigned int) header->site);
 		} else {
-			// align to page bounds
-			state.s.dumb.start_placement += 0x1000 - (state.s.dumb.start_placement & 0xFFF);
+			KERROR("kheap: %s of invalid or damaged object 0x%08X from 0x%08X\n",
+				   what, (unsigned int) ptr, (unsigned int) site);
 		}
 
-		// get address and increment
-		uintptr_t address = state.s.dumb.start_placement;
+		cpu->bad_frees++;
+		return false;
+	}
+
+	// the tail redzone of guarded objects runs up to the guard page
+	size_t tail = KHEAP_REDZONE;
+
+	if(header->magic == KHEAP_MAGIC_GUARD) {
+		tail = kheap_guarded_size(header->size) - header->size;
+	}
+
+	bool front = (header->redzone == KHEAP_REDZONE_WORD);
+	size_t bad = kheap_harden_scan(ptr + header->size, tail, KHEAP_REDZONE_BYTE, KHEAP_REDZONE_WORD);
+
+	if(unlikely(!front || bad != tail)) {
+		KERROR("kheap: %s of object 0x%08X (0x%X bytes, allocated at 0x%08X) from 0x%08X: %s redzone overwritten\n",
+			   what, (unsigned int) ptr, header->size, (unsigned int) header->site,
+			   (unsigned int) site, front ? "back" : "front");
 
-		state.s.dumb.start_placement += s;
-		state.s.dumb.bytes_allocated += s;
+		cpu->corruptions++;
+		return false;
+	}
+
+	return true;
+}
 
-		// convert to physical
-		if(physical) {
-			*physical = address - 0xC0000000;
+/*
+ * Really releases an object that comes out of quarantine. Writes to it while
+ * it was in quarantine show up as damaged poison.
+ */
+static void kheap_harden_release(void *address) {
+	uintptr_t ptr = (uintptr_t) address;
+
+	// guarded objects were unmapped when they were freed
+	if(vmalloc_owns(address)) {
+		vfree((void *) (ptr & 0xFFFFF000));
+
+		bool enabled = platform_int_enabled();
+		platform_int_set_mask(false);
+
+		kheap_harden[platform_cpu_id()].guarded--;
+
+		if(enabled) {
+			platform_int_set_mask(true);
 		}
 
-		return (void *) address;
+		return;
 	}
 
-	return NULL;
+	kheap_header_t *header = (kheap_header_t *) (ptr - sizeof(kheap_header_t));
+	size_t bad = kheap_harden_scan(ptr, header->size, KHEAP_POISON_BYTE, KHEAP_POISON_WORD);
+
+	if(unlikely(bad != header->size)) {
+		KERROR("kheap: object 0x%08X (0x%X bytes, allocated at 0x%08X) written at offset 0x%X after free\n",
+			   (unsigned int) ptr, header->size, (unsigned int) header->site, (unsigned int) bad);
+
+		kheap_harden[platform_cpu_id()].corruptions++;
+	}
+
+	header->magic = 0;
+	kheap_free(header);
+}
+
+/*
+ * Checks an object that is being freed, poisons it, and puts it in this CPU's
+ * quarantine; the oldest object in there is released. Damaged objects are
+ * never released. Returns false if the object has no redzones, and must be
+ * freed as usual.
+ */
+static bool kheap_harden_free(void *address, void *site) {
+	uintptr_t ptr = (uintptr_t) address;
+
+	if(!kheap_harden_owns(address)) {
+		return false;
+	}
+
+	if(unlikely(!kheap_harden_check(address, "free", site))) {
+		return true;
+	}
+
+	kheap_header_t *header = (kheap_header_t *) (ptr - sizeof(kheap_header_t));
+
+	if(header->magic == KHEAP_MAGIC_GUARD) {
+		// any access faults until the page leaves quarantine
+		header->magic = KHEAP_MAGIC_FREE;
+		vmalloc_decommit((void *) (ptr & 0xFFFFF000));
+	} else {
+		header->magic = KHEAP_MAGIC_FREE;
+		memset(address, KHEAP_POISON_BYTE, header->size);
+	}
+
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	kheap_harden_cpu_t *cpu = &kheap_harden[platform_cpu_id()];
+
+	void *evicted = cpu->quarantine[cpu->next];
+	cpu->quarantine[cpu->next] = address;
+	cpu->next = (cpu->next + 1) % KHEAP_QUARANTINE_SIZE;
+
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+
+	if(evicted) {
+		kheap_harden_release(evicted);
+	}
+
+	return true;
+}
+
+#endif
+
+/*
+ * Allocates memory from whichever heap is active, on behalf of the given call
+ * site.
+ */
+static inline void *kheap_alloc(size_t s, kmalloc_flags_t flags,
+								phys_addr_t *physical, void *site) {
+	if(unlikely(!state.use_smart_mapper)) {
+		return kheap_dumb_alloc(s, flags, physical);
+	}
+
+#if KHEAP_HARDEN
+	void *ptr = kheap_harden_alloc(s, flags, physical, site);
+#else
+	void *ptr = kheap_smart_alloc(s, flags, physical);
+#endif
+
+#if KHEAP_PROFILE
+	if(likely(ptr)) {
+		kheap_profile(site, s);
+	}
+#endif
+
+	return ptr;
+}
+
+#if KHEAP_HARDEN
+/*
+ * Moves an object with redzones to a new allocation of size bytes.
+ */
+static void *kheap_harden_realloc(void *addr, size_t size, void *site) {
+	if(unlikely(!kheap_harden_check(addr, "realloc", site))) {
+		return NULL;
+	}
+
+	kheap_header_t *header = (kheap_header_t *) ((uintptr_t) addr - sizeof(kheap_header_t));
+	size_t old_size = header->size;
+
+	void *ptr = NULL;
+
+	if(size) {
+		// the old contents are copied over, so there's no need to clear it
+		ptr = kheap_alloc(size, 0, NULL, site);
+
+		if(unlikely(!ptr)) {
+			return NULL;
+		}
+
+		memcpy(ptr, addr, (old_size < size) ? old_size : size);
+	}
+
+	kheap_harden_free(addr, site);
+
+	return ptr;
+}
+#endif
+
+/**
+ * Allocates a chunk of memory, at least s bytes in size, that satisfies the
+ * given flags. If physical is not NULL, the physical address of the memory is
+ * stored there. Returns NULL if the memory could not be made available.
+ */
+void *kmalloc_ext(size_t s, kmalloc_flags_t flags, phys_addr_t *physical) {
+	return kheap_alloc(s, flags, physical, __builtin_return_address(0));
+}
+
+/**
+ * Allocates a chunk of memory, at least s bytes in size. Returns NULL if the
+ * memory could not be made available.
+ */
+void *kmalloc(size_t s) {
+	return kheap_alloc(s, kMallocDefault, NULL, __builtin_return_address(0));
+}
+
+/*
+ * Allocates a chunk of memory and gets physical address.
+ *
+ * @param sz Size of memory to allocate
+ * @param phys Pointer to memory to place physical address in
+ */
+void *kmalloc_p(size_t s, phys_addr_t *physical) {
+	return kheap_alloc(s, kMallocDefault, physical, __builtin_return_address(0));
+}
+
+/*
+ * Allocates a page-aligned chunk of memory.
+ *
+ * @param sz Size of memory to allocate
+ */
+void *kmalloc_a(size_t sz) {
+	return kheap_alloc(sz, kMallocDefault | kMallocAligned, NULL, __builtin_return_address(0));
+}
+
+/**
+ * Allocates a chunk of page allocated memory, s bytes in size, and stores the
+ * physical address of the page in the specified memory, if not NULL. Returns
+ * NULL if memory could not be allocated.
+ */
+void *kmalloc_ap(size_t s, phys_addr_t *physical) {
+	return kheap_alloc(s, kMallocDefault | kMallocAligned, physical, __builtin_return_address(0));
 }
 
 /**
@@ -375,6 +925,21 @@ unsigned int kheap_dumb_get_bytes(void) {
 	return state.s.dumb.bytes_allocated;
 }
 
+/**
+ * Returns the number of bytes that can still be allocated from the dumb kernel
+ * heap, before it runs past the memory mapped by the boot pagetables.
+ */
+size_t kheap_dumb_get_free(void) {
+	uintptr_t placement = state.s.dumb.start_placement;
+
+	if(!placement) {
+		placement = (uintptr_t) &__kern_end;
+	}
+
+	uintptr_t end = platform_pm_boot_map_end();
+	return (placement < end) ? (end - placement) : 0;
+}
+
 /*
  * Resizes an allocated block of memory.
  *
@@ -382,6 +947,59 @@ unsigned int kheap_dumb_get_bytes(void) {
  * @param size New size to change to.
  */
 void *krealloc(void *addr, size_t size) {
+#if KHEAP_HARDEN
+	// objects with redzones always move, so stale pointers are caught too
+	if(addr && kheap_harden_owns(addr)) {
+		return kheap_harden_realloc(addr, size, __builtin_return_address(0));
+	}
+#endif
+
+	// slab objects can grow up to the size of their class
+	if(addr && is_slab_page((uintptr_t) addr)) {
+		size_t obj_size = slab_obj_size(addr);
+
+		if(size == 0) {
+			slab_free(addr);
+			return NULL;
+		} else if(size <= obj_size) {
+			return addr;
+		}
+
+		// the old contents are copied over, so there's no need to clear it
+		void *ptr = kheap_alloc(size, 0, NULL, __builtin_return_address(0));
+
+		if(ptr) {
+			memcpy(ptr, addr, obj_size);
+			slab_free(addr);
+		}
+
+		return ptr;
+	}
+
+	// large objects keep their pages if they still fit
+	if(addr && vmalloc_owns(addr)) {
+		size_t length = vmalloc_size(addr);
+
+		if(size == 0) {
+			vfree(addr);
+			return NULL;
+		} else if(size >= KHEAP_LARGE_SIZE && vmalloc_resize(addr, size)) {
+			// grown or shrunk in place
+			return addr;
+		} else if(size <= length) {
+			return addr;
+		}
+
+		void *ptr = kheap_alloc(size, 0, NULL, __builtin_return_address(0));
+
+		if(ptr) {
+			memcpy(ptr, addr, length);
+			vfree(addr);
+		}
+
+		return ptr;
+	}
+
 	return lalloc_realloc(addr, size);
 }
 
@@ -392,80 +1010,86 @@ void *krealloc(void *addr, size_t size) {
  * @param size Size of a single item
  */
 void *kcalloc(size_t count, size_t size) {
+	// the product must not wrap around to a smaller buffer
+	if(unlikely(size && count > (SIZE_MAX / size))) {
+		return NULL;
+	}
+
+	// kmalloc always hands back cleared memory
+	if(likely(state.use_smart_mapper)) {
+		return kheap_alloc(count * size, kMallocZero, NULL, __builtin_return_address(0));
+	}
+
 	return lalloc_calloc(count, size);
 }
 
 /*
- * Locking functions for liballoc
+ * Locking functions for liballoc. The lock is held with interrupts masked, so
+ * the heap can be used from interrupt handlers; the interrupt state to go
+ * back to is only touched by the holder of the lock.
  */
 static int allocator_lock() {
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	mutex_take_spin(&heap_lock);
+	heap_lock_irq = enabled;
+
 	return 0;
 }
 
 static int allocator_unlock() {
+	bool enabled = heap_lock_irq;
+	mutex_give(&heap_lock);
+
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+
 	return 0;
 }
 
 /*
- * Allocate pages pages of memory
+ * Backs pages pages of the heap, starting at address, with physical memory and
+ * marks them as in use. If memory runs out, the pages backed so far are
+ * released again, and false is returned.
  */
-static void* allocator_alloc(size_t pages) {
-//	bool pagesFound = false;
-	unsigned int first_free_page = 0;
-	void *start = NULL;
-
-	// Check all free frames for a section of pages
-	unsigned int i, j, l = 0;
-
-	for (i = 0; i < INDEX_FROM_BIT(nframes); i++) {
-		// Skip if all 32 frames are filled
-		if (likely(heap_frames[i] != 0xFFFFFFFF)) {
-			// Check which one of the 32 frames are filled
-			for (j = 0; j < 32; j++) {
-				unsigned int toTest = 0x1 << j;
-
-				// If this frame is free, increment a counter
-				if (!(heap_frames[i] & toTest)) {
-					// If no previous pages match, set starting one
-					if(!l) {
-						first_free_page = i*4*8+j;
-					}
+static bool allocator_map(uintptr_t address, size_t pages) {
+	uintptr_t start = address;
 
-					// Increment page counter
-					l++;
+	// Allocate requested pages some physical memory
+	uintptr_t run_virt = address;
+	phys_addr_t run_phys = 0;
+	size_t run_pages = 0;
 
-					// If the count matches the number of pages we want, allocate pages
-					if(unlikely(l == pages)) {
-						goto pagesFound;
-					}
-				} else {
-					l = 0;
-				}
+	for(int p = 0; p < pages; p++) {
+		// allocate a page: these come pre-cleared
+		phys_addr_t phys_addr = vm_allocate_phys_zeroed();
+
+		// out of physical memory: give back the pages mapped so far
+		if(unlikely(!phys_addr)) {
+			if(run_pages) {
+				platform_pm_map_range(kernel_table, run_virt, run_phys, run_pages, VM_FLAGS_KERNEL_DATA);
 			}
-		}
-	}
 
-	// We drop down here if there wasn't enough pages
-	KERROR("Could not allocate 0x%X pages (last checked page is 0x%X)\n", (unsigned int) pages, first_free_page);
-	return NULL;
+			kernel_heap->size += p;
+			allocator_free((void *) start, p);
 
-	// Enough free pages were found
-	pagesFound:;
-	// KDEBUG("Allocated 0x%X pages (page 0x%X)", (unsigned int) pages, first_free_page);
-	start = (void *) (first_free_page * 0x1000) + kernel_heap->start_address;
+			return false;
+		}
 
-	// Starting address
-	unsigned int address = (first_free_page * 0x1000) + kernel_heap->start_address;
+		// map physically contiguous runs of pages in one go
+		if(run_pages && phys_addr != (run_phys + (run_pages * 0x1000))) {
+			platform_pm_map_range(kernel_table, run_virt, run_phys, run_pages, VM_FLAGS_KERNEL_DATA);
+			run_pages = 0;
+		}
 
-#if DEBUG_PAGE_ALLOCATION
-	KDEBUG("Allocated 0x%X pages (virt 0x%X)\n", (unsigned int) pages, address);
-#endif
+		if(!run_pages) {
+			run_virt = address;
+			run_phys = phys_addr;
+		}
 
-	// Allocate requested pages some physical memory
-	for(int p = 0; p < pages; p++) {
-		// allocate a page
-		uintptr_t phys_addr = vm_allocate_phys();
-		platform_pm_map(kernel_table, address, phys_addr, VM_FLAGS_KERNEL);
+		run_pages++;
 
 		// Mark this frame as set for the heap
 		set_frame(address - kernel_heap->start_address);
@@ -475,10 +1099,64 @@ static void* allocator_alloc(size_t pages) {
 		address += 0x1000;
 	}
 
+	platform_pm_map_range(kernel_table, run_virt, run_phys, run_pages, VM_FLAGS_KERNEL_DATA);
+
 	// Increment allocation counter
 	kernel_heap->size += pages;
 
-	return start;
+	return true;
+}
+
+/*
+ * Allocate pages pages of memory
+ */
+static void* allocator_alloc(size_t pages) {
+	// Find a run of free pages
+	unsigned int first_free_page = bitmap_find_clear_run(&heap_frames, pages);
+
+	if(unlikely(first_free_page == BITMAP_NOT_FOUND)) {
+		KERROR("Could not allocate 0x%X pages\n", (unsigned int) pages);
+		return NULL;
+	}
+
+	// Enough free pages were found
+	// KDEBUG("Allocated 0x%X pages (page 0x%X)", (unsigned int) pages, first_free_page);
+	uintptr_t address = (first_free_page * 0x1000) + kernel_heap->start_address;
+
+#if DEBUG_PAGE_ALLOCATION
+	KDEBUG("Allocated 0x%X pages (virt 0x%X)\n", (unsigned int) pages, address);
+#endif
+
+	if(unlikely(!allocator_map(address, pages))) {
+		return NULL;
+	}
+
+	return (void *) address;
+}
+
+/*
+ * Grows the run of pages pages starting at mem by more pages, if the pages
+ * directly following it are free. Returns whether the run was grown.
+ */
+static bool allocator_extend(void *mem, size_t pages, size_t more) {
+	unsigned int first = (((uintptr_t) mem - kernel_heap->start_address) / 0x1000) + pages;
+
+	if(first + more > nframes) {
+		return false;
+	}
+
+	for(unsigned int i = 0; i < more; i++) {
+		if(bitmap_test(&heap_frames, first + i)) {
+			return false;
+		}
+	}
+
+#if DEBUG_PAGE_ALLOCATION
+	KDEBUG("Extended 0x%X pages by 0x%X (virt 0x%X)\n", (unsigned int) pages,
+		   (unsigned int) more, (unsigned int) mem);
+#endif
+
+	return allocator_map((uintptr_t) mem + (pages * 0x1000), more);
 }
 
 /*
@@ -491,27 +1169,76 @@ static int allocator_free(void *mem, size_t pages) {
 	KDEBUG("Freed 0x%X pages (virt 0x%X)\n", (unsigned int) pages, (unsigned int) address);
 #endif
 
-	// Loop through all the pages
-	for(int i = 0; i < pages; i++) {
-		// is this page mapped?
-		if(platform_pm_is_valid(kernel_table, address, false)) {
-			uintptr_t physical = platform_pm_virt_to_phys(kernel_table, address);
-			vm_deallocate_phys(physical);
+	/*
+	 * Pages are unmapped in batches, ending with the last extent the page
+	 * table walk found: the frames backing a batch are only released once the
+	 * entire batch has been unmapped and invalidated.
+	 */
+	platform_pm_extent_t extents[ALLOCATOR_FREE_EXTENTS];
+	uintptr_t end = address + (pages * 0x1000);
+	size_t total = pages;
 
-			// Mark this page as unused
-			clear_frame(address - kernel_heap->start_address);
+	while(address < end) {
+		size_t num = platform_pm_translate(kernel_table, address, end - address,
+										   extents, ALLOCATOR_FREE_EXTENTS);
+
+		uintptr_t batch_end = end;
+
+		if(num == ALLOCATOR_FREE_EXTENTS) {
+			batch_end = extents[num - 1].virt + extents[num - 1].length;
+		}
+
+		platform_pm_unmap_range(kernel_table, address, (batch_end - address) / 0x1000);
+
+		for(size_t i = 0; i < num; i++) {
+			for(size_t off = 0; off < extents[i].length; off += 0x1000) {
+				vm_deallocate_phys(extents[i].phys + off);
+			}
+		}
 
-			// Advance pointer
-			address += 0x1000;
+		// Mark these pages as unused
+		for(; address < batch_end; address += 0x1000) {
+			clear_frame(address - kernel_heap->start_address);
 		}
 	}
 
 	// Stats
-	kernel_heap->size -= pages;
+	kernel_heap->size -= total;
 
 	return 0;
 }
 
+/*
+ * Allocates a single page of kernel heap, backed by physical memory, and marks
+ * it as belonging to the slab allocator.
+ */
+void *kheap_slab_page_alloc(void) {
+	allocator_lock();
+
+	void *page = allocator_alloc(1);
+
+	if(likely(page)) {
+		bitmap_set(&slab_frames, ((uintptr_t) page - kernel_heap->start_address) / 0x1000);
+	}
+
+	allocator_unlock();
+
+	return page;
+}
+
+/*
+ * Releases a page previously allocated with kheap_slab_page_alloc.
+ */
+void kheap_slab_page_free(void *page) {
+	allocator_lock();
+
+	bitmap_clear(&slab_frames, ((uintptr_t) page - kernel_heap->start_address) / 0x1000);
+
+	allocator_free(page, 1);
+
+	allocator_unlock();
+}
+
 /*
  * Allocate a new memory page.
  */
@@ -533,6 +1260,23 @@ static struct allocator_major *allocate_new_page(unsigned int size) {
 	
 	// Enforce minimum
 	if (st < l_pageCount) st = l_pageCount;
+
+	// Reuse a retained block if it's big enough: its memory is still counted
+	if (st == l_pageCount && l_retained != NULL) {
+		maj = l_retained;
+
+		l_retained = maj->next;
+		if (l_retained != NULL) l_retained->prev = NULL;
+		l_numRetained--;
+
+		maj->prev = NULL;
+		maj->next = NULL;
+		maj->usage = sizeof(struct allocator_major);
+		maj->first = NULL;
+		maj->zeroed = false;
+
+		return maj;
+	}
 	
 	maj = (struct allocator_major *) allocator_alloc(st);
 
@@ -552,6 +1296,7 @@ static struct allocator_major *allocate_new_page(unsigned int size) {
 	maj->size = st * l_pageSize;
 	maj->usage = sizeof(struct allocator_major);
 	maj->first = NULL;
+	maj->zeroed = true;
 
 	l_allocated += maj->size;
 
@@ -564,9 +1309,67 @@ static struct allocator_major *allocate_new_page(unsigned int size) {
 }
 
 /*
- * Allocates a memory block of the requested size.
+ * Takes an empty major block, which is no longer on the list of blocks. It is
+ * retained for reuse if there is room, or released otherwise. Blocks that are
+ * larger than the default size were made for a single large request, so they
+ * are always released.
+ */
+static void allocator_retire(struct allocator_major *maj) {
+	if (l_numRetained < ALLOCATOR_RETAIN_MAJORS && maj->pages == l_pageCount) {
+		maj->prev = NULL;
+		maj->next = l_retained;
+		maj->idle = 0;
+
+		if (l_retained != NULL) l_retained->prev = maj;
+		l_retained = maj;
+		l_numRetained++;
+
+		return;
+	}
+
+	l_allocated -= maj->size;
+	allocator_free(maj, maj->pages);
+}
+
+/*
+ * Releases retained major blocks that have gone unused for a while. This is
+ * called once per idle pass of the processor.
+ */
+void kheap_idle(void) {
+	struct allocator_major *maj, *next;
+
+	// this is only a hint: it's checked again with the lock held
+	if (l_numRetained == 0) {
+		return;
+	}
+
+	allocator_lock();
+
+	for (maj = l_retained; maj != NULL; maj = next) {
+		next = maj->next;
+
+		if (++maj->idle < ALLOCATOR_RETAIN_IDLE) {
+			continue;
+		}
+
+		if (maj->prev != NULL) maj->prev->next = maj->next;
+		if (maj->next != NULL) maj->next->prev = maj->prev;
+		if (l_retained == maj) l_retained = maj->next;
+		l_numRetained--;
+
+		l_allocated -= maj->size;
+		allocator_free(maj, maj->pages);
+	}
+
+	allocator_unlock();
+}
+
+/*
+ * Allocates a memory block of the requested size. If fresh is not NULL, it is
+ * set to whether the block was carved from a newly allocated major block,
+ * whose memory is still zeroed.
  */
-static void *lalloc_malloc(size_t req_size) {
+static void *lalloc_malloc(size_t req_size, bool *fresh) {
 	int startedBet = 0;
 	unsigned long long bestSize = 0;
 	void *p = NULL;
@@ -675,6 +1478,8 @@ static void *lalloc_malloc(size_t req_size) {
 
 		// It's a brand new block.
 		if (maj->first == NULL) {
+			if (fresh) *fresh = maj->zeroed;
+
 			maj->first = (struct allocator_minor*)((uintptr_t)maj + sizeof(struct allocator_major));
 
 			
@@ -917,9 +1722,8 @@ static void lalloc_free(void *ptr) {
 		if (l_bestBet == maj) l_bestBet = NULL;
 		if (maj->prev != NULL) maj->prev->next = maj->next;
 		if (maj->next != NULL) maj->next->prev = maj->prev;
-		l_allocated -= maj->size;
 
-		allocator_free(maj, maj->pages);
+		allocator_retire(maj);
 	} else {
 		if (l_bestBet != NULL) {
 			int bestSize = l_bestBet->size  - l_bestBet->usage;
@@ -941,7 +1745,7 @@ static void* lalloc_calloc(size_t nobj, size_t size) {
 
 	real_size = nobj * size;
 	
-	p = lalloc_malloc(real_size);
+	p = lalloc_malloc(real_size, NULL);
 
 	memset(p, 0, real_size);
 
@@ -951,7 +1755,9 @@ static void* lalloc_calloc(size_t nobj, size_t size) {
 static void* lalloc_realloc(void *p, size_t size) {
 	void *ptr;
 	struct allocator_minor *min;
+	struct allocator_major *maj;
 	unsigned int real_size;
+	size_t needed, avail, more;
 	
 	// Honour the case of size == 0 => free old and return NULL
 	if (size == 0) {
@@ -960,7 +1766,7 @@ static void* lalloc_realloc(void *p, size_t size) {
 	}
 
 	// In the case of a NULL pointer, return a simple malloc.
-	if (p == NULL) return lalloc_malloc(size);
+	if (p == NULL) return lalloc_malloc(size, NULL);
 
 	// Unalign the pointer if required.
 	ptr = p;
@@ -1003,9 +1809,46 @@ static void* lalloc_realloc(void *p, size_t size) {
 	
 	// Definitely a memory block.
 	real_size = min->req_size;
+	maj = min->block;
+
+	// bytes of the minor the block needs, counting the alignment padding
+	needed = ((uintptr_t) p - (uintptr_t) min) - sizeof(struct allocator_minor) + size;
+
+	// the minor can extend up to the next one, or the end of the major block
+	avail = min->next ? (uintptr_t) min->next : ((uintptr_t) maj + maj->size);
+	avail -= (uintptr_t) min + sizeof(struct allocator_minor);
+
+	// the last minor can also take pages that directly follow its major block
+	if (needed > avail && min->next == NULL) {
+		more = ((needed - avail) + l_pageSize - 1) / l_pageSize;
+
+		if (allocator_extend(maj, maj->pages, more)) {
+			maj->pages += more;
+			maj->size += more * l_pageSize;
+			l_allocated += more * l_pageSize;
+
+			avail += more * l_pageSize;
+		}
+	}
+
+	/*
+	 * Resize the block in place: this grows it into the free space after it,
+	 * or returns its tail to the major block when it shrinks.
+	 */
+	if (needed <= avail) {
+		l_inuse += needed;
+		l_inuse -= min->size;
 
-	if (real_size >= size) {
+		maj->usage += needed;
+		maj->usage -= min->size;
+
+		min->size = needed;
 		min->req_size = size;
+
+		if (l_bestBet != NULL && (maj->size - maj->usage) > (l_bestBet->size - l_bestBet->usage)) {
+			l_bestBet = maj;
+		}
+
 		allocator_unlock();
 		return p;
 	}
@@ -1013,9 +1856,242 @@ static void* lalloc_realloc(void *p, size_t size) {
 	allocator_unlock();
 
 	// If we got here then we're reallocating to a block bigger than us.
-	ptr = lalloc_malloc(size);
+	ptr = lalloc_malloc(size, NULL);
+
+	if (ptr == NULL) {
+		return NULL;
+	}
+
 	memcpy(ptr, p, real_size);
 	lalloc_free(p);
 
 	return ptr;
-}
\ No newline at end of file
+}
+/*
+ * Returns the size of the largest free range in a major block.
+ */
+static size_t allocator_largest_gap(struct allocator_major *maj) {
+	uintptr_t pos = (uintptr_t) maj + sizeof(struct allocator_major);
+	uintptr_t end = (uintptr_t) maj + maj->size;
+	size_t largest = 0;
+
+	for(struct allocator_minor *min = maj->first; min; min = min->next) {
+		if(((uintptr_t) min - pos) > largest) {
+			largest = (uintptr_t) min - pos;
+		}
+
+		pos = (uintptr_t) min + sizeof(struct allocator_minor) + min->size;
+	}
+
+	if((end - pos) > largest) {
+		largest = end - pos;
+	}
+
+	return largest;
+}
+
+/*
+ * Takes a snapshot of the kernel heap's usage.
+ *
+ * @param stats Structure to fill in
+ */
+void kheap_get_stats(kheap_stats_t *stats) {
+	size_t total_free = 0;
+
+	memclr(stats, sizeof(kheap_stats_t));
+
+	slab_get_class_stats(stats->classes);
+	vmalloc_get_stats(&stats->large);
+
+	allocator_lock();
+
+	for(struct allocator_major *maj = l_memRoot; maj; maj = maj->next) {
+		stats->major_blocks++;
+
+		// the block header always counts as used, so this is at least 0
+		stats->major_occupancy[((maj->usage * 4) - 1) / maj->size]++;
+
+		size_t gap = allocator_largest_gap(maj);
+
+		if(gap > stats->largest_free) {
+			stats->largest_free = gap;
+		}
+
+		total_free += maj->size - maj->usage;
+	}
+
+	stats->major_bytes = l_allocated;
+	stats->major_inuse = l_inuse;
+	stats->major_retained = l_numRetained;
+
+	stats->heap_pages = kernel_heap ? kernel_heap->size : 0;
+
+#if KHEAP_HARDEN
+	for(unsigned int i = 0; i < PLATFORM_MAX_CPUS; i++) {
+		stats->guarded += kheap_harden[i].guarded_total;
+		stats->corruptions += kheap_harden[i].corruptions;
+		stats->bad_frees += kheap_harden[i].bad_frees;
+	}
+#endif
+
+	stats->warnings = l_warningCount;
+	stats->errors = l_errorCount;
+	stats->possible_overruns = l_possibleOverruns;
+
+	allocator_unlock();
+
+	// share of the free space that isn't part of the largest range
+	if(total_free >= 1000) {
+		unsigned int contiguous = stats->largest_free / (total_free / 1000);
+		stats->fragmentation = (contiguous < 1000) ? (1000 - contiguous) : 0;
+	}
+}
+
+#if KHEAP_PROFILE
+/*
+ * Finds the entry of a call site in a CPU's table, or NULL.
+ */
+static kheap_site_stats_t *kheap_profile_find(unsigned int cpu, void *site) {
+	kheap_site_stats_t *sites = kheap_profiles[cpu].sites;
+	unsigned int hash = (((uintptr_t) site) * 2654435761U) >> (32 - KHEAP_PROFILE_BITS);
+
+	for(unsigned int i = 0; i < KHEAP_PROFILE_PROBES; i++) {
+		kheap_site_stats_t *slot = &sites[(hash + i) & (KHEAP_PROFILE_SITES - 1)];
+
+		if(slot->site == site) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Inserts an entry into a list of at most n sites, sorted by bytes, if it is
+ * larger than the smallest entry.
+ */
+static void kheap_site_insert(kheap_site_stats_t *sites, unsigned int *num,
+							  unsigned int n, kheap_site_stats_t *entry) {
+	unsigned int i = *num;
+
+	if(i == n) {
+		if(!n || sites[n - 1].bytes >= entry->bytes) {
+			return;
+		}
+
+		// the last entry drops off the list
+		i = n - 1;
+	} else {
+		(*num)++;
+	}
+
+	while(i && sites[i - 1].bytes < entry->bytes) {
+		sites[i] = sites[i - 1];
+		i--;
+	}
+
+	sites[i] = *entry;
+}
+#endif
+
+/*
+ * Gets the call sites that allocated the most bytes since boot, most first.
+ * The tables of other CPUs are read while they may be updated, so the counts
+ * are approximate.
+ *
+ * @param sites Array to fill in
+ * @param n Number of entries in the array
+ * @return Number of entries filled in
+ */
+unsigned int kheap_get_top_sites(kheap_site_stats_t *sites, unsigned int n) {
+	unsigned int num = 0;
+
+#if KHEAP_PROFILE
+	kheap_site_stats_t other = { NULL, 0, 0 };
+
+	for(unsigned int cpu = 0; cpu < PLATFORM_MAX_CPUS; cpu++) {
+		other.count += kheap_profiles[cpu].other.count;
+		other.bytes += kheap_profiles[cpu].other.bytes;
+
+		for(unsigned int i = 0; i < KHEAP_PROFILE_SITES; i++) {
+			void *site = kheap_profiles[cpu].sites[i].site;
+			bool seen = false;
+
+			if(!site) {
+				continue;
+			}
+
+			// sites are totalled when first seen on the lowest CPU
+			for(unsigned int prev = 0; prev < cpu && !seen; prev++) {
+				seen = (kheap_profile_find(prev, site) != NULL);
+			}
+
+			if(seen) {
+				continue;
+			}
+
+			kheap_site_stats_t total = { site, 0, 0 };
+
+			for(unsigned int c = cpu; c < PLATFORM_MAX_CPUS; c++) {
+				kheap_site_stats_t *entry = kheap_profile_find(c, site);
+
+				if(entry) {
+					total.count += entry->count;
+					total.bytes += entry->bytes;
+				}
+			}
+
+			kheap_site_insert(sites, &num, n, &total);
+		}
+	}
+
+	if(other.count) {
+		kheap_site_insert(sites, &num, n, &other);
+	}
+#endif
+
+	return num;
+}
+
+/*
+ * Prints the heap's statistics and its top allocation sites to the console.
+ */
+void kheap_dump_stats(void) {
+	kheap_stats_t stats;
+	kheap_site_stats_t sites[KHEAP_DUMP_SITES];
+
+	kheap_get_stats(&stats);
+
+	for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+		slab_stats_t *c = &stats.classes[i];
+
+		KINFO("%s: %u/%u objects in use (%u cached), %u slabs\n", c->name,
+			  c->objs_inuse, c->objs_total, c->objs_cached, c->num_slabs);
+	}
+
+	KINFO("liballoc: %u blocks, %uK of %uK in use, largest free 0x%X, fragmentation %u.%u%%\n",
+		  stats.major_blocks, (unsigned int) (stats.major_inuse / 1024),
+		  (unsigned int) (stats.major_bytes / 1024), (unsigned int) stats.largest_free,
+		  stats.fragmentation / 10, stats.fragmentation % 10);
+	KINFO("liballoc: occupancy %u/%u/%u/%u, %u retained; %u warnings, %u errors, %u overruns\n",
+		  stats.major_occupancy[0], stats.major_occupancy[1],
+		  stats.major_occupancy[2], stats.major_occupancy[3], stats.major_retained,
+		  stats.warnings, stats.errors, stats.possible_overruns);
+	KINFO("heap: %u pages; large: %u allocations, %uK, %uK free (largest %uK)\n",
+		  (unsigned int) stats.heap_pages, stats.large.allocations,
+		  (unsigned int) (stats.large.allocated_bytes / 1024),
+		  (unsigned int) (stats.large.free_bytes / 1024),
+		  (unsigned int) (stats.large.largest_free / 1024));
+
+#if KHEAP_HARDEN
+	KINFO("hardening: %u guarded allocations, %u corruptions, %u bad frees\n",
+		  stats.guarded, stats.corruptions, stats.bad_frees);
+#endif
+
+	unsigned int num = kheap_get_top_sites(sites, KHEAP_DUMP_SITES);
+
+	for(unsigned int i = 0; i < num; i++) {
+		KINFO("site 0x%08X: %u allocations, %uK\n", (unsigned int) sites[i].site,
+			  (unsigned int) sites[i].count, (unsigned int) (sites[i].bytes >> 10));
+	}
+}
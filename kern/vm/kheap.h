@@ -1,7 +1,14 @@
 /*
  * Kernel heap!
  */
+#ifndef VM_KHEAP_H
+#define VM_KHEAP_H
+
 #include <types.h>
+#include "pexpert/platform.h"
+
+#include "slab.h"
+#include "vmalloc.h"
 
 // Data types
 typedef struct heap {
@@ -25,11 +32,102 @@ typedef struct heap {
 	unsigned int end_address;
 } heap_t;
 
+/*
+ * A snapshot of the kernel heap's usage.
+ */
+typedef struct {
+	// kmalloc's size classes
+	slab_stats_t classes[SLAB_NUM_CLASSES];
+
+	// liballoc's major blocks: their size, and the bytes handed out from them
+	unsigned int major_blocks;
+	size_t major_bytes;
+	size_t major_inuse;
+
+	// number of major blocks that are up to 25%, 50%, 75% and 100% in use
+	unsigned int major_occupancy[4];
+
+	// empty major blocks kept for reuse, which are counted in major_bytes
+	unsigned int major_retained;
+
+	/*
+	 * Largest free range in any major block, and how fragmented their free
+	 * space is, in per mille: 0 if all free space is in one range.
+	 */
+	size_t largest_free;
+	unsigned int fragmentation;
+
+	// pages of the heap region in use, by both liballoc and slabs
+	size_t heap_pages;
+
+	// requests of a page or more, which are served by vmalloc
+	vmalloc_stats_t large;
+
+	// liballoc's counters of suspicious calls
+	unsigned int warnings;
+	unsigned int errors;
+	unsigned int possible_overruns;
+
+	/*
+	 * Hardened mode: objects given guard pages, objects found with damaged
+	 * redzones or poison, and frees of objects that weren't live.
+	 */
+	unsigned int guarded;
+	unsigned int corruptions;
+	unsigned int bad_frees;
+} kheap_stats_t;
+
+/*
+ * Allocations made from one call site, as recorded by the profiler.
+ */
+typedef struct {
+	// return address of the call to kmalloc; NULL for all other sites
+	void *site;
+
+	// number of allocations made, and the bytes requested by them
+	uint64_t count;
+	uint64_t bytes;
+} kheap_site_stats_t;
+
 /*
  * Creates the kernel heap.
  */
 void kheap_install();
 
+/*
+ * Returns the number of bytes that can still be allocated before the heap is
+ * installed.
+ */
+size_t kheap_dumb_get_free(void);
+
+/*
+ * Releases empty heap memory that has been kept around for a while. This is
+ * called once per idle pass of the processor.
+ */
+void kheap_idle(void);
+
+/*
+ * Takes a snapshot of the kernel heap's usage.
+ *
+ * @param stats Structure to fill in
+ */
+void kheap_get_stats(kheap_stats_t *stats);
+
+/*
+ * Gets the call sites that allocated the most bytes since boot, most first.
+ * The counts only ever grow: they measure allocation volume, not live memory.
+ *
+ * @param sites Array to fill in
+ * @param n Number of entries in the array
+ * @return Number of entries filled in
+ */
+unsigned int kheap_get_top_sites(kheap_site_stats_t *sites, unsigned int n);
+
+/*
+ * Prints the heap's statistics and its top allocation sites to the console.
+ */
+void kheap_dump_stats(void);
+
 
 // !Heap accessing functions
 /*
@@ -45,7 +143,7 @@ void *kmalloc_a(size_t sz);
  * @param sz Size of memory to allocate
  * @param phys Pointer to memory to place physical address in
  */
-void *kmalloc_p(size_t sz, uintptr_t *phys);
+void *kmalloc_p(size_t sz, phys_addr_t *phys);
 
 /*
  * Allocates a page-aligned chunk of memory and gets physical address.
@@ -53,7 +151,7 @@ void *kmalloc_p(size_t sz, uintptr_t *phys);
  * @param sz Size of memory to allocate
  * @param phys Pointer to memory to place physical address in
  */
-void *kmalloc_ap(size_t sz, uintptr_t *phys);
+void *kmalloc_ap(size_t sz, phys_addr_t *phys);
 
 /*
  * Allocates a chunk of memory.
@@ -83,4 +181,20 @@ void *krealloc(void *addr, size_t size);
  * @param count Number of items
  * @param size Size of a single item
  */
-void *kcalloc(size_t count, size_t size);
\ No newline at end of file
+void *kcalloc(size_t count, size_t size);
+
+// !Page-level interface for the slab allocator
+/*
+ * Allocates a single page of kernel heap, backed by physical memory, and marks
+ * it as belonging to the slab allocator.
+ */
+void *kheap_slab_page_alloc(void);
+
+/*
+ * Releases a page previously allocated with kheap_slab_page_alloc.
+ *
+ * @param page Address of the page
+ */
+void kheap_slab_page_free(void *page);
+
+#endif
@@ -2,7 +2,7 @@
 
 extern char __kern_end;
 
-extern void *kheap_smart_alloc(size_t size, bool aligned, uintptr_t *phys);
+extern void *kheap_smart_alloc(size_t size, kmalloc_flags_t flags, phys_addr_t *phys);
 
 /**
  * Overall state of the memory allocator. This encapsulates the state of both
@@ -29,7 +29,7 @@ static struct {
  */
 void *kmalloc(size_t s) {
 	if(likely(state.use_smart_mapper)) {
-		return kheap_smart_alloc(s, false, NULL);
+		return kheap_smart_alloc(s, kMallocDefault, NULL);
 	} else {
 		// is the start placement address configured?
 		if(!state.s.dumb.start_placement) {
@@ -60,9 +60,9 @@ void *kmalloc(size_t s) {
  * @param sz Size of memory to allocate
  * @param phys Pointer to memory to place physical address in
  */
-void *kmalloc_p(size_t s, uintptr_t *physical) {
+void *kmalloc_p(size_t s, phys_addr_t *physical) {
 	if(likely(state.use_smart_mapper)) {
-		return kheap_smart_alloc(s, false, physical);		
+		return kheap_smart_alloc(s, kMallocDefault, physical);		
 	} else {
 		// is the start placement address configured?
 		if(!state.s.dumb.start_placement) {
@@ -104,9 +104,9 @@ void *kmalloc_a(size_t sz) {
  * physical address of the page in the specified memory, if not NULL. Returns
  * NULL if memory could not be allocated.
  */
-void *kmalloc_ap(size_t s, uintptr_t *physical) {
+void *kmalloc_ap(size_t s, phys_addr_t *physical) {
 	if(likely(state.use_smart_mapper)) {
-		return kheap_smart_alloc(s, true, physical);
+		return kheap_smart_alloc(s, kMallocDefault | kMallocAligned, physical);
 	} else {
 		// is the start placement address configured?
 		if(!state.s.dumb.start_placement) {
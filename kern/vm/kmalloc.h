@@ -2,6 +2,34 @@
 #define VM_KMALLOC_H
 
 #include <types.h>
+#include "pexpert/platform.h"
+
+/**
+ * Requirements on memory allocated with kmalloc_ext. Callers should only ask
+ * for what they need: clearing large buffers that are about to be filled
+ * anyways is wasted memory bandwidth.
+ */
+typedef enum {
+	// the memory is cleared to zero
+	kMallocZero = (1 << 0),
+	// the memory starts on a page boundary
+	kMallocAligned = (kMallocZero << 1),
+	// the memory is backed by physically contiguous frames
+	kMallocContiguous = (kMallocAligned << 1),
+
+	// flags used by kmalloc and friends
+	kMallocDefault = kMallocZero,
+} kmalloc_flags_t;
+
+/**
+ * Allocates a chunk of memory, at least s bytes in size, that satisfies the
+ * given flags. If physical is not NULL, the physical address of the memory is
+ * stored there. Returns NULL if the memory could not be made available.
+ *
+ * This never sleeps, so it may be called from interrupt handlers: the heap's
+ * locks are spinlocks that are only held with interrupts masked.
+ */
+void *kmalloc_ext(size_t s, kmalloc_flags_t flags, phys_addr_t *physical);
 
 /**
  * Allocates a chunk of memory, at least s bytes in size. Returns NULL if the
@@ -14,7 +42,7 @@ void *kmalloc(size_t s);
  * physical address of the page in the specified memory, if not NULL. Returns
  * NULL if memory could not be allocated.
  */
-void *kmalloc_ap(size_t s, uintptr_t *physical);
+void *kmalloc_ap(size_t s, phys_addr_t *physical);
 
 /**
  * Frees the specified chunk of memory. Pointer p must point to the beginning of
@@ -0,0 +1,697 @@
+#include "map.h"
+#include "physical.h"
+
+#include "kmalloc.h"
+
+// Page size is determined by hardware, but all platforms support 4K pages.
+#define	PAGE_SIZE 0x1000
+
+// Map that is active on each processor
+static vm_map_t *current_maps[PLATFORM_MAX_CPUS];
+
+// Number of physical extents translated at once when walking a region
+#define	MAP_EXTENTS 8
+
+// Number of pages whose state is scanned at once
+#define	MAP_SCAN_PAGES 64
+
+// Number of pages reclaimed before retrying an allocation that failed
+#define	MAP_RECLAIM_PAGES 16
+
+// Gets the region that contains a tree node
+#define	REGION(n) rbtree_entry((n), vm_region_t, node)
+
+/**
+ * Gets the platform flags with which pages in a region are mapped. If writable
+ * is false, pages are always mapped read-only.
+ */
+static platform_page_flags_t region_page_flags(vm_region_t *r, bool writable) {
+	platform_page_flags_t flags = 0;
+
+	if(r->flags & kVMAttributeUser) flags |= kPlatformPageUser;
+	if(r->flags & kVMAttributeUncached) flags |= kPlatformPageUncachable;
+	if(r->flags & kVMAttributeWriteThru) flags |= kPlatformPageWritethrough;
+	if(r->flags & kVMAttributeNoExecute) flags |= kPlatformPageNoExecute;
+
+	if(!writable || (r->flags & kVMAttributeReadOnly)) {
+		flags |= kPlatformPageReadOnly;
+	}
+
+	return flags;
+}
+
+/**
+ * Allocates a region structure, taking a reference to the backing object.
+ */
+static vm_region_t *region_alloc(uintptr_t start, uintptr_t end, vm_attribute_t flags,
+								 vm_object_t *object, uintptr_t offset) {
+	vm_region_t *r = (vm_region_t *) kmalloc(sizeof(vm_region_t));
+
+	if(unlikely(!r)) {
+		return NULL;
+	}
+
+	r->start = start;
+	r->end = end;
+	r->flags = flags;
+	r->object = object;
+	r->offset = offset;
+
+	if(object) {
+		atomic_inc(&object->refs);
+	}
+
+	return r;
+}
+
+/**
+ * Frees a region structure, dropping its reference to the backing object.
+ */
+static void region_free(vm_region_t *r) {
+	if(r->object && atomic_sub_and_test(1, &r->object->refs)) {
+		r->object->release(r->object);
+	}
+
+	kfree(r);
+}
+
+/**
+ * Finds the first region that ends after the given address, or NULL.
+ */
+static vm_region_t *region_find_after(vm_map_t *map, uintptr_t address) {
+	rbtree_node_t *node = map->regions.root;
+	vm_region_t *found = NULL;
+
+	while(node) {
+		vm_region_t *r = REGION(node);
+
+		if(address < r->end) {
+			found = r;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Inserts a region into the map's tree. It must not overlap any others.
+ */
+static void region_link(vm_map_t *map, vm_region_t *region) {
+	rbtree_node_t **link = &map->regions.root;
+	rbtree_node_t *parent = NULL;
+
+	while(*link) {
+		parent = *link;
+		link = (region->start < REGION(parent)->start) ? &parent->left : &parent->right;
+	}
+
+	rbtree_insert(&map->regions, &region->node, parent, link);
+	map->num_regions++;
+}
+
+/**
+ * Removes a region from the map's tree.
+ */
+static void region_unlink(vm_map_t *map, vm_region_t *region) {
+	rbtree_remove(&map->regions, &region->node);
+	map->num_regions--;
+}
+
+/**
+ * Checks whether region b directly follows region a, and both can be merged.
+ */
+static bool region_can_merge(vm_region_t *a, vm_region_t *b) {
+	if(a->end != b->start || a->flags != b->flags || a->object != b->object) {
+		return false;
+	}
+
+	return !a->object || (a->offset + (a->end - a->start)) == b->offset;
+}
+
+/**
+ * Merges a region with its neighbours, where possible. Returns the region that
+ * now covers it.
+ */
+static vm_region_t *region_merge(vm_map_t *map, vm_region_t *r) {
+	rbtree_node_t *node = rbtree_prev(&r->node);
+
+	if(node && region_can_merge(REGION(node), r)) {
+		vm_region_t *prev = REGION(node);
+
+		prev->end = r->end;
+		region_unlink(map, r);
+		region_free(r);
+
+		r = prev;
+	}
+
+	node = rbtree_next(&r->node);
+
+	if(node && region_can_merge(r, REGION(node))) {
+		vm_region_t *next = REGION(node);
+
+		r->end = next->end;
+		region_unlink(map, next);
+		region_free(next);
+	}
+
+	return r;
+}
+
+/**
+ * Splits a region in two at the given address, which must lie inside it.
+ * Returns the upper part, or NULL if no memory is available.
+ */
+static vm_region_t *region_split(vm_map_t *map, vm_region_t *r, uintptr_t address) {
+	uintptr_t offset = r->offset + (address - r->start);
+	vm_region_t *upper = region_alloc(address, r->end, r->flags, r->object, offset);
+
+	if(unlikely(!upper)) {
+		return NULL;
+	}
+
+	// the lower part keeps its position in the tree
+	r->end = address;
+	region_link(map, upper);
+
+	return upper;
+}
+
+/**
+ * Unmaps all pages in a region, and drops the map's references to the memory
+ * backing them.
+ */
+static void region_release(vm_map_t *map, vm_region_t *r) {
+	platform_pm_extent_t extents[MAP_EXTENTS];
+	uintptr_t start = r->start;
+	size_t num;
+
+	do {
+		num = platform_pm_translate(map->table, start, r->end - start, extents, MAP_EXTENTS);
+
+		for(size_t i = 0; i < num; i++) {
+			platform_pm_unmap_range(map->table, extents[i].virt, extents[i].length / PAGE_SIZE);
+
+			for(size_t off = 0; off < extents[i].length; off += PAGE_SIZE) {
+				vm_phys_release(extents[i].phys + off);
+			}
+		}
+
+		if(num) {
+			start = extents[num - 1].virt + extents[num - 1].length;
+		}
+	} while(num == MAP_EXTENTS);
+}
+
+/**
+ * Creates a new, empty map, with its own pagetable.
+ */
+vm_map_t *vm_map_create(void) {
+	vm_map_t *map = (vm_map_t *) kmalloc(sizeof(vm_map_t));
+
+	if(unlikely(!map)) {
+		return NULL;
+	}
+
+	map->table = platform_pm_new();
+
+	if(unlikely(!map->table)) {
+		kfree(map);
+		return NULL;
+	}
+
+	map->regions.root = NULL;
+	map->num_regions = 0;
+	map->clock_hand = 0;
+	atomic_set(&map->lock, 0);
+
+	return map;
+}
+
+/**
+ * Releases all memory in the map, as well as the map itself. The map must not
+ * be active on any processor.
+ */
+void vm_map_destroy(vm_map_t *map) {
+	rbtree_node_t *node;
+
+	while((node = map->regions.root)) {
+		vm_region_t *r = REGION(node);
+
+		region_release(map, r);
+		region_unlink(map, r);
+		region_free(r);
+	}
+
+	platform_pm_destroy(map->table);
+	kfree(map);
+}
+
+/**
+ * Adds an anonymous region to the map. Its pages are allocated and zeroed when
+ * they are first accessed. Returns 0 on success, or -1 if the range is not page
+ * aligned, not in user space, or overlaps an existing region.
+ */
+int vm_map_add(vm_map_t *map, uintptr_t start, size_t size, vm_attribute_t flags) {
+	return vm_map_add_object(map, start, size, flags, NULL, 0);
+}
+
+/**
+ * Adds a region to the map, which is backed by the given object, starting at
+ * the given offset into it. Pages are filled by the object when they are first
+ * accessed. Returns 0 on success, or -1 on error, as with vm_map_add.
+ *
+ * The region is merged with adjacent regions, if they have the same attributes
+ * and backing.
+ */
+int vm_map_add_object(vm_map_t *map, uintptr_t start, size_t size,
+					  vm_attribute_t flags, vm_object_t *object,
+					  uintptr_t offset) {
+	if((start & (PAGE_SIZE - 1)) || (size & (PAGE_SIZE - 1)) || !size) {
+		return -1;
+	}
+
+	if(size > VM_KERNEL_BASE || start > (VM_KERNEL_BASE - size)) {
+		return -1;
+	}
+
+	vm_region_t *region = region_alloc(start, start + size, flags, object, offset);
+
+	if(unlikely(!region)) {
+		return -1;
+	}
+
+	mutex_take_spin(&map->lock);
+
+	// the first region ending after the start must begin after the new one
+	vm_region_t *next = region_find_after(map, start);
+
+	if(next && next->start < region->end) {
+		mutex_give(&map->lock);
+
+		region_free(region);
+		return -1;
+	}
+
+	region_link(map, region);
+	region_merge(map, region);
+
+	mutex_give(&map->lock);
+
+	return 0;
+}
+
+/**
+ * Removes a range of addresses from the map, and releases the memory that
+ * backs it. Regions that are partially covered by the range are split. Returns
+ * 0 on success, -1 if the range is not page aligned.
+ */
+int vm_map_remove(vm_map_t *map, uintptr_t start, size_t size) {
+	if((start & (PAGE_SIZE - 1)) || (size & (PAGE_SIZE - 1))) {
+		return -1;
+	}
+
+	uintptr_t end = start + size;
+	int err = 0;
+
+	mutex_take_spin(&map->lock);
+
+	vm_region_t *r = region_find_after(map, start);
+
+	while(r && r->start < end) {
+		// keep the parts of the region outside of the range
+		if(r->start < start) {
+			r = region_split(map, r, start);
+
+			if(unlikely(!r)) {
+				err = -1;
+				break;
+			}
+		}
+
+		if(r->end > end && unlikely(!region_split(map, r, end))) {
+			err = -1;
+			break;
+		}
+
+		rbtree_node_t *next = rbtree_next(&r->node);
+
+		region_release(map, r);
+		region_unlink(map, r);
+		region_free(r);
+
+		r = next ? REGION(next) : NULL;
+	}
+
+	mutex_give(&map->lock);
+
+	return err;
+}
+
+/**
+ * Returns the region that contains the given address, or NULL. The map must
+ * be locked while the region is used.
+ */
+vm_region_t *vm_map_find(vm_map_t *map, uintptr_t address) {
+	rbtree_node_t *node = map->regions.root;
+
+	while(node) {
+		vm_region_t *r = REGION(node);
+
+		if(address < r->start) {
+			node = node->left;
+		} else if(address >= r->end) {
+			node = node->right;
+		} else {
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates a copy of a map. All pages are shared with the original, and copied
+ * when either map first writes to them.
+ */
+vm_map_t *vm_map_fork(vm_map_t *map) {
+	vm_map_t *child = vm_map_create();
+
+	if(unlikely(!child)) {
+		return NULL;
+	}
+
+	mutex_take_spin(&map->lock);
+
+	for(rbtree_node_t *node = rbtree_first(&map->regions); node; node = rbtree_next(node)) {
+		vm_region_t *r = REGION(node);
+		vm_region_t *copy = region_alloc(r->start, r->end, r->flags, r->object, r->offset);
+
+		if(unlikely(!copy)) {
+			mutex_give(&map->lock);
+
+			vm_map_destroy(child);
+			return NULL;
+		}
+
+		region_link(child, copy);
+
+		// share all pages that are present, read-only in both maps
+		platform_page_flags_t flags = region_page_flags(r, false);
+		bool writable = !(r->flags & kVMAttributeReadOnly);
+
+		platform_pm_extent_t extents[MAP_EXTENTS];
+		uintptr_t start = r->start;
+		size_t num;
+
+		do {
+			num = platform_pm_translate(map->table, start, r->end - start, extents, MAP_EXTENTS);
+
+			for(size_t i = 0; i < num; i++) {
+				size_t pages = extents[i].length / PAGE_SIZE;
+
+				for(size_t off = 0; off < extents[i].length; off += PAGE_SIZE) {
+					vm_phys_retain(extents[i].phys + off);
+				}
+
+				platform_pm_map_range(child->table, extents[i].virt, extents[i].phys, pages, flags);
+
+				// this also updates the TLB if the original is active
+				if(writable) {
+					platform_pm_map_range(map->table, extents[i].virt, extents[i].phys, pages, flags);
+				}
+			}
+
+			if(num) {
+				start = extents[num - 1].virt + extents[num - 1].length;
+			}
+		} while(num == MAP_EXTENTS);
+	}
+
+	mutex_give(&map->lock);
+
+	return child;
+}
+
+/**
+ * Checks whether a page, in the given state, can be reclaimed: it must not
+ * have been accessed since the clock hand last passed it, and its contents
+ * must be the same as when it was filled.
+ *
+ * Writable pages are only mapped writable once they are no longer shared, and
+ * copies made on write are mapped dirty, so a clean, writable page still holds
+ * what it was filled with. Pages of writable regions that are mapped read-only
+ * may have been written before the map was forked, so they are kept.
+ */
+static inline bool region_can_reclaim(vm_region_t *r, platform_page_state_t state) {
+	if(!(state & kPlatformPageStatePresent) ||
+	   (state & (kPlatformPageStateAccessed | kPlatformPageStateDirty))) {
+		return false;
+	}
+
+	return (state & kPlatformPageStateWritable) || (r->flags & kVMAttributeReadOnly);
+}
+
+/**
+ * Advances the clock hand over the map, with the map locked, reclaiming up to
+ * pages pages. The hand passes over every page at most twice, so that pages
+ * whose accessed bit it cleared can be reclaimed on its second pass.
+ */
+static size_t map_reclaim(vm_map_t *map, size_t pages) {
+	platform_page_state_t states[MAP_SCAN_PAGES];
+	size_t reclaimed = 0;
+
+	// count the pages the hand passes over
+	size_t total = 0;
+
+	for(rbtree_node_t *node = rbtree_first(&map->regions); node; node = rbtree_next(node)) {
+		total += (REGION(node)->end - REGION(node)->start) / PAGE_SIZE;
+	}
+
+	size_t budget = total * 2;
+	vm_region_t *r = region_find_after(map, map->clock_hand);
+
+	while(reclaimed < pages && budget) {
+		// wrap around at the end of the address space
+		if(!r) {
+			rbtree_node_t *first = rbtree_first(&map->regions);
+
+			if(!first) {
+				break;
+			}
+
+			r = REGION(first);
+			map->clock_hand = r->start;
+		}
+
+		uintptr_t start = (map->clock_hand > r->start) ? map->clock_hand : r->start;
+		size_t count = (r->end - start) / PAGE_SIZE;
+
+		if(count > MAP_SCAN_PAGES) {
+			count = MAP_SCAN_PAGES;
+		}
+
+		if(count > budget) {
+			count = budget;
+		}
+
+		platform_pm_scan(map->table, start, count, states, kPlatformPageStateAccessed);
+
+		for(size_t i = 0; i < count && reclaimed < pages; i++) {
+			if(!region_can_reclaim(r, states[i])) {
+				continue;
+			}
+
+			uintptr_t page = start + (i * PAGE_SIZE);
+			phys_addr_t phys = platform_pm_virt_to_phys(map->table, page);
+
+			platform_pm_unmap_range(map->table, page, 1);
+			vm_phys_release(phys);
+
+			reclaimed++;
+		}
+
+		map->clock_hand = start + (count * PAGE_SIZE);
+		budget -= count;
+
+		if(map->clock_hand >= r->end) {
+			rbtree_node_t *next = rbtree_next(&r->node);
+			r = next ? REGION(next) : NULL;
+
+			map->clock_hand = r ? r->start : 0;
+		}
+	}
+
+	return reclaimed;
+}
+
+/**
+ * Unmaps up to pages pages that were not accessed recently and can be filled
+ * again when next accessed, and releases the memory backing them. Returns the
+ * number of pages that were reclaimed.
+ */
+size_t vm_map_reclaim(vm_map_t *map, size_t pages) {
+	mutex_take_spin(&map->lock);
+	size_t reclaimed = map_reclaim(map, pages);
+	mutex_give(&map->lock);
+
+	return reclaimed;
+}
+
+/**
+ * Returns the number of pages in the map that were accessed since the last
+ * call, and resets their accessed bits.
+ */
+size_t vm_map_working_set(vm_map_t *map) {
+	platform_page_state_t states[MAP_SCAN_PAGES];
+	size_t accessed = 0;
+
+	mutex_take_spin(&map->lock);
+
+	for(rbtree_node_t *node = rbtree_first(&map->regions); node; node = rbtree_next(node)) {
+		vm_region_t *r = REGION(node);
+
+		for(uintptr_t start = r->start; start < r->end; start += MAP_SCAN_PAGES * PAGE_SIZE) {
+			size_t count = (r->end - start) / PAGE_SIZE;
+
+			if(count > MAP_SCAN_PAGES) {
+				count = MAP_SCAN_PAGES;
+			}
+
+			platform_pm_scan(map->table, start, count, states, kPlatformPageStateAccessed);
+
+			for(size_t i = 0; i < count; i++) {
+				if(states[i] & kPlatformPageStateAccessed) {
+					accessed++;
+				}
+			}
+		}
+	}
+
+	mutex_give(&map->lock);
+
+	return accessed;
+}
+
+/**
+ * Makes the map the active one on the current processor.
+ */
+void vm_map_switchto(vm_map_t *map) {
+	current_maps[platform_cpu_id()] = map;
+	platform_pm_switchto(map ? map->table : vm_get_pagetable());
+}
+
+/**
+ * Returns the map that is active on the current processor, or NULL if only the
+ * kernel is mapped.
+ */
+vm_map_t *vm_map_current(void) {
+	return current_maps[platform_cpu_id()];
+}
+
+/**
+ * Allocates a frame for a page that is not present in a region, and fills it
+ * with the page's contents. Returns 0 if no memory is available.
+ */
+static phys_addr_t vm_map_fill(vm_region_t *r, uintptr_t page) {
+	// anonymous memory is zero filled
+	if(!r->object) {
+		return vm_allocate_phys_zeroed();
+	}
+
+	phys_addr_t phys = vm_allocate_phys();
+
+	if(unlikely(!phys)) {
+		return 0;
+	}
+
+	if(r->object->fill(r->object, r->offset + (page - r->start), phys)) {
+		vm_deallocate_phys(phys);
+		return 0;
+	}
+
+	return phys;
+}
+
+/**
+ * Resolves a fault on a page in a region, with the map locked. The access has
+ * already been checked against the region's permissions.
+ */
+static bool vm_map_resolve(vm_map_t *map, vm_region_t *r, uintptr_t page, bool write) {
+	platform_page_flags_t flags = region_page_flags(r, true);
+
+	// not present: allocate and fill a page
+	if(!platform_pm_is_valid(map->table, page, false)) {
+		phys_addr_t phys = vm_map_fill(r, page);
+
+		// under memory pressure, reclaim cold pages of this map and try again
+		if(unlikely(!phys) && map_reclaim(map, MAP_RECLAIM_PAGES)) {
+			phys = vm_map_fill(r, page);
+		}
+
+		if(unlikely(!phys)) {
+			return false;
+		}
+
+		platform_pm_map_range(map->table, page, phys, 1, flags);
+		return true;
+	}
+
+	// a read of a present page: another processor resolved the fault already
+	if(!write) {
+		return true;
+	}
+
+	// write to a read-only page in a writable region: copy it if it's shared
+	phys_addr_t phys = platform_pm_virt_to_phys(map->table, page);
+
+	if(vm_phys_refs(phys) > 1) {
+		// the page is read through its existing mapping
+		ASSERT(map == vm_map_current());
+
+		phys_addr_t copy = vm_allocate_phys();
+
+		if(unlikely(!copy)) {
+			return false;
+		}
+
+		// the copy differs from what the region is filled with
+		vm_phys_copy(copy, (void *) page);
+		platform_pm_map_range(map->table, page, copy, 1, flags | kPlatformPageDirty);
+
+		vm_phys_release(phys);
+	} else {
+		// all other references are gone, so the page can be written directly
+		platform_pm_map_range(map->table, page, phys, 1, flags | kPlatformPageDirty);
+	}
+
+	return true;
+}
+
+/**
+ * Attempts to resolve a page fault at the given address in the map. Returns
+ * true if the access can be retried, or false if it is invalid.
+ */
+bool vm_map_fault(vm_map_t *map, uintptr_t address, bool write, bool user) {
+	bool resolved = false;
+
+	if(!map || address >= VM_KERNEL_BASE) {
+		return false;
+	}
+
+	mutex_take_spin(&map->lock);
+
+	vm_region_t *r = vm_map_find(map, address);
+
+	if(r && !(write && (r->flags & kVMAttributeReadOnly)) &&
+	   !(user && !(r->flags & kVMAttributeUser))) {
+		resolved = vm_map_resolve(map, r, address & ~(PAGE_SIZE - 1), write);
+	}
+
+	mutex_give(&map->lock);
+
+	return resolved;
+}
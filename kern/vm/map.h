@@ -0,0 +1,158 @@
+#ifndef VM_MAP_H
+#define VM_MAP_H
+
+#include <types.h>
+#include "vm.h"
+
+/**
+ * Address spaces ("maps") for user processes.
+ *
+ * A map consists of a pagetable and a set of regions, which describe which
+ * ranges of the address space are valid and how they may be accessed. Regions
+ * are kept in a red-black tree, keyed by their start address, so finding the
+ * region for an address, as well as adding, splitting and removing regions,
+ * takes logarithmic time.
+ *
+ * Regions are backed lazily: pages are only allocated when they are first
+ * touched. Anonymous regions are filled with zeroes; other regions are filled
+ * from a backing object, such as a file.
+ *
+ * Forking a map shares all of its pages with the new map. Writable pages are
+ * mapped read-only in both maps, and copied when either map first writes to
+ * them, as long as the page is still shared.
+ *
+ * Under memory pressure, pages that can be recreated by filling them again are
+ * reclaimed with a clock algorithm: a hand sweeps over the map's pages, clearing
+ * their accessed bits, and pages that weren't accessed since the hand last
+ * passed them are unmapped. There is no swap, so only pages that haven't been
+ * written to since they were filled can be reclaimed.
+ */
+typedef struct vm_object vm_object_t;
+typedef struct vm_region vm_region_t;
+typedef struct vm_map vm_map_t;
+
+/**
+ * An object that provides the contents of pages in a region. It is reference
+ * counted by the regions that refer to it.
+ */
+struct vm_object {
+	/*
+	 * Fills the frame at phys with the page at the given offset into the
+	 * object. Returns 0 on success.
+	 */
+	int (*fill)(vm_object_t *object, uintptr_t offset, phys_addr_t phys);
+
+	// Called once the last region referring to the object is gone
+	void (*release)(vm_object_t *object);
+
+	atomic_t refs;
+};
+
+/**
+ * A range of virtual memory in a map, with the same access permissions and
+ * backing object.
+ */
+struct vm_region {
+	rbtree_node_t node;
+
+	// first byte of the region, and first byte past it
+	uintptr_t start;
+	uintptr_t end;
+
+	vm_attribute_t flags;
+
+	// object backing the region (NULL if anonymous) and offset of start in it
+	vm_object_t *object;
+	uintptr_t offset;
+};
+
+struct vm_map {
+	platform_pagetable_t table;
+
+	// regions, keyed by start address
+	rbtree_t regions;
+	unsigned int num_regions;
+
+	// next address to be examined for page reclaim
+	uintptr_t clock_hand;
+
+	mutex_t lock;
+};
+
+/**
+ * Creates a new, empty map, with its own pagetable.
+ */
+vm_map_t *vm_map_create(void);
+
+/**
+ * Releases all memory in the map, as well as the map itself. The map must not
+ * be active on any processor.
+ */
+void vm_map_destroy(vm_map_t *map);
+
+/**
+ * Adds an anonymous region to the map. Its pages are allocated and zeroed when
+ * they are first accessed. Returns 0 on success, or -1 if the range is not page
+ * aligned, not in user space, or overlaps an existing region.
+ */
+int vm_map_add(vm_map_t *map, uintptr_t start, size_t size, vm_attribute_t flags);
+
+/**
+ * Adds a region to the map, which is backed by the given object, starting at
+ * the given offset into it. Pages are filled by the object when they are first
+ * accessed. Returns 0 on success, or -1 on error, as with vm_map_add.
+ */
+int vm_map_add_object(vm_map_t *map, uintptr_t start, size_t size,
+					  vm_attribute_t flags, vm_object_t *object,
+					  uintptr_t offset);
+
+/**
+ * Removes a range of addresses from the map, and releases the memory that
+ * backs it. Regions that are partially covered by the range are split. Returns
+ * 0 on success, -1 if the range is not page aligned.
+ */
+int vm_map_remove(vm_map_t *map, uintptr_t start, size_t size);
+
+/**
+ * Returns the region that contains the given address, or NULL. The map must
+ * be locked while the region is used.
+ */
+vm_region_t *vm_map_find(vm_map_t *map, uintptr_t address);
+
+/**
+ * Creates a copy of a map. All pages are shared with the original, and copied
+ * when either map first writes to them.
+ */
+vm_map_t *vm_map_fork(vm_map_t *map);
+
+/**
+ * Unmaps up to pages pages that were not accessed recently and can be filled
+ * again when next accessed, and releases the memory backing them. Returns the
+ * number of pages that were reclaimed.
+ */
+size_t vm_map_reclaim(vm_map_t *map, size_t pages);
+
+/**
+ * Returns the number of pages in the map that were accessed since the last
+ * call, and resets their accessed bits.
+ */
+size_t vm_map_working_set(vm_map_t *map);
+
+/**
+ * Makes the map the active one on the current processor.
+ */
+void vm_map_switchto(vm_map_t *map);
+
+/**
+ * Returns the map that is active on the current processor, or NULL if only the
+ * kernel is mapped.
+ */
+vm_map_t *vm_map_current(void);
+
+/**
+ * Attempts to resolve a page fault at the given address in the map. Returns
+ * true if the access can be retried, or false if it is invalid.
+ */
+bool vm_map_fault(vm_map_t *map, uintptr_t address, bool write, bool user);
+
+#endif
@@ -2,75 +2,448 @@
 #include "physical.h"
 
 #include "kmalloc.h"
+#include "kheap.h"
 
 /**
  * Physical memory manager. This keeps track of what physical memory pages have
  * been allocated, to whom they are allocated, and what their current state is.
+ *
+ * Free memory is managed by a binary buddy allocator: every free block is a
+ * naturally aligned run of 2^order frames. Each order has a bitmap with one
+ * bit per block of that order, which is clear if the block is free, and set
+ * if it is in use, split into smaller blocks, or merged into a larger one.
+ *
+ * The bitmaps keep summaries of full words, so a free block is found with a
+ * bsf per summary level rather than a scan over the whole bitmap.
+ *
+ * Memory is split into zones at the addresses that DMA capable devices can
+ * reach (16M for ISA, and 4G), and each zone counts its own free blocks. Blocks
+ * are taken from the highest zone that has one, so low memory is kept for the
+ * devices that can't use anything else.
+ *
+ * Single pages are served from a per-CPU magazine of free frames in front of
+ * the buddy allocator. Only refilling or draining a magazine takes the global
+ * lock, and then moves a whole batch of frames at once.
+ *
+ * A separate pool holds frames that are known to be filled with zeroes. It is
+ * refilled while the system is idle, so callers that need cleared memory do
+ * not have to clear it themselves.
+ *
+ * Frames that are mapped in more than one place (such as copy-on-write pages
+ * shared after a fork) have a reference count. Only the extra references are
+ * stored, so a frame with a single owner needs no bookkeeping.
  */
 
 // Page size is determined by hardware, but all platforms support 4K pages.
 #define	PAGE_SIZE 0x1000
 
-// A bitmap of 4K frames of physical memory that are available.
-static unsigned int* frames;
+// Number of frames in the system, and a bitmap of free blocks for each order
 static unsigned int nframes;
+static bitmap_t free_maps[VM_PHYS_MAX_ORDER + 1];
+
+/**
+ * Zones of physical memory. Zone boundaries are aligned to the largest block
+ * size, so a block never straddles two zones.
+ */
+enum {
+	kPhysZoneISA,
+	kPhysZone32Bit,
+	kPhysZoneHigh,
+
+	kPhysNumZones
+};
+
+// First frame of each zone; the last zone extends to the end of memory
+static const unsigned int zone_base[kPhysNumZones] = {
+	0,
+	VM_PHYS_LIMIT_ISA / PAGE_SIZE,
+	VM_PHYS_LIMIT_32BIT / PAGE_SIZE,
+};
+
+// Number of free blocks of each order, in each zone
+static unsigned int free_blocks[kPhysNumZones][VM_PHYS_MAX_ORDER + 1];
+
+// Protects the buddy allocator's state
+static mutex_t phys_lock;
 
-// Macros used in the bitset algorithms.
-#define INDEX_FROM_BIT(a) (a/(8*4))
-#define OFFSET_FROM_BIT(a) (a%(8*4))
+// Number of frames a magazine holds, and how many are moved at once
+#define	MAGAZINE_SIZE	64
+#define	MAGAZINE_BATCH	32
 
 /**
- * Set a bit in the frames bitset
- *
- * @param frame_addr Physical memory address
+ * A per-CPU stack of free frames. It is only touched by its own CPU, with
+ * interrupts masked.
+ */
+typedef struct {
+	unsigned int count;
+	unsigned int frames[MAGAZINE_SIZE];
+} phys_magazine_t;
+
+static phys_magazine_t magazines[PLATFORM_MAX_CPUS];
+
+// Number of frames kept in the zeroed pool, and how many are cleared per call
+#define	ZERO_POOL_SIZE	256
+#define	ZERO_POOL_BATCH	8
+
+/*
+ * Pool of frames that have already been cleared. Its lock may be held while
+ * taking the buddy lock, but not the other way around.
+ */
+static struct {
+	mutex_t lock;
+
+	unsigned int count;
+	unsigned int frames[ZERO_POOL_SIZE];
+} zero_pool;
+
+// Set once the scratch mappings used to clear frames can be used
+static bool scratch_ready;
+
+/*
+ * Number of extra references to each frame, protected by the buddy lock. This
+ * is allocated once the kernel heap is up, as it can be much larger than what
+ * the boot pagetables map.
+ */
+static uint16_t *frame_refs;
+
+// Early heap left for the allocations that follow the bitmaps during boot
+#define	PHYS_EARLY_RESERVE	0x10000
+
+// Number of blocks of a given order that cover all frames
+#define BLOCKS_IN_ORDER(o) ((nframes + (1 << (o)) - 1) >> (o))
+
+/**
+ * Returns the zone that a frame belongs to.
+ */
+static inline unsigned int zone_of(unsigned int frame) {
+	unsigned int zone = kPhysNumZones - 1;
+
+	while(frame < zone_base[zone]) {
+		zone--;
+	}
+
+	return zone;
+}
+
+/**
+ * Checks whether the block at the given frame is free at the given order.
+ */
+static inline bool block_is_free(unsigned int frame, unsigned int order) {
+	unsigned int block = frame >> order;
+
+	if(unlikely(block >= BLOCKS_IN_ORDER(order))) {
+		return false;
+	}
+
+	return !bitmap_test(&free_maps[order], block);
+}
+
+/**
+ * Puts the block at the given frame on the free map of an order.
+ */
+static inline void block_mark_free(unsigned int frame, unsigned int order) {
+	bitmap_clear(&free_maps[order], frame >> order);
+	free_blocks[zone_of(frame)][order]++;
+}
+
+/**
+ * Takes the block at the given frame off the free map of an order.
+ */
+static inline void block_mark_used(unsigned int frame, unsigned int order) {
+	bitmap_set(&free_maps[order], frame >> order);
+	free_blocks[zone_of(frame)][order]--;
+}
+
+/**
+ * Finds the first free block of the given order in a zone, and returns its
+ * first frame. The caller must make sure that the zone has free blocks of that
+ * order; as blocks don't straddle zones, the first free block after the start
+ * of the zone is then inside it.
  */
-static inline void set_frame(uintptr_t frame_addr) {
-	unsigned int frame = frame_addr / PAGE_SIZE;
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	frames[idx] |= (0x1 << off);
+static inline unsigned int find_free_block(unsigned int zone, unsigned int order) {
+	return bitmap_find_clear_from(&free_maps[order], zone_base[zone] >> order) << order;
 }
 
 /**
- * Clear a bit in the frames bitset
+ * Frees a block of 2^order frames, merging it with its buddies for as long as
+ * they are free as well.
+ */
+static void buddy_free(unsigned int frame, unsigned int order) {
+	while(order < VM_PHYS_MAX_ORDER) {
+		unsigned int buddy = frame ^ (1 << order);
+
+		if(!block_is_free(buddy, order)) {
+			break;
+		}
+
+		// take the buddy off its free map, and continue with the merged block
+		block_mark_used(buddy, order);
+
+		frame &= ~(1 << order);
+		order++;
+	}
+
+	block_mark_free(frame, order);
+}
+
+/**
+ * Allocates a block of 2^order frames, of which at least the first pages must
+ * lie below the frame limit, splitting larger blocks if needed. Returns the
+ * first frame, or -1 if there is no suitable block.
  *
- * @param frame_addr Physical memory address
+ * Zones are tried from the highest one below the limit down, and within each
+ * zone, the smallest order with a free block is used. Only the lowest free
+ * block of each order is checked: if it is not below the limit, none of the
+ * others are either.
+ */
+static unsigned int buddy_alloc_below(unsigned int order, unsigned int pages, unsigned int limit) {
+	for(int zone = zone_of(limit - 1); zone >= 0; zone--) {
+		for(unsigned int o = order; o <= VM_PHYS_MAX_ORDER; o++) {
+			if(!free_blocks[zone][o]) {
+				continue;
+			}
+
+			unsigned int frame = find_free_block(zone, o);
+
+			if(frame >= limit || pages > (limit - frame)) {
+				continue;
+			}
+
+			block_mark_used(frame, o);
+
+			// split it down: the upper half of each split becomes free
+			while(o > order) {
+				o--;
+				block_mark_free(frame + (1 << o), o);
+			}
+
+			return frame;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Allocates a block of 2^order frames, splitting larger blocks if needed.
+ * Returns the first frame, or -1 if there is no block large enough.
+ */
+static inline unsigned int buddy_alloc(unsigned int order) {
+	return buddy_alloc_below(order, 1 << order, nframes);
+}
+
+/**
+ * Removes a single frame from the free pool, if it is free. The free block
+ * that contains it is split, with all other parts remaining free.
+ */
+static void buddy_claim(unsigned int frame) {
+	unsigned int o;
+
+	// find the order of the free block that contains this frame
+	for(o = 0; o <= VM_PHYS_MAX_ORDER; o++) {
+		if(block_is_free(frame & ~((1 << o) - 1), o)) {
+			break;
+		}
+	}
+
+	// frame is already allocated
+	if(o > VM_PHYS_MAX_ORDER) {
+		return;
+	}
+
+	unsigned int block = frame & ~((1 << o) - 1);
+	block_mark_used(block, o);
+
+	// split down, freeing whichever half does not contain the frame
+	while(o > 0) {
+		o--;
+
+		if(frame & (1 << o)) {
+			block_mark_free(block, o);
+			block += (1 << o);
+		} else {
+			block_mark_free(block + (1 << o), o);
+		}
+	}
+}
+
+/**
+ * Masks interrupts, so the current CPU's magazine can be used. Returns the
+ * previous interrupt state.
+ */
+static inline bool phys_local_lock(void) {
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	return enabled;
+}
+
+/**
+ * Restores the interrupt state saved by phys_local_lock.
  */
-/*static void clear_frame(uintptr_t frame_addr) {
-	unsigned int frame = frame_addr / PAGE_SIZE;
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	frames[idx] &= ~(0x1 << off);
-}*/
+static inline void phys_local_unlock(bool enabled) {
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+}
 
 /**
- * Check if a certain page is allocated.
+ * Fills up a magazine with a batch of frames from the buddy allocator.
+ */
+static void magazine_refill(phys_magazine_t *mag) {
+	unsigned int first = mag->count;
+
+	mutex_take_spin(&phys_lock);
+
+	while(mag->count < MAGAZINE_BATCH) {
+		unsigned int frame = buddy_alloc(0);
+
+		if(unlikely(frame == -1)) {
+			break;
+		}
+
+		mag->frames[mag->count++] = frame;
+	}
+
+	mutex_give(&phys_lock);
+
+	/*
+	 * Frames come out of the buddy allocator in ascending order; reverse them,
+	 * so that they are popped in ascending order as well. Callers that map
+	 * pages one by one then get physically contiguous runs more often.
+	 */
+	for(unsigned int i = first, j = mag->count; (i + 1) < j; i++, j--) {
+		unsigned int tmp = mag->frames[i];
+		mag->frames[i] = mag->frames[j - 1];
+		mag->frames[j - 1] = tmp;
+	}
+}
+
+/**
+ * Returns a batch of frames from a magazine to the buddy allocator. If count
+ * is larger than the number of frames in the magazine, it is emptied.
+ */
+static void magazine_drain(phys_magazine_t *mag, unsigned int count) {
+	mutex_take_spin(&phys_lock);
+
+	while(mag->count && count--) {
+		buddy_free(mag->frames[--mag->count], 0);
+	}
+
+	mutex_give(&phys_lock);
+}
+
+/**
+ * Takes a frame from the zeroed pool, for when the buddy allocator has run
+ * out. Returns -1 if the pool is empty. Interrupts must be masked.
+ */
+static unsigned int zero_pool_take(void) {
+	unsigned int frame = -1;
+
+	mutex_take_spin(&zero_pool.lock);
+
+	if(zero_pool.count) {
+		frame = zero_pool.frames[--zero_pool.count];
+	}
+
+	mutex_give(&zero_pool.lock);
+	return frame;
+}
+
+/**
+ * Returns all frames in the zeroed pool to the buddy allocator, so they can
+ * merge back into larger blocks. Returns false if the pool was empty.
+ * Interrupts must be masked.
+ */
+static bool zero_pool_drain(void) {
+	mutex_take_spin(&zero_pool.lock);
+	bool drained = (zero_pool.count != 0);
+
+	if(drained) {
+		mutex_take_spin(&phys_lock);
+
+		while(zero_pool.count) {
+			buddy_free(zero_pool.frames[--zero_pool.count], 0);
+		}
+
+		mutex_give(&phys_lock);
+	}
+
+	mutex_give(&zero_pool.lock);
+	return drained;
+}
+
+/**
+ * Adds the frames in [start, end) to the free pool, as the largest aligned
+ * blocks that fit.
+ */
+static void buddy_free_range(unsigned int start, unsigned int end) {
+	while(start < end) {
+		unsigned int order = 0;
+
+		while(order < VM_PHYS_MAX_ORDER && !(start & (1 << order)) &&
+			  (start + (2 << order)) <= end) {
+			order++;
+		}
+
+		buddy_free(start, order);
+		start += (1 << order);
+	}
+}
+
+/**
+ * Allocates a run of pages frames that is larger than the largest block, or
+ * aligned to more than its size, from consecutive free blocks of the largest
+ * order. The first frame is a multiple of align, and the run ends at or below
+ * the frame limit. Returns the first frame, or -1 if there is no such run.
  *
- * @param frame_addr Physical memory address
- */
-/*static bool test_frame(uintptr_t frame_addr) {
-	unsigned int frame = frame_addr / PAGE_SIZE;
-	unsigned int idx = INDEX_FROM_BIT(frame);
-	unsigned int off = OFFSET_FROM_BIT(frame);
-	return (frames[idx] & (0x1 << off));
-}*/
-
-/**
- * Find the first free frame that can be allocated
- */
-static uintptr_t find_free_frame() {
-	unsigned int i, j;
-	for(i = 0; i < INDEX_FROM_BIT(nframes); i++) {
-		if(frames[i] != 0xFFFFFFFF) { // nothing free, check next
-			// At least one bit is free here
-			for (j = 0; j < 32; j++) {
-				unsigned int toTest = 0x1 << j;
-
-				// If this frame is free, return
-				if (!(frames[i] & toTest)) {
-					return i*4*8+j;
-				}
+ * As with single blocks, the highest zone is searched first: runs may extend
+ * past the end of the zone they start in, but the search for a lower zone ends
+ * where the next one starts.
+ */
+static unsigned int buddy_alloc_run(unsigned int pages, unsigned int align, unsigned int limit) {
+	const unsigned int o = VM_PHYS_MAX_ORDER;
+
+	unsigned int count = (pages + (1 << o) - 1) >> o;
+	unsigned int step = (align > (1 << o)) ? (align >> o) : 1;
+
+	unsigned int top = zone_of(limit - 1);
+
+	for(int zone = top; zone >= 0; zone--) {
+		unsigned int end = (zone == top) ? limit : zone_base[zone + 1];
+		unsigned int block = zone_base[zone] >> o;
+
+		for(;;) {
+			block = bitmap_find_clear_from(&free_maps[o], block);
+
+			if(block == BITMAP_NOT_FOUND) {
+				break;
+			}
+
+			block = (block + step - 1) & ~(step - 1);
+			unsigned int frame = block << o;
+
+			if(frame >= end || pages > (limit - frame)) {
+				break;
+			}
+
+			// the whole run must be free; if not, continue past the used block
+			unsigned int i = 0;
+
+			while(i < count && block_is_free(frame + (i << o), o)) {
+				i++;
+			}
+
+			if(i < count) {
+				block += i + 1;
+				continue;
 			}
+
+			for(i = 0; i < count; i++) {
+				block_mark_used(frame + (i << o), o);
+			}
+
+			return frame;
 		}
 	}
 
@@ -78,40 +451,578 @@ static uintptr_t find_free_frame() {
 }
 
 /**
- * Initialises the physical memory manager, with the given number of physical
- * memory available.
+ * Allocates pages contiguous frames, starting at a multiple of align frames
+ * and ending at or below the frame limit. Whatever the block or run holds past
+ * the last frame is freed again. Returns the first frame, or -1.
+ */
+static unsigned int buddy_alloc_contig(unsigned int pages, unsigned int align, unsigned int limit) {
+	unsigned int order = 0;
+
+	while(order <= VM_PHYS_MAX_ORDER && ((1U << order) < pages || (1U << order) < align)) {
+		order++;
+	}
+
+	unsigned int frame, end;
+
+	if(order <= VM_PHYS_MAX_ORDER) {
+		frame = buddy_alloc_below(order, pages, limit);
+		end = frame + (1 << order);
+	} else {
+		frame = buddy_alloc_run(pages, align, limit);
+		end = frame + (((pages + (1 << VM_PHYS_MAX_ORDER) - 1) >> VM_PHYS_MAX_ORDER) << VM_PHYS_MAX_ORDER);
+	}
+
+	if(likely(frame != -1)) {
+		buddy_free_range(frame + pages, end);
+	}
+
+	return frame;
+}
+
+// Highest physical address the allocator can manage, as frames are 32 bits
+#define	PHYS_ADDR_LIMIT	(((phys_addr_t) UINT_MAX) * PAGE_SIZE)
+
+// First physical address that is not used, set up during initialisation
+static phys_addr_t phys_limit;
+
+/**
+ * Gets the range of whole frames in a region, clipped to the addressable
+ * physical memory. Returns false if the region contains no whole frames.
+ */
+static bool region_frames(const platform_mem_region_t *r, unsigned int *start, unsigned int *end) {
+	uint64_t base = (r->base + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+	uint64_t top = (r->base + r->length) & ~((uint64_t) PAGE_SIZE - 1);
+
+	if(top > phys_limit) {
+		top = phys_limit;
+	}
+
+	if(base >= top) {
+		return false;
+	}
+
+	*start = base / PAGE_SIZE;
+	*end = top / PAGE_SIZE;
+
+	return true;
+}
+
+/**
+ * Returns the number of bytes the free block bitmaps for the given number of
+ * frames take up on the early heap, which rounds each allocation to 16 bytes.
+ */
+static size_t phys_bitmap_bytes(unsigned int frames) {
+	size_t bytes = 0;
+
+	for(unsigned int o = 0; o <= VM_PHYS_MAX_ORDER; o++) {
+		bytes += (bitmap_storage_size((frames + (1 << o) - 1) >> o) + 0xF) & ~0xF;
+	}
+
+	return bytes;
+}
+
+/**
+ * Initialises the physical memory manager from the memory map in the boot
+ * arguments. Only regions marked as usable are handed to the allocator.
  *
- * This allocates memory for the physical memory bitmap, which is used to alloc
- * physical memory when needed.
+ * This allocates memory for the free block bitmaps of each order, sized to
+ * cover the highest usable frame, and then frees each usable region. The
+ * bitmaps come from the early heap, and so must fit into the memory mapped by
+ * the boot pagetables: any memory they can't cover is not used.
  */
-void vm_init_phys_allocator(uintptr_t bytes) {
-	// This page set allocates for lowmem, but this is reserved by the kernel
-	unsigned int mem_end_page = bytes;
-	nframes = mem_end_page / PAGE_SIZE;
-	nframes += 0x100;
+void vm_init_phys_allocator(const platform_bootargs_t *bootargs) {
+	unsigned int start, end;
+	nframes = 0;
+
+	// only use memory the platform can map
+	phys_limit = platform_pm_phys_limit();
 
-	// Allocate page frame table and clear it
-	frames = (unsigned int *) kmalloc(INDEX_FROM_BIT(nframes));
-	memclr(frames, INDEX_FROM_BIT(nframes));
+	if(phys_limit > PHYS_ADDR_LIMIT) {
+		phys_limit = PHYS_ADDR_LIMIT;
+	}
+
+	for(unsigned int i = 0; i < bootargs->num_mem_regions; i++) {
+		const platform_mem_region_t *r = &bootargs->mem_regions[i];
+
+		if(r->type == kMemoryUsable && region_frames(r, &start, &end)) {
+			nframes = (end > nframes) ? end : nframes;
+		}
+	}
+
+	ASSERT(nframes);
+
+	size_t budget = kheap_dumb_get_free();
+	budget = (budget > PHYS_EARLY_RESERVE) ? (budget - PHYS_EARLY_RESERVE) : 0;
+
+	if(unlikely(phys_bitmap_bytes(nframes) > budget)) {
+		// find the most frames whose bitmaps still fit
+		unsigned int lo = 0, hi = nframes;
+
+		while(lo < hi) {
+			unsigned int mid = lo + ((hi - lo + 1) / 2);
+
+			if(phys_bitmap_bytes(mid) <= budget) {
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+
+		KWARNING("Ignoring memory above %uM: no room for its bitmaps (%uM total)\n",
+				 lo / (0x100000 / PAGE_SIZE), nframes / (0x100000 / PAGE_SIZE));
+
+		nframes = lo;
+		phys_limit = (phys_addr_t) nframes * PAGE_SIZE;
+
+		ASSERT(nframes);
+	}
+
+	// Allocate the bitmaps for each order, with all blocks marked as used
+	for(int o = 0; o <= VM_PHYS_MAX_ORDER; o++) {
+		bool allocated = bitmap_init(&free_maps[o], BLOCKS_IN_ORDER(o), true);
+		ASSERT(allocated);
+
+		for(int z = 0; z < kPhysNumZones; z++) {
+			free_blocks[z][o] = 0;
+		}
+	}
+
+	// Free the usable regions
+	for(unsigned int i = 0; i < bootargs->num_mem_regions; i++) {
+		const platform_mem_region_t *r = &bootargs->mem_regions[i];
+
+		if(r->type == kMemoryUsable && region_frames(r, &start, &end)) {
+			buddy_free_range(start, end);
+		}
+	}
+
+	// Firmware may report overlapping regions: anything reserved wins
+	for(unsigned int i = 0; i < bootargs->num_mem_regions; i++) {
+		const platform_mem_region_t *r = &bootargs->mem_regions[i];
+
+		if(r->type != kMemoryUsable && region_frames(r, &start, &end)) {
+			for(unsigned int f = start; f < end && f < nframes; f++) {
+				buddy_claim(f);
+			}
+		}
+	}
+}
+
+/**
+ * Takes a frame from the current CPU's magazine, refilling it if needed.
+ * Returns -1 if the buddy allocator is out of memory. Interrupts must be
+ * masked.
+ */
+static unsigned int magazine_alloc(void) {
+	phys_magazine_t *mag = &magazines[platform_cpu_id()];
+
+	if(unlikely(!mag->count)) {
+		magazine_refill(mag);
+
+		if(unlikely(!mag->count)) {
+			return -1;
+		}
+	}
+
+	return mag->frames[--mag->count];
 }
 
 /**
  * Allocates a single page of physical memory. Each page is 4K in size.
+ *
+ * If the buddy allocator is out of memory, a frame is taken from the zeroed
+ * pool instead: those are just as free, only already cleared.
  */
-uintptr_t vm_allocate_phys(void) {
-	uintptr_t page = find_free_frame();
-	page *= PAGE_SIZE;
+phys_addr_t vm_allocate_phys(void) {
+	bool irq = phys_local_lock();
+
+	unsigned int frame = magazine_alloc();
+
+	if(unlikely(frame == -1)) {
+		frame = zero_pool_take();
+	}
+
+	phys_local_unlock(irq);
+
+	if(unlikely(frame == -1)) {
+		KERROR("Out of physical memory\n");
+		return 0;
+	}
 
-	set_frame(page);
+	return (phys_addr_t) frame * PAGE_SIZE;
+}
 
-	return page;
+/**
+ * Allocates a single page of physical memory below the given address, for
+ * structures that the hardware can only find at low addresses. Returns 0 if
+ * there is no free memory below it.
+ */
+phys_addr_t vm_allocate_phys_below(phys_addr_t limit) {
+	ASSERT(limit);
+	return vm_allocate_phys_contig(1, PAGE_SIZE, limit);
 }
 
 /**
  * Releases physical memory back to the system so it can be reallocated.
  */
-void vm_deallocate_phys(uintptr_t address) {
+void vm_deallocate_phys(phys_addr_t address) {
+	ASSERT((address / PAGE_SIZE) < nframes);
+
+	bool irq = phys_local_lock();
+	phys_magazine_t *mag = &magazines[platform_cpu_id()];
+
+	if(unlikely(mag->count == MAGAZINE_SIZE)) {
+		magazine_drain(mag, MAGAZINE_BATCH);
+	}
+
+	mag->frames[mag->count++] = address / PAGE_SIZE;
+	phys_local_unlock(irq);
+}
+
+/**
+ * Allocates 2^order physically contiguous pages, aligned to their size.
+ * Returns 0 if no such run of pages is available.
+ */
+phys_addr_t vm_allocate_phys_order(unsigned int order) {
+	ASSERT(order <= VM_PHYS_MAX_ORDER);
+
+	bool irq = phys_local_lock();
+
+	mutex_take_spin(&phys_lock);
+	unsigned int frame = buddy_alloc(order);
+	mutex_give(&phys_lock);
+
+	// frames sitting in this CPU's magazine may be what prevents merging
+	if(unlikely(frame == -1 && order)) {
+		magazine_drain(&magazines[platform_cpu_id()], MAGAZINE_SIZE);
+
+		mutex_take_spin(&phys_lock);
+		frame = buddy_alloc(order);
+		mutex_give(&phys_lock);
+	}
+
+	// as a last resort, give the zeroed pool's frames back to the buddies
+	if(unlikely(frame == -1) && zero_pool_drain()) {
+		mutex_take_spin(&phys_lock);
+		frame = buddy_alloc(order);
+		mutex_give(&phys_lock);
+	}
+
+	phys_local_unlock(irq);
+
+	if(unlikely(frame == -1)) {
+		KERROR("Out of physical memory (order %u)\n", order);
+		return 0;
+	}
+
+	return (phys_addr_t) frame * PAGE_SIZE;
+}
+
+/**
+ * Releases 2^order pages, previously allocated with vm_allocate_phys_order.
+ */
+void vm_deallocate_phys_order(phys_addr_t address, unsigned int order) {
+	unsigned int frame = address / PAGE_SIZE;
+
+	ASSERT(order <= VM_PHYS_MAX_ORDER);
+	ASSERT(frame < nframes);
+
+	bool irq = phys_local_lock();
+	mutex_take_spin(&phys_lock);
+
+	// catch double frees of the block
+	ASSERT(!block_is_free(frame, order));
+
+	buddy_free(frame, order);
 
+	mutex_give(&phys_lock);
+	phys_local_unlock(irq);
+}
+
+/**
+ * Allocates pages physically contiguous pages, for DMA. The first page is
+ * aligned to align, a power of two, and the last page ends at or below limit;
+ * a limit of 0 places no restriction. Returns 0 if no such run of pages is
+ * available.
+ *
+ * Runs of up to the largest block size come from a single buddy block, which
+ * is large enough for both the run and the alignment; anything larger is made
+ * up of consecutive blocks of the largest order.
+ */
+phys_addr_t vm_allocate_phys_contig(size_t pages, phys_addr_t align, phys_addr_t limit) {
+	ASSERT(pages);
+	ASSERT(!(align & (align - 1)));
+
+	// work in frames from here on
+	unsigned int align_frames = (align > PAGE_SIZE) ? (align / PAGE_SIZE) : 1;
+	unsigned int limit_frames = nframes;
+
+	if(limit && (limit / PAGE_SIZE) < nframes) {
+		limit_frames = limit / PAGE_SIZE;
+	}
+
+	unsigned int frame = -1;
+
+	if(likely(pages <= limit_frames && (align / PAGE_SIZE) < limit_frames)) {
+		bool irq = phys_local_lock();
+
+		mutex_take_spin(&phys_lock);
+		frame = buddy_alloc_contig(pages, align_frames, limit_frames);
+		mutex_give(&phys_lock);
+
+		// frames sitting in this CPU's magazine may be what prevents merging
+		if(unlikely(frame == -1)) {
+			magazine_drain(&magazines[platform_cpu_id()], MAGAZINE_SIZE);
+
+			mutex_take_spin(&phys_lock);
+			frame = buddy_alloc_contig(pages, align_frames, limit_frames);
+			mutex_give(&phys_lock);
+		}
+
+		// as a last resort, give the zeroed pool's frames back to the buddies
+		if(unlikely(frame == -1) && zero_pool_drain()) {
+			mutex_take_spin(&phys_lock);
+			frame = buddy_alloc_contig(pages, align_frames, limit_frames);
+			mutex_give(&phys_lock);
+		}
+
+		phys_local_unlock(irq);
+	}
+
+	if(unlikely(frame == -1)) {
+		KERROR("Out of physical memory (0x%X contiguous pages below %uM)\n",
+			   (unsigned int) pages, (unsigned int) (((phys_addr_t) limit_frames * PAGE_SIZE) >> 20));
+		return 0;
+	}
+
+	return (phys_addr_t) frame * PAGE_SIZE;
+}
+
+/**
+ * Releases pages pages, previously allocated with vm_allocate_phys_contig.
+ * They are freed as the largest blocks that fit, merging with their buddies.
+ */
+void vm_deallocate_phys_contig(phys_addr_t address, size_t pages) {
+	unsigned int frame = address / PAGE_SIZE;
+
+	ASSERT(!(address & (PAGE_SIZE - 1)));
+	ASSERT(frame < nframes && pages <= (nframes - frame));
+
+	bool irq = phys_local_lock();
+	mutex_take_spin(&phys_lock);
+
+	// catch double frees of the first frame
+	ASSERT(!block_is_free(frame, 0));
+
+	buddy_free_range(frame, frame + pages);
+
+	mutex_give(&phys_lock);
+	phys_local_unlock(irq);
+}
+
+/**
+ * Sets up the per-CPU scratch pages used to clear frames. This requires the
+ * kernel pagetable to be active, and its pagetable for the scratch area to
+ * exist already.
+ */
+void vm_phys_init_scratch(void) {
+	platform_pagetable_t table = vm_get_pagetable();
+
+	for(int i = 0; i < PLATFORM_MAX_CPUS; i++) {
+		uintptr_t virt = VM_SCRATCH_BASE + (i * PAGE_SIZE);
+		platform_pm_map(table, virt, 0, VM_FLAGS_KERNEL_DATA | kPlatformPageNotPresent);
+	}
+
+	scratch_ready = true;
+}
+
+/**
+ * Allocates the reference counts of frames. This is done once the kernel heap
+ * is up, and before any frame can be mapped in more than one place.
+ */
+void vm_phys_init_refs(void) {
+	frame_refs = (uint16_t *) kmalloc(nframes * sizeof(uint16_t));
+	ASSERT(frame_refs);
+
+	memclr(frame_refs, nframes * sizeof(uint16_t));
+}
+
+/**
+ * Maps a frame into the current CPU's scratch page, and returns the address it
+ * can be accessed at. Interrupts must be masked until scratch_unmap is called.
+ */
+static void *scratch_map(phys_addr_t address) {
+	ASSERT(scratch_ready);
+
+	uintptr_t virt = VM_SCRATCH_BASE + (platform_cpu_id() * PAGE_SIZE);
+
+	platform_pm_map(vm_get_pagetable(), virt, address, VM_FLAGS_KERNEL_DATA);
+	platform_pm_invalidate((void *) virt);
+
+	return (void *) virt;
+}
+
+/**
+ * Removes the mapping of the current CPU's scratch page.
+ */
+static void scratch_unmap(void *virt) {
+	platform_pm_unmap(vm_get_pagetable(), (uintptr_t) virt);
+	platform_pm_invalidate(virt);
+}
+
+/**
+ * Fills a page of physical memory with zeroes. It is temporarily mapped into
+ * the current CPU's scratch page to do so.
+ */
+void vm_phys_zero(phys_addr_t address) {
+	bool irq = phys_local_lock();
+
+	void *page = scratch_map(address);
+	memclr(page, PAGE_SIZE);
+	scratch_unmap(page);
+
+	phys_local_unlock(irq);
+}
+
+/**
+ * Copies a page of memory, at the given virtual address, into a page of
+ * physical memory, which is temporarily mapped into the scratch page.
+ */
+void vm_phys_copy(phys_addr_t address, void *src) {
+	bool irq = phys_local_lock();
+
+	void *page = scratch_map(address);
+	memcpy(page, src, PAGE_SIZE);
+	scratch_unmap(page);
+
+	phys_local_unlock(irq);
+}
+
+/**
+ * Adds a reference to a page of physical memory, when it is mapped in another
+ * place.
+ */
+void vm_phys_retain(phys_addr_t address) {
+	unsigned int frame = address / PAGE_SIZE;
+	ASSERT(frame < nframes);
+
+	bool irq = phys_local_lock();
+	mutex_take_spin(&phys_lock);
+
+	ASSERT(frame_refs[frame] != 0xFFFF);
+	frame_refs[frame]++;
+
+	mutex_give(&phys_lock);
+	phys_local_unlock(irq);
+}
+
+/**
+ * Drops a reference to a page of physical memory. The page is deallocated once
+ * its last reference is dropped.
+ */
+void vm_phys_release(phys_addr_t address) {
+	unsigned int frame = address / PAGE_SIZE;
+	ASSERT(frame < nframes);
+
+	bool irq = phys_local_lock();
+	mutex_take_spin(&phys_lock);
+
+	bool last = (frame_refs[frame] == 0);
+
+	if(!last) {
+		frame_refs[frame]--;
+	}
+
+	mutex_give(&phys_lock);
+	phys_local_unlock(irq);
+
+	if(last) {
+		vm_deallocate_phys(address);
+	}
+}
+
+/**
+ * Returns the number of references to a page of physical memory; this is 1 if
+ * it has a single owner.
+ */
+unsigned int vm_phys_refs(phys_addr_t address) {
+	unsigned int frame = address / PAGE_SIZE;
+	ASSERT(frame < nframes);
+
+	return frame_refs[frame] + 1;
+}
+
+/**
+ * Allocates a single page of physical memory that is filled with zeroes. If
+ * no pre-cleared pages are available, a page is cleared synchronously.
+ */
+phys_addr_t vm_allocate_phys_zeroed(void) {
+	bool irq = phys_local_lock();
+	unsigned int frame = zero_pool_take();
+	phys_local_unlock(irq);
+
+	if(likely(frame != -1)) {
+		return (phys_addr_t) frame * PAGE_SIZE;
+	}
+
+	// nothing in the pool: clear one now
+	phys_addr_t address = vm_allocate_phys();
+
+	if(likely(address)) {
+		vm_phys_zero(address);
+	}
+
+	return address;
+}
+
+/**
+ * Performs background work for the physical memory manager: this clears a
+ * small batch of pages for the zeroed page pool. Returns true if there is
+ * more work to do.
+ */
+bool vm_phys_idle(void) {
+	if(!scratch_ready) {
+		return false;
+	}
+
+	for(int i = 0; i < ZERO_POOL_BATCH; i++) {
+		// pool is full?
+		if(zero_pool.count >= ZERO_POOL_SIZE) {
+			return false;
+		}
+
+		// only use memory the buddy allocator has spare, never the pool itself
+		bool irq = phys_local_lock();
+		unsigned int frame = magazine_alloc();
+		phys_local_unlock(irq);
+
+		if(frame == -1) {
+			return false;
+		}
+
+		phys_addr_t address = (phys_addr_t) frame * PAGE_SIZE;
+		vm_phys_zero(address);
+
+		// add it to the pool, or give it back if the pool filled up meanwhile
+		irq = phys_local_lock();
+		mutex_take_spin(&zero_pool.lock);
+
+		bool added = (zero_pool.count < ZERO_POOL_SIZE);
+
+		if(added) {
+			zero_pool.frames[zero_pool.count++] = address / PAGE_SIZE;
+		}
+
+		mutex_give(&zero_pool.lock);
+		phys_local_unlock(irq);
+
+		if(!added) {
+			vm_deallocate_phys(address);
+			return false;
+		}
+	}
+
+	return (zero_pool.count < ZERO_POOL_SIZE);
 }
 
 /**
@@ -119,7 +1030,7 @@ void vm_deallocate_phys(uintptr_t address) {
  * used when the VM manager is first initialised, so pages belonging to kernel
  * data cannot be accidentally re-allocated.
  */
-void vm_reserve_phys(uintptr_t address) {
+void vm_reserve_phys(phys_addr_t address) {
 	// even out address to multiples of a page size
 	if(address & (PAGE_SIZE - 1)) {
 		address += PAGE_SIZE;
@@ -127,7 +1038,11 @@ void vm_reserve_phys(uintptr_t address) {
 
 	address &= ~(PAGE_SIZE - 1);
 
-	for(intptr_t i = 0; i < address; i += PAGE_SIZE) {
-		set_frame(i);
+	mutex_take_spin(&phys_lock);
+
+	for(unsigned int i = 0; i < (address / PAGE_SIZE) && i < nframes; i++) {
+		buddy_claim(i);
 	}
-}
\ No newline at end of file
+
+	mutex_give(&phys_lock);
+}
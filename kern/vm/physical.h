@@ -2,28 +2,127 @@
 #define VM_PHYSICAL_H
 
 #include <types.h>
+#include "pexpert/platform.h"
 
 /**
- * Initialises the physical memory manager, with the given number of physical
- * memory available.
+ * Largest block the physical allocator manages, as a power of two number of
+ * pages: 2^10 pages is 4M.
  */
-void vm_init_phys_allocator(uintptr_t bytes);
+#define	VM_PHYS_MAX_ORDER	10
+
+/**
+ * Address limits for devices that can't reach all of physical memory: ISA DMA
+ * only reaches the first 16M, and devices with 32-bit DMA the first 4G. These
+ * are also the boundaries of the zones the physical allocator keeps.
+ */
+#define	VM_PHYS_LIMIT_ISA	0x1000000ULL
+#define	VM_PHYS_LIMIT_32BIT	0x100000000ULL
+
+/**
+ * Initialises the physical memory manager from the memory map in the boot
+ * arguments. Only regions marked as usable are handed to the allocator.
+ */
+void vm_init_phys_allocator(const platform_bootargs_t *bootargs);
 
 /**
  * Reserves all memory up to a specific physical address to the kernel. This is
  * used when the VM manager is first initialised, so pages belonging to kernel
  * data cannot be accidentally re-allocated.
  */
-void vm_reserve_phys(uintptr_t address);
+void vm_reserve_phys(phys_addr_t address);
 
 /**
  * Allocates a single page of physical memory. Each page is 4K in size.
  */
-uintptr_t vm_allocate_phys(void);
+phys_addr_t vm_allocate_phys(void);
+
+/**
+ * Allocates a single page of physical memory below the given address, for
+ * structures that the hardware can only find at low addresses. Returns 0 if
+ * there is no free memory below it.
+ */
+phys_addr_t vm_allocate_phys_below(phys_addr_t limit);
 
 /**
  * Releases physical memory back to the system so it can be reallocated.
  */
-void vm_deallocate_phys(uintptr_t address);
+void vm_deallocate_phys(phys_addr_t address);
+
+/**
+ * Allocates a single page of physical memory that is filled with zeroes. If
+ * no pre-cleared pages are available, a page is cleared synchronously.
+ */
+phys_addr_t vm_allocate_phys_zeroed(void);
+
+/**
+ * Fills a page of physical memory with zeroes.
+ */
+void vm_phys_zero(phys_addr_t address);
+
+/**
+ * Copies a page of memory, at the given virtual address, into a page of
+ * physical memory.
+ */
+void vm_phys_copy(phys_addr_t address, void *src);
+
+/**
+ * Adds a reference to a page of physical memory, when it is mapped in another
+ * place.
+ */
+void vm_phys_retain(phys_addr_t address);
+
+/**
+ * Drops a reference to a page of physical memory. The page is deallocated once
+ * its last reference is dropped.
+ */
+void vm_phys_release(phys_addr_t address);
+
+/**
+ * Returns the number of references to a page of physical memory; this is 1 if
+ * it has a single owner.
+ */
+unsigned int vm_phys_refs(phys_addr_t address);
+
+/**
+ * Maps the scratch pages used to access physical memory that is not mapped
+ * otherwise. This requires the kernel pagetable to be active.
+ */
+void vm_phys_init_scratch(void);
+
+/**
+ * Allocates the reference counts of frames. This requires the kernel heap to
+ * be up, and the scratch pages to be mapped.
+ */
+void vm_phys_init_refs(void);
+
+/**
+ * Performs background work for the physical memory manager, such as filling
+ * the pool of zeroed pages. Returns true if there is more work to do.
+ */
+bool vm_phys_idle(void);
+
+/**
+ * Allocates 2^order physically contiguous pages, aligned to their size.
+ * Returns 0 if no such run of pages is available.
+ */
+phys_addr_t vm_allocate_phys_order(unsigned int order);
+
+/**
+ * Releases 2^order pages, previously allocated with vm_allocate_phys_order.
+ */
+void vm_deallocate_phys_order(phys_addr_t address, unsigned int order);
+
+/**
+ * Allocates pages physically contiguous pages, for DMA. The first page is
+ * aligned to align, a power of two, and the last page ends at or below limit;
+ * a limit of 0 places no restriction. Returns 0 if no such run of pages is
+ * available.
+ */
+phys_addr_t vm_allocate_phys_contig(size_t pages, phys_addr_t align, phys_addr_t limit);
+
+/**
+ * Releases pages pages, previously allocated with vm_allocate_phys_contig.
+ */
+void vm_deallocate_phys_contig(phys_addr_t address, size_t pages);
 
 #endif
\ No newline at end of file
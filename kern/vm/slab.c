@@ -0,0 +1,400 @@
+#include "slab.h"
+#include "kheap.h"
+
+// Page size of slabs
+#define	PAGE_SIZE 0x1000
+
+// Offset of the first object in a slab, and the largest object that fits
+#define	SLAB_OBJ_OFFSET	((sizeof(slab_t) + 0x0F) & ~0x0F)
+#define	SLAB_OBJ_MAX	(PAGE_SIZE - SLAB_OBJ_OFFSET)
+
+// Marker in the header of every live slab
+#define	SLAB_MAGIC 'SLAB'
+
+// Number of completely free slabs each cache keeps around before releasing
+#define	SLAB_MAX_EMPTY 1
+
+// Caches backing the kmalloc size classes
+static slab_cache_t size_caches[SLAB_NUM_CLASSES];
+static const char *size_cache_names[SLAB_NUM_CLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+	"kmalloc-512"
+};
+
+/**
+ * Initialises the given cache structure for objects of a certain size.
+ */
+static void slab_cache_setup(slab_cache_t *cache, const char *name, size_t size) {
+	memclr(cache, sizeof(slab_cache_t));
+
+	// objects must be able to hold the free list pointer, and stay 16 aligned
+	if(size < SLAB_MIN_SIZE) {
+		size = SLAB_MIN_SIZE;
+	}
+
+	size = (size + 0x0F) & ~0x0F;
+
+	cache->name = name;
+	cache->obj_size = size;
+
+	cache->obj_offset = SLAB_OBJ_OFFSET;
+	cache->objs_per_slab = (PAGE_SIZE - cache->obj_offset) / size;
+}
+
+/**
+ * Masks interrupts, so the current CPU's magazines can be used. Returns the
+ * previous interrupt state.
+ */
+static inline bool slab_local_lock(void) {
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	return enabled;
+}
+
+/**
+ * Restores the interrupt state saved by slab_local_lock.
+ */
+static inline void slab_local_unlock(bool enabled) {
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+}
+
+/**
+ * Removes a slab from the list it is on.
+ */
+static inline void slab_list_remove(slab_t **list, slab_t *slab) {
+	if(slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		*list = slab->next;
+	}
+
+	if(slab->next) {
+		slab->next->prev = slab->prev;
+	}
+
+	slab->next = slab->prev = NULL;
+}
+
+/**
+ * Pushes a slab to the front of a list.
+ */
+static inline void slab_list_push(slab_t **list, slab_t *slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+
+	if(*list) {
+		(*list)->prev = slab;
+	}
+
+	*list = slab;
+}
+
+/**
+ * Gets a fresh page from the kernel heap and formats it as a slab for the
+ * given cache, with every object on the free list.
+ */
+static slab_t *slab_create(slab_cache_t *cache) {
+	slab_t *slab = (slab_t *) kheap_slab_page_alloc();
+
+	if(unlikely(!slab)) {
+		return NULL;
+	}
+
+	slab->next = slab->prev = NULL;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->magic = SLAB_MAGIC;
+
+	// thread the free list through the objects, lowest address first
+	uintptr_t obj = ((uintptr_t) slab) + cache->obj_offset;
+	slab->free = (void *) obj;
+
+	for(unsigned int i = 0; i < cache->objs_per_slab - 1; i++) {
+		*((void **) obj) = (void *) (obj + cache->obj_size);
+		obj += cache->obj_size;
+	}
+
+	*((void **) obj) = NULL;
+
+	cache->num_slabs++;
+
+	return slab;
+}
+
+/**
+ * Returns a slab's page to the kernel heap.
+ */
+static void slab_release(slab_cache_t *cache, slab_t *slab) {
+	slab->magic = 0;
+	cache->num_slabs--;
+
+	kheap_slab_page_free(slab);
+}
+
+/**
+ * Sets up the size class caches used by kmalloc. This must be called once the
+ * kernel heap is able to hand out pages.
+ */
+void slab_init(void) {
+	size_t size = SLAB_MIN_SIZE;
+
+	for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+		slab_cache_setup(&size_caches[i], size_cache_names[i], size);
+		size <<= 1;
+	}
+}
+
+/**
+ * Creates a new object cache for objects of the given size. Returns NULL if
+ * the object is too large to fit in a slab.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t size) {
+	if(size > SLAB_OBJ_MAX) {
+		return NULL;
+	}
+
+	slab_cache_t *cache = (slab_cache_t *) kmalloc(sizeof(slab_cache_t));
+
+	if(cache) {
+		slab_cache_setup(cache, name, size);
+	}
+
+	return cache;
+}
+
+/**
+ * Releases all slabs owned by the cache, as well as the cache itself. Any
+ * objects still allocated from the cache become invalid.
+ */
+void slab_cache_destroy(slab_cache_t *cache) {
+	slab_t *lists[3] = { cache->partial, cache->full, cache->empty };
+
+	// objects in the magazines live in the slabs that are released below
+	for(int i = 0; i < PLATFORM_MAX_CPUS; i++) {
+		cache->magazines[i].count = 0;
+	}
+
+	for(int i = 0; i < 3; i++) {
+		slab_t *slab = lists[i];
+
+		while(slab) {
+			slab_t *next = slab->next;
+			slab_release(cache, slab);
+			slab = next;
+		}
+	}
+
+	kfree(cache);
+}
+
+/**
+ * Takes an object off the cache's slabs. The cache's lock must be held.
+ */
+static void *slab_alloc_locked(slab_cache_t *cache) {
+	slab_t *slab = cache->partial;
+
+	// no partially used slabs: take an empty one, or make a new one
+	if(unlikely(!slab)) {
+		if(cache->empty) {
+			slab = cache->empty;
+			slab_list_remove(&cache->empty, slab);
+			cache->num_empty--;
+		} else {
+			slab = slab_create(cache);
+
+			if(unlikely(!slab)) {
+				return NULL;
+			}
+		}
+
+		slab_list_push(&cache->partial, slab);
+	}
+
+	// pop the first free object
+	void *obj = slab->free;
+	slab->free = *((void **) obj);
+	slab->inuse++;
+	cache->objs_inuse++;
+
+	// if the slab is now full, move it off the partial list
+	if(unlikely(!slab->free)) {
+		slab_list_remove(&cache->partial, slab);
+		slab_list_push(&cache->full, slab);
+	}
+
+	return obj;
+}
+
+/**
+ * Puts an object back on its slab. The cache's lock must be held.
+ */
+static void slab_free_locked(slab_cache_t *cache, void *obj) {
+	slab_t *slab = (slab_t *) (((uintptr_t) obj) & ~(PAGE_SIZE - 1));
+
+	// a full slab is about to gain a free object
+	if(unlikely(!slab->free)) {
+		slab_list_remove(&cache->full, slab);
+		slab_list_push(&cache->partial, slab);
+	}
+
+	*((void **) obj) = slab->free;
+	slab->free = obj;
+	slab->inuse--;
+	cache->objs_inuse--;
+
+	// once the slab is completely free, keep a few around and release the rest
+	if(unlikely(!slab->inuse)) {
+		slab_list_remove(&cache->partial, slab);
+
+		if(cache->num_empty < SLAB_MAX_EMPTY) {
+			slab_list_push(&cache->empty, slab);
+			cache->num_empty++;
+		} else {
+			slab_release(cache, slab);
+		}
+	}
+}
+
+/**
+ * Fills up a magazine with a batch of objects from the cache's slabs.
+ */
+static void magazine_refill(slab_cache_t *cache, slab_magazine_t *mag) {
+	mutex_take_spin(&cache->lock);
+
+	while(mag->count < SLAB_MAGAZINE_BATCH) {
+		void *obj = slab_alloc_locked(cache);
+
+		if(unlikely(!obj)) {
+			break;
+		}
+
+		mag->objs[mag->count++] = obj;
+	}
+
+	mutex_give(&cache->lock);
+}
+
+/**
+ * Returns a batch of objects from a magazine to the cache's slabs. If count
+ * is larger than the number of objects in the magazine, it is emptied.
+ */
+static void magazine_drain(slab_cache_t *cache, slab_magazine_t *mag,
+						   unsigned int count) {
+	mutex_take_spin(&cache->lock);
+
+	while(mag->count && count--) {
+		slab_free_locked(cache, mag->objs[--mag->count]);
+	}
+
+	mutex_give(&cache->lock);
+}
+
+/**
+ * Allocates an object from the given cache. Returns NULL if no memory could be
+ * made available.
+ */
+void *slab_alloc(slab_cache_t *cache) {
+	void *obj = NULL;
+
+	bool irq = slab_local_lock();
+	slab_magazine_t *mag = &cache->magazines[platform_cpu_id()];
+
+	if(unlikely(!mag->count)) {
+		magazine_refill(cache, mag);
+	}
+
+	if(likely(mag->count)) {
+		obj = mag->objs[--mag->count];
+	}
+
+	slab_local_unlock(irq);
+
+	return obj;
+}
+
+/**
+ * Returns an object to the cache it was allocated from.
+ */
+void slab_free(void *obj) {
+	slab_t *slab = (slab_t *) (((uintptr_t) obj) & ~(PAGE_SIZE - 1));
+	ASSERT(slab->magic == SLAB_MAGIC);
+
+	slab_cache_t *cache = slab->cache;
+
+	bool irq = slab_local_lock();
+	slab_magazine_t *mag = &cache->magazines[platform_cpu_id()];
+
+	if(unlikely(mag->count == SLAB_MAGAZINE_SIZE)) {
+		magazine_drain(cache, mag, SLAB_MAGAZINE_BATCH);
+	}
+
+	mag->objs[mag->count++] = obj;
+
+	slab_local_unlock(irq);
+}
+
+/**
+ * Returns the size of the object that the pointer was allocated as.
+ */
+size_t slab_obj_size(void *obj) {
+	slab_t *slab = (slab_t *) (((uintptr_t) obj) & ~(PAGE_SIZE - 1));
+	ASSERT(slab->magic == SLAB_MAGIC);
+
+	return slab->cache->obj_size;
+}
+
+/**
+ * Takes a snapshot of the cache's usage. Magazines of other CPUs are read
+ * without synchronisation, so the number of cached objects is approximate.
+ */
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats) {
+	stats->name = cache->name;
+	stats->obj_size = cache->obj_size;
+	stats->objs_cached = 0;
+
+	for(int i = 0; i < PLATFORM_MAX_CPUS; i++) {
+		stats->objs_cached += cache->magazines[i].count;
+	}
+
+	bool irq = slab_local_lock();
+	mutex_take_spin(&cache->lock);
+
+	stats->num_slabs = cache->num_slabs;
+	stats->objs_total = cache->num_slabs * cache->objs_per_slab;
+	stats->objs_inuse = cache->objs_inuse;
+
+	mutex_give(&cache->lock);
+	slab_local_unlock(irq);
+}
+
+/**
+ * Takes a snapshot of the usage of each of kmalloc's size classes, smallest
+ * first. stats must have space for SLAB_NUM_CLASSES entries.
+ */
+void slab_get_class_stats(slab_stats_t *stats) {
+	for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+		slab_cache_get_stats(&size_caches[i], &stats[i]);
+	}
+}
+
+/**
+ * Allocates an object from the smallest size class that can hold size bytes,
+ * or returns NULL if the request is larger than SLAB_MAX_SIZE.
+ */
+void *slab_alloc_sized(size_t size) {
+	if(unlikely(size > SLAB_MAX_SIZE)) {
+		return NULL;
+	}
+
+	// index of the smallest power of two that is >= size, relative to 16
+	unsigned int class = 0;
+
+	if(size > SLAB_MIN_SIZE) {
+		class = (32 - __builtin_clz(size - 1)) - 4;
+	}
+
+	return slab_alloc(&size_caches[class]);
+}
@@ -0,0 +1,168 @@
+#ifndef VM_SLAB_H
+#define VM_SLAB_H
+
+#include <types.h>
+#include "pexpert/platform.h"
+
+/**
+ * Object cache ("slab") allocator for fixed-size kernel objects.
+ *
+ * Each slab is exactly one page of kernel heap: a small header sits at the
+ * start of the page, and the rest of the page is carved into equally sized
+ * objects. Free objects are threaded onto a singly linked list inside the slab,
+ * so allocating and freeing an object is a constant-time push/pop.
+ *
+ * The kernel heap keeps a set of power-of-two caches, which kmalloc uses for
+ * all small requests.
+ *
+ * Each processor has a magazine of free objects in front of every cache.
+ * Objects are allocated from and freed to it without taking the cache's lock;
+ * only when it runs empty or full is a batch of objects moved between it and
+ * the slabs.
+ */
+typedef struct slab slab_t;
+typedef struct slab_cache slab_cache_t;
+
+// Number of objects a magazine holds, and how many are moved at once
+#define	SLAB_MAGAZINE_SIZE	16
+#define	SLAB_MAGAZINE_BATCH	8
+
+/**
+ * A per-CPU stack of free objects. It is only touched by its own CPU, with
+ * interrupts masked.
+ */
+typedef struct {
+	unsigned int count;
+	void *objs[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+/**
+ * Header placed at the beginning of every slab page.
+ */
+struct slab {
+	// linkage in one of the cache's slab lists
+	slab_t *next, *prev;
+
+	// cache that this slab belongs to
+	slab_cache_t *cache;
+
+	// first free object in this slab, or NULL if the slab is full
+	void *free;
+
+	// number of objects currently handed out from this slab
+	unsigned int inuse;
+
+	unsigned int magic;
+};
+
+/**
+ * A cache of objects of one size. Slabs move between the partial, full and
+ * empty lists as objects are allocated and released.
+ */
+struct slab_cache {
+	const char *name;
+
+	// size of each object, and how many fit in a slab
+	size_t obj_size;
+	unsigned int objs_per_slab;
+
+	// offset of the first object from the start of the slab
+	unsigned int obj_offset;
+
+	// slabs with some objects free, no objects free, and all objects free
+	slab_t *partial;
+	slab_t *full;
+	slab_t *empty;
+
+	// number of slabs on the empty list
+	unsigned int num_empty;
+
+	// statistics; objects in magazines count as in use
+	unsigned int num_slabs;
+	unsigned int objs_inuse;
+
+	// protects the slab lists and statistics
+	mutex_t lock;
+
+	// magazines of free objects, one per CPU
+	slab_magazine_t magazines[PLATFORM_MAX_CPUS];
+};
+
+/*
+ * Smallest and largest object sizes served by the kmalloc size classes. Past
+ * 512 bytes, the slab header leaves room for so few objects that a quarter of
+ * each page goes to waste, so larger requests are left to liballoc.
+ */
+#define SLAB_MIN_SIZE		16
+#define SLAB_MAX_SIZE		512
+
+// Number of power-of-two size classes between SLAB_MIN_SIZE and SLAB_MAX_SIZE
+#define SLAB_NUM_CLASSES	6
+
+/**
+ * A snapshot of a cache's usage.
+ */
+typedef struct {
+	const char *name;
+	size_t obj_size;
+
+	unsigned int num_slabs;
+	unsigned int objs_total;
+
+	// objects handed out, including those sitting in magazines
+	unsigned int objs_inuse;
+	unsigned int objs_cached;
+} slab_stats_t;
+
+/**
+ * Sets up the size class caches used by kmalloc. This must be called once the
+ * kernel heap is able to hand out pages.
+ */
+void slab_init(void);
+
+/**
+ * Creates a new object cache for objects of the given size. Returns NULL if
+ * the object is too large to fit in a slab.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t size);
+
+/**
+ * Releases all slabs owned by the cache, as well as the cache itself. Any
+ * objects still allocated from the cache become invalid.
+ */
+void slab_cache_destroy(slab_cache_t *cache);
+
+/**
+ * Allocates an object from the given cache. Returns NULL if no memory could be
+ * made available.
+ */
+void *slab_alloc(slab_cache_t *cache);
+
+/**
+ * Returns an object to the cache it was allocated from.
+ */
+void slab_free(void *obj);
+
+/**
+ * Returns the size of the object that the pointer was allocated as.
+ */
+size_t slab_obj_size(void *obj);
+
+/**
+ * Takes a snapshot of the cache's usage.
+ */
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+/**
+ * Takes a snapshot of the usage of each of kmalloc's size classes, smallest
+ * first. stats must have space for SLAB_NUM_CLASSES entries.
+ */
+void slab_get_class_stats(slab_stats_t *stats);
+
+/**
+ * Allocates an object from the smallest size class that can hold size bytes,
+ * or returns NULL if the request is larger than SLAB_MAX_SIZE.
+ */
+void *slab_alloc_sized(size_t size);
+
+#endif
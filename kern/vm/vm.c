@@ -13,7 +13,7 @@ unsigned int kheap_dumb_get_bytes(void);
  * Overall state of the Virtual Memory manager
  */
 static struct {
-	// Total memory installed in the system, past 0x100000, in bytes.
+	// Total usable memory installed in the system, in bytes.
 	uintptr_t mem_total;
 	// Total memory used through mapped pagetables, in bytes
 	uintptr_t mem_used;
@@ -33,12 +33,12 @@ void vm_init(void) {
 	vm_state.mem_total = bootargs->total_mem * 1024;
 	vm_state.mem_used = 0;
 
-	// initialise the physical manager
-	vm_init_phys_allocator(vm_state.mem_total);
-
-	// Initialise platform physical mappings manager
+	// Initialise platform physical mappings manager; it limits usable memory
 	platform_pm_init();
 
+	// initialise the physical manager
+	vm_init_phys_allocator(bootargs);
+
 	// get the blank kernel page directory
 	vm_state.kernel_table = platform_pm_get_kernel_table();
 
@@ -53,21 +53,29 @@ void vm_init(void) {
 
 	vm_reserve_phys(kernel_size + 0x100000);
 
-	// map the kernel memory
-	for (int i = 0; i < kernel_size + 0x100000; i += 0x1000) {
-		platform_pm_map(vm_state.kernel_table, i + VM_KERNEL_BASE, i, VM_FLAGS_KERNEL);
-	}
+	/*
+	 * Map the kernel memory. This is rounded up to a multiple of 4M, so the
+	 * platform can map it with large pages.
+	 */
+	size_t kernel_pages = (kernel_size + 0x100000 + 0x3FFFFF) / 0x1000;
+	kernel_pages &= ~0x3FF;
 
-	// Perform identity mapping for the real-mode accessible RAM (to 0x10FFEF)
-	for (int i = 0; i < 0x110000; i += 0x1000) {
-		platform_pm_map(vm_state.kernel_table, i, i, VM_FLAGS_KERNEL);
-	}
+	platform_pm_map_range(vm_state.kernel_table, VM_KERNEL_BASE, 0, kernel_pages, VM_FLAGS_KERNEL);
 
-	// Allocate some memory for the kernel heap and enable it
-	for(int i = VM_KERNEL_HEAP_BASE; i < (VM_KERNEL_HEAP_BASE + 0x10000); i += 0x1000) {
-		uintptr_t phys_addr = vm_allocate_phys();
-		platform_pm_map(vm_state.kernel_table, i, phys_addr, VM_FLAGS_KERNEL);
-	}
+	/*
+	 * Perform identity mapping for the real-mode accessible RAM (to 0x10FFEF).
+	 * The entire first 4M is mapped, so it can be a single large page.
+	 */
+	platform_pm_map_range(vm_state.kernel_table, 0, 0, 0x400, VM_FLAGS_KERNEL);
+
+	// Allocate some memory for the kernel heap (64K) and enable it
+	phys_addr_t heap_phys = vm_allocate_phys_order(4);
+	ASSERT(heap_phys);
+
+	platform_pm_map_range(vm_state.kernel_table, VM_KERNEL_HEAP_BASE, heap_phys, 16, VM_FLAGS_KERNEL_DATA);
+
+	// Create the pagetable for the scratch pages while the early heap is in use
+	platform_pm_map(vm_state.kernel_table, VM_SCRATCH_BASE, 0, VM_FLAGS_KERNEL | kPlatformPageNotPresent);
 
 	// Map the video framebuffer
 	if(bootargs->framebuffer.isVideo) {
@@ -79,6 +87,10 @@ void vm_init(void) {
 	// switch pagetable
 	platform_pm_switchto(vm_state.kernel_table);
 
+	// the physical allocator can now access frames through its scratch pages
+	vm_phys_init_scratch();
+	vm_phys_init_refs();
+
 	// set up the video console
 	if(bootargs->framebuffer.isVideo) {
 		platform_console_vid_clear();
@@ -108,4 +120,19 @@ void vm_init(void) {
  */
 platform_pagetable_t vm_get_pagetable(void) {
 	return vm_state.kernel_table;
+}
+
+/**
+ * Performs background work of the VM subsystem. This should be called when the
+ * processor has nothing else to do, and returns true if work remains.
+ */
+bool vm_idle(void) {
+	bool more = vm_phys_idle();
+
+	// once the page pool is topped up, the heap can give back idle memory
+	if(!more) {
+		kheap_idle();
+	}
+
+	return more;
 }
\ No newline at end of file
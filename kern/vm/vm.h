@@ -8,6 +8,7 @@ typedef enum {
 	kVMAttributeUncached = (kVMAttributeUser << 1),
 	kVMAttributeReadOnly = (kVMAttributeUncached << 1),
 	kVMAttributeWriteThru = (kVMAttributeReadOnly << 1),
+	kVMAttributeNoExecute = (kVMAttributeWriteThru << 1),
 } vm_attribute_t;
 
 typedef struct {
@@ -35,6 +36,12 @@ static const vm_section_t vm_sections[] = {
 // kernel pages are mapped as RW
 #define	VM_FLAGS_KERNEL kPlatformPageGlobal
 
+// kernel pages that only hold data, such as the heap, can't be executed
+#define	VM_FLAGS_KERNEL_DATA (VM_FLAGS_KERNEL | kPlatformPageNoExecute)
+
+// per-CPU scratch pages for accessing unmapped physical memory
+#define	VM_SCRATCH_BASE 0xC2FF0000
+
 /**
  * Initialises the virtual memory subsystem. This initialises internal state,
  * structures, and then builds a set of pagetables for the kernel.
@@ -46,5 +53,11 @@ void vm_init(void);
  */
 platform_pagetable_t vm_get_pagetable(void);
 
+/**
+ * Performs background work of the VM subsystem. This should be called when the
+ * processor has nothing else to do, and returns true if work remains.
+ */
+bool vm_idle(void);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,821 @@
+#include "vmalloc.h"
+#include "physical.h"
+
+#include "kmalloc.h"
+
+// Page size is determined by hardware, but all platforms support 4K pages.
+#define	PAGE_SIZE 0x1000
+
+// Number of physical extents translated at once when releasing memory
+#define	VMALLOC_FREE_EXTENTS 8
+
+/**
+ * A range of addresses in an arena. Free extents are linked into the arena's
+ * address and size trees; allocated extents into the tree of allocations.
+ */
+typedef struct vmalloc_extent {
+	rbtree_node_t node;
+	rbtree_node_t size_node;
+
+	// range of addresses, including guard pages
+	uintptr_t start;
+	size_t size;
+
+	// allocated extents: usable range of addresses
+	uintptr_t base;
+	size_t length;
+
+	vmalloc_flags_t flags;
+
+	// maps device memory, whose frames are not owned by the allocation
+	bool device;
+} vmalloc_extent_t;
+
+/**
+ * A window of the kernel's address space that ranges are allocated from.
+ */
+typedef struct {
+	const char *name;
+
+	// first address, and first address past the arena
+	uintptr_t start;
+	uintptr_t end;
+
+	// free extents, keyed by address, and by size
+	rbtree_t free_addr;
+	rbtree_t free_size;
+
+	size_t free_bytes;
+
+	// number of allocations, and their usable bytes
+	unsigned int allocations;
+	size_t allocated_bytes;
+} vmalloc_arena_t;
+
+enum {
+	kArenaKernel,
+	kArenaDevice,
+
+	kArenaMax
+};
+
+/*
+ * General allocations come from the kernel heap section, below the pages
+ * managed by the kernel heap itself. Device memory is mapped into the MMIO
+ * section, above the framebuffer, which is always mapped at its start.
+ */
+static vmalloc_arena_t arenas[kArenaMax] = {
+	[kArenaKernel] = {
+		.name = "kernel",
+		.start = 0xC8000000,
+		.end = VM_KERNEL_HEAP_BASE
+	},
+	[kArenaDevice] = {
+		.name = "device",
+		.start = 0xF0800000,
+		.end = 0xFFFFF000
+	},
+};
+
+// All allocated extents, keyed by start address
+static rbtree_t allocations;
+
+// Protects the arenas and allocations; held with interrupts masked
+static mutex_t vmalloc_lock;
+
+// Kernel pagetable
+static platform_pagetable_t kernel_table;
+
+// Gets the extent that contains a tree node
+#define	EXTENT(n) rbtree_entry((n), vmalloc_extent_t, node)
+#define	EXTENT_BY_SIZE(n) rbtree_entry((n), vmalloc_extent_t, size_node)
+
+/**
+ * Takes the allocator's lock, with interrupts masked, so that it can be used
+ * by interrupt handlers. Returns the previous interrupt state.
+ */
+static inline bool vmalloc_lock_take(void) {
+	bool enabled = platform_int_enabled();
+	platform_int_set_mask(false);
+
+	mutex_take_spin(&vmalloc_lock);
+
+	return enabled;
+}
+
+/**
+ * Releases the allocator's lock, and restores the interrupt state.
+ */
+static inline void vmalloc_lock_give(bool enabled) {
+	mutex_give(&vmalloc_lock);
+
+	if(enabled) {
+		platform_int_set_mask(true);
+	}
+}
+
+/**
+ * Orders extents by size, and then address, so that no two are equal.
+ */
+static inline bool extent_smaller(vmalloc_extent_t *a, vmalloc_extent_t *b) {
+	return (a->size < b->size) || (a->size == b->size && a->start < b->start);
+}
+
+/**
+ * Inserts an extent into a tree keyed by address.
+ */
+static void extent_link(rbtree_t *tree, vmalloc_extent_t *e) {
+	rbtree_node_t **link = &tree->root;
+	rbtree_node_t *parent = NULL;
+
+	while(*link) {
+		parent = *link;
+		link = (e->start < EXTENT(parent)->start) ? &parent->left : &parent->right;
+	}
+
+	rbtree_insert(tree, &e->node, parent, link);
+}
+
+/**
+ * Inserts a free extent into the arena's size tree.
+ */
+static void extent_link_size(vmalloc_arena_t *arena, vmalloc_extent_t *e) {
+	rbtree_node_t **link = &arena->free_size.root;
+	rbtree_node_t *parent = NULL;
+
+	while(*link) {
+		parent = *link;
+		link = extent_smaller(e, EXTENT_BY_SIZE(parent)) ? &parent->left : &parent->right;
+	}
+
+	rbtree_insert(&arena->free_size, &e->size_node, parent, link);
+}
+
+/**
+ * Finds the extent in a tree keyed by address that contains the address.
+ */
+static vmalloc_extent_t *extent_find(rbtree_t *tree, uintptr_t address) {
+	rbtree_node_t *node = tree->root;
+
+	while(node) {
+		vmalloc_extent_t *e = EXTENT(node);
+
+		if(address < e->start) {
+			node = node->left;
+		} else if(address >= (e->start + e->size)) {
+			node = node->right;
+		} else {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Finds a free extent of at least size bytes: the smallest one, or the one
+ * with the lowest address if first_fit is set.
+ */
+static vmalloc_extent_t *arena_find_free(vmalloc_arena_t *arena, size_t size,
+										 bool first_fit) {
+	vmalloc_extent_t *found = NULL;
+
+	if(first_fit) {
+		for(rbtree_node_t *n = rbtree_first(&arena->free_addr); n; n = rbtree_next(n)) {
+			if(EXTENT(n)->size >= size) {
+				return EXTENT(n);
+			}
+		}
+
+		return NULL;
+	}
+
+	rbtree_node_t *node = arena->free_size.root;
+
+	while(node) {
+		vmalloc_extent_t *e = EXTENT_BY_SIZE(node);
+
+		if(e->size >= size) {
+			found = e;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Takes size bytes from the start of a suitable free extent. If the extent is
+ * larger, it shrinks, and spare describes the range that was taken instead.
+ * Returns the extent describing the range, or NULL.
+ */
+static vmalloc_extent_t *arena_take(vmalloc_arena_t *arena, size_t size,
+									bool first_fit, vmalloc_extent_t *spare) {
+	vmalloc_extent_t *e = arena_find_free(arena, size, first_fit);
+
+	if(unlikely(!e)) {
+		return NULL;
+	}
+
+	rbtree_remove(&arena->free_size, &e->size_node);
+	arena->free_bytes -= size;
+
+	// exact fits hand out the free extent itself
+	if(e->size == size) {
+		rbtree_remove(&arena->free_addr, &e->node);
+		return e;
+	}
+
+	spare->start = e->start;
+	spare->size = size;
+
+	// this does not change the extent's position in the address tree
+	e->start += size;
+	e->size -= size;
+
+	extent_link_size(arena, e);
+
+	return spare;
+}
+
+/**
+ * Returns the range of an extent to the arena, merging it with adjacent free
+ * extents. Extents that are no longer needed are stored in dead, which must
+ * have space for two, so they can be freed once the lock is released. Returns
+ * their number.
+ */
+static unsigned int arena_give(vmalloc_arena_t *arena, vmalloc_extent_t *e,
+							   vmalloc_extent_t **dead) {
+	vmalloc_extent_t *prev = NULL, *next = NULL;
+	unsigned int num_dead = 0;
+
+	arena->free_bytes += e->size;
+
+	// find the free extents on either side
+	rbtree_node_t *node = arena->free_addr.root;
+
+	while(node) {
+		if(EXTENT(node)->start < e->start) {
+			prev = EXTENT(node);
+			node = node->right;
+		} else {
+			next = EXTENT(node);
+			node = node->left;
+		}
+	}
+
+	if(prev && (prev->start + prev->size) == e->start) {
+		rbtree_remove(&arena->free_size, &prev->size_node);
+		prev->size += e->size;
+
+		dead[num_dead++] = e;
+		e = prev;
+	} else {
+		extent_link(&arena->free_addr, e);
+	}
+
+	if(next && (e->start + e->size) == next->start) {
+		rbtree_remove(&arena->free_size, &next->size_node);
+		rbtree_remove(&arena->free_addr, &next->node);
+		e->size += next->size;
+
+		dead[num_dead++] = next;
+	}
+
+	extent_link_size(arena, e);
+
+	return num_dead;
+}
+
+/**
+ * Adds size bytes of free address space, which directly follow an allocated
+ * extent, to it. If the free extent is used up entirely, it is stored in dead,
+ * so it can be freed once the lock is released. Returns false if there isn't
+ * enough free space after the extent.
+ */
+static bool arena_extend(vmalloc_arena_t *arena, vmalloc_extent_t *e, size_t size,
+						 vmalloc_extent_t **dead) {
+	vmalloc_extent_t *next = extent_find(&arena->free_addr, e->start + e->size);
+
+	if(!next || next->size < size) {
+		return false;
+	}
+
+	rbtree_remove(&arena->free_size, &next->size_node);
+	arena->free_bytes -= size;
+
+	if(next->size == size) {
+		rbtree_remove(&arena->free_addr, &next->node);
+		*dead = next;
+	} else {
+		// this does not change the extent's position in the address tree
+		next->start += size;
+		next->size -= size;
+
+		extent_link_size(arena, next);
+	}
+
+	e->size += size;
+	e->length += size;
+
+	arena->allocated_bytes += size;
+
+	return true;
+}
+
+/**
+ * Returns the arena that an extent was allocated from.
+ */
+static vmalloc_arena_t *arena_for(vmalloc_extent_t *e) {
+	for(unsigned int i = 0; i < kArenaMax; i++) {
+		if(e->start >= arenas[i].start && e->start < arenas[i].end) {
+			return &arenas[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Sets up the arenas. This must be called once the kernel heap is available.
+ */
+void vmalloc_init(void) {
+	kernel_table = vm_get_pagetable();
+
+	for(unsigned int i = 0; i < kArenaMax; i++) {
+		vmalloc_extent_t *e = (vmalloc_extent_t *) kmalloc(sizeof(vmalloc_extent_t));
+		ASSERT(e);
+
+		e->start = arenas[i].start;
+		e->size = arenas[i].end - arenas[i].start;
+
+		extent_link(&arenas[i].free_addr, e);
+		extent_link_size(&arenas[i], e);
+
+		arenas[i].free_bytes = e->size;
+	}
+}
+
+/**
+ * Reserves pages pages of address space in an arena, surrounded by a guard
+ * page on either side if requested, and records the allocation. Returns NULL
+ * if the arena is exhausted.
+ */
+static vmalloc_extent_t *vmalloc_reserve(unsigned int arena, size_t pages,
+										 vmalloc_flags_t flags, bool device) {
+	size_t guard = (flags & kVMAllocGuard) ? PAGE_SIZE : 0;
+	size_t size = (pages * PAGE_SIZE) + (guard * 2);
+
+	vmalloc_extent_t *spare = (vmalloc_extent_t *) kmalloc(sizeof(vmalloc_extent_t));
+
+	if(unlikely(!spare)) {
+		return NULL;
+	}
+
+	bool irq = vmalloc_lock_take();
+
+	vmalloc_extent_t *e = arena_take(&arenas[arena], size, (flags & kVMAllocFirstFit), spare);
+
+	if(likely(e)) {
+		e->base = e->start + guard;
+		e->length = pages * PAGE_SIZE;
+		e->flags = flags;
+		e->device = device;
+
+		extent_link(&allocations, e);
+
+		arenas[arena].allocations++;
+		arenas[arena].allocated_bytes += e->length;
+	}
+
+	vmalloc_lock_give(irq);
+
+	if(e != spare) {
+		kfree(spare);
+	}
+
+	if(unlikely(!e)) {
+		KERROR("Out of %s address space for 0x%X pages\n", arenas[arena].name, (unsigned int) pages);
+	}
+
+	return e;
+}
+
+/**
+ * Unmaps pages pages, starting at virt, and releases the frames that backed
+ * them, unless they are device memory. Pages that were never backed are
+ * skipped.
+ */
+static void vmalloc_unback(uintptr_t virt, size_t pages, bool device) {
+	if(device) {
+		platform_pm_unmap_range(kernel_table, virt, pages);
+		return;
+	}
+
+	platform_pm_extent_t extents[VMALLOC_FREE_EXTENTS];
+	uintptr_t end = virt + (pages * PAGE_SIZE);
+
+	while(virt < end) {
+		size_t num = platform_pm_translate(kernel_table, virt, end - virt,
+										   extents, VMALLOC_FREE_EXTENTS);
+
+		uintptr_t batch_end = end;
+
+		if(num == VMALLOC_FREE_EXTENTS) {
+			batch_end = extents[num - 1].virt + extents[num - 1].length;
+		}
+
+		platform_pm_unmap_range(kernel_table, virt, (batch_end - virt) / PAGE_SIZE);
+
+		for(size_t i = 0; i < num; i++) {
+			for(size_t off = 0; off < extents[i].length; off += PAGE_SIZE) {
+				vm_deallocate_phys(extents[i].phys + off);
+			}
+		}
+
+		virt = batch_end;
+	}
+}
+
+/**
+ * Backs pages pages, starting at virt, with a single physically contiguous
+ * run of frames.
+ */
+static bool vmalloc_back_contiguous(uintptr_t virt, size_t pages, bool zero) {
+	phys_addr_t phys = vm_allocate_phys_contig(pages, PAGE_SIZE, 0);
+
+	if(unlikely(!phys)) {
+		return false;
+	}
+
+	platform_pm_map_range(kernel_table, virt, phys, pages, VM_FLAGS_KERNEL_DATA);
+
+	// the block didn't come from the pool of zeroed frames
+	if(zero) {
+		memclr((void *) virt, pages * PAGE_SIZE);
+	}
+
+	return true;
+}
+
+/**
+ * Backs pages pages, starting at virt, with frames, which are zeroed if zero
+ * is set. Physically contiguous runs of frames are mapped in one go. Returns
+ * false if memory ran out, leaving the pages backed so far mapped.
+ */
+static bool vmalloc_back(uintptr_t virt, size_t pages, bool zero) {
+	uintptr_t run_virt = virt;
+	phys_addr_t run_phys = 0;
+	size_t run_pages = 0;
+
+	for(size_t p = 0; p < pages; p++) {
+		// don't use up the pool of zeroed frames if it's not needed
+		phys_addr_t phys = zero ? vm_allocate_phys_zeroed() : vm_allocate_phys();
+
+		if(unlikely(!phys)) {
+			break;
+		}
+
+		if(run_pages && phys != (run_phys + (run_pages * PAGE_SIZE))) {
+			platform_pm_map_range(kernel_table, run_virt, run_phys, run_pages, VM_FLAGS_KERNEL_DATA);
+			run_pages = 0;
+		}
+
+		if(!run_pages) {
+			run_virt = virt + (p * PAGE_SIZE);
+			run_phys = phys;
+		}
+
+		run_pages++;
+	}
+
+	if(run_pages) {
+		platform_pm_map_range(kernel_table, run_virt, run_phys, run_pages, VM_FLAGS_KERNEL_DATA);
+	}
+
+	return ((run_virt + (run_pages * PAGE_SIZE)) == (virt + (pages * PAGE_SIZE)));
+}
+
+/**
+ * Allocates size bytes of kernel memory, rounded up to a multiple of the page
+ * size, which is virtually contiguous and zeroed. Returns NULL if either
+ * address space or memory ran out.
+ */
+void *vmalloc(size_t size, vmalloc_flags_t flags) {
+	size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if(unlikely(!pages)) {
+		return NULL;
+	}
+
+	ASSERT(!((flags & kVMAllocLazy) && (flags & kVMAllocContiguous)));
+
+	vmalloc_extent_t *e = vmalloc_reserve(kArenaKernel, pages, flags, false);
+
+	if(unlikely(!e)) {
+		return NULL;
+	}
+
+	// lazy allocations are backed by vmalloc_fault
+	bool zero = !(flags & kVMAllocNoZero);
+	bool backed = true;
+
+	if(flags & kVMAllocContiguous) {
+		backed = vmalloc_back_contiguous(e->base, pages, zero);
+	} else if(!(flags & kVMAllocLazy)) {
+		backed = vmalloc_back(e->base, pages, zero);
+	}
+
+	if(unlikely(!backed)) {
+		vfree((void *) e->base);
+		return NULL;
+	}
+
+	return (void *) e->base;
+}
+
+/**
+ * Maps size bytes of physical memory, such as device registers, starting at
+ * phys, into the kernel's address space with the given flags. The returned
+ * address has the same offset into a page as phys.
+ */
+void *vmalloc_map_phys(phys_addr_t phys, size_t size, platform_page_flags_t flags) {
+	uintptr_t offset = phys & (PAGE_SIZE - 1);
+	size_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if(unlikely(!size)) {
+		return NULL;
+	}
+
+	vmalloc_extent_t *e = vmalloc_reserve(kArenaDevice, pages, kVMAllocFirstFit, true);
+
+	if(unlikely(!e)) {
+		return NULL;
+	}
+
+	platform_pm_map_range(kernel_table, e->base, phys - offset, pages,
+						  flags | VM_FLAGS_KERNEL_DATA);
+
+	return (void *) (e->base + offset);
+}
+
+/**
+ * Releases memory allocated with vmalloc, or unmaps memory mapped with
+ * vmalloc_map_phys.
+ */
+void vfree(void *address) {
+	vmalloc_extent_t *dead[2];
+	uintptr_t addr = (uintptr_t) address;
+
+	bool irq = vmalloc_lock_take();
+
+	vmalloc_extent_t *e = extent_find(&allocations, addr);
+
+	// device mappings may be released through any address in their first page
+	if(unlikely(!e || (addr & ~(PAGE_SIZE - 1)) != e->base)) {
+		vmalloc_lock_give(irq);
+
+		KERROR("vfree: 0x%08X was not allocated\n", (unsigned int) addr);
+		return;
+	}
+
+	// no faults can be resolved in the range once it's gone from the tree
+	rbtree_remove(&allocations, &e->node);
+
+	vmalloc_lock_give(irq);
+
+	vmalloc_unback(e->base, e->length / PAGE_SIZE, e->device);
+
+	// only now may the range be handed out again
+	irq = vmalloc_lock_take();
+
+	vmalloc_arena_t *arena = arena_for(e);
+	arena->allocations--;
+	arena->allocated_bytes -= e->length;
+
+	unsigned int num_dead = arena_give(arena, e, dead);
+	vmalloc_lock_give(irq);
+
+	for(unsigned int i = 0; i < num_dead; i++) {
+		kfree(dead[i]);
+	}
+}
+
+/**
+ * Shrinks an allocation to length bytes. The pages past the new end are
+ * unmapped, and their frames released, before the range is given back to the
+ * arena. Returns false if there was no memory to describe the range.
+ */
+static bool vmalloc_shrink(vmalloc_extent_t *e, size_t length) {
+	vmalloc_extent_t *dead[2];
+	size_t removed = e->length - length;
+
+	vmalloc_extent_t *tail = (vmalloc_extent_t *) kmalloc(sizeof(vmalloc_extent_t));
+
+	if(unlikely(!tail)) {
+		return false;
+	}
+
+	// no faults are resolved past the new end once the lock is released
+	bool irq = vmalloc_lock_take();
+
+	e->length = length;
+	e->size -= removed;
+
+	vmalloc_lock_give(irq);
+
+	vmalloc_unback(e->base + length, removed / PAGE_SIZE, false);
+
+	irq = vmalloc_lock_take();
+
+	vmalloc_arena_t *arena = arena_for(e);
+	arena->allocated_bytes -= removed;
+
+	tail->start = e->base + length;
+	tail->size = removed;
+
+	unsigned int num_dead = arena_give(arena, tail, dead);
+	vmalloc_lock_give(irq);
+
+	for(unsigned int i = 0; i < num_dead; i++) {
+		kfree(dead[i]);
+	}
+
+	return true;
+}
+
+/**
+ * Resizes the allocation at the given address in place, to size bytes rounded
+ * up to a multiple of the page size.
+ */
+bool vmalloc_resize(void *address, size_t size) {
+	uintptr_t addr = (uintptr_t) address;
+	size_t length = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	vmalloc_extent_t *dead = NULL;
+	bool grown = false;
+
+	if(unlikely(!length)) {
+		return false;
+	}
+
+	bool irq = vmalloc_lock_take();
+
+	vmalloc_extent_t *e = extent_find(&allocations, addr);
+
+	if(unlikely(!e || e->base != addr)) {
+		vmalloc_lock_give(irq);
+
+		KERROR("vmalloc_resize: 0x%08X was not allocated\n", (unsigned int) addr);
+		return false;
+	}
+
+	size_t old_length = e->length;
+	bool fixed = e->device || (e->flags & kVMAllocGuard);
+
+	if(length > old_length && !fixed && !(e->flags & kVMAllocContiguous)) {
+		grown = arena_extend(arena_for(e), e, length - old_length, &dead);
+	}
+
+	vmalloc_lock_give(irq);
+
+	if(length == old_length) {
+		return true;
+	} else if(length < old_length) {
+		return !fixed && vmalloc_shrink(e, length);
+	} else if(!grown) {
+		return false;
+	}
+
+	if(dead) {
+		kfree(dead);
+	}
+
+	// back the new pages the same way as the rest of the allocation
+	if(!(e->flags & kVMAllocLazy)) {
+		size_t pages = (length - old_length) / PAGE_SIZE;
+
+		if(unlikely(!vmalloc_back(addr + old_length, pages, !(e->flags & kVMAllocNoZero)))) {
+			vmalloc_shrink(e, old_length);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Releases the memory that backs the allocation at the given address, while
+ * keeping its addresses reserved.
+ */
+void vmalloc_decommit(void *address) {
+	uintptr_t addr = (uintptr_t) address;
+
+	bool irq = vmalloc_lock_take();
+
+	vmalloc_extent_t *e = extent_find(&allocations, addr);
+
+	if(unlikely(!e || e->base != addr || e->device)) {
+		vmalloc_lock_give(irq);
+
+		KERROR("vmalloc_decommit: 0x%08X was not allocated\n", (unsigned int) addr);
+		return;
+	}
+
+	// accesses must fault from now on, rather than be backed lazily
+	e->flags &= ~kVMAllocLazy;
+	size_t pages = e->length / PAGE_SIZE;
+
+	vmalloc_lock_give(irq);
+
+	vmalloc_unback(addr, pages, false);
+}
+
+/**
+ * Checks whether the address lies in the arena that vmalloc allocates from.
+ */
+bool vmalloc_owns(void *address) {
+	uintptr_t addr = (uintptr_t) address;
+	return (addr >= arenas[kArenaKernel].start && addr < arenas[kArenaKernel].end);
+}
+
+/**
+ * Returns the usable size of the allocation at the given address, or 0 if it
+ * was not allocated with vmalloc.
+ */
+size_t vmalloc_size(void *address) {
+	size_t length = 0;
+
+	bool irq = vmalloc_lock_take();
+
+	vmalloc_extent_t *e = extent_find(&allocations, (uintptr_t) address);
+
+	if(e && e->base == (uintptr_t) address) {
+		length = e->length;
+	}
+
+	vmalloc_lock_give(irq);
+
+	return length;
+}
+
+/**
+ * Takes a snapshot of the usage of the arena vmalloc allocates from.
+ */
+void vmalloc_get_stats(vmalloc_stats_t *stats) {
+	vmalloc_arena_t *arena = &arenas[kArenaKernel];
+
+	bool irq = vmalloc_lock_take();
+
+	stats->allocations = arena->allocations;
+	stats->allocated_bytes = arena->allocated_bytes;
+	stats->free_bytes = arena->free_bytes;
+
+	// the largest free extent is the last in the size tree
+	rbtree_node_t *largest = rbtree_last(&arena->free_size);
+	stats->largest_free = largest ? EXTENT_BY_SIZE(largest)->size : 0;
+
+	vmalloc_lock_give(irq);
+}
+
+/**
+ * Attempts to resolve a page fault at the given kernel address, by backing a
+ * lazily allocated page. Returns true if the access can be retried.
+ */
+bool vmalloc_fault(uintptr_t address) {
+	bool resolved = false;
+
+	if(address < VM_KERNEL_BASE) {
+		return false;
+	}
+
+	bool irq = vmalloc_lock_take();
+
+	vmalloc_extent_t *e = extent_find(&allocations, address);
+
+	if(!e) {
+		// not allocated at all
+	} else if(address < e->base || address >= (e->base + e->length)) {
+		KERROR("Access to guard page at 0x%08X\n", (unsigned int) address);
+	} else if(e->flags & kVMAllocLazy) {
+		uintptr_t page = address & ~(PAGE_SIZE - 1);
+
+		// another processor may have faulted on the same page first
+		if(platform_pm_is_valid(kernel_table, page, false)) {
+			resolved = true;
+		} else {
+			phys_addr_t phys = (e->flags & kVMAllocNoZero) ? vm_allocate_phys() :
+														   vm_allocate_phys_zeroed();
+
+			if(likely(phys)) {
+				platform_pm_map(kernel_table, page, phys, VM_FLAGS_KERNEL_DATA);
+				resolved = true;
+			}
+		}
+	}
+
+	vmalloc_lock_give(irq);
+
+	return resolved;
+}
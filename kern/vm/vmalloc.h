@@ -0,0 +1,117 @@
+#ifndef VM_VMALLOC_H
+#define VM_VMALLOC_H
+
+#include <types.h>
+#include "vm.h"
+
+/**
+ * Allocator for ranges of kernel virtual address space.
+ *
+ * Each arena is a window of the kernel's address space, whose free ranges
+ * ("extents") are kept in two red-black trees: one keyed by address, so that
+ * freed ranges can be merged with their neighbours, and one keyed by size, so
+ * that the smallest range that fits a request can be found quickly.
+ *
+ * Memory allocated with vmalloc is backed by frames that need not be
+ * physically contiguous: either as it is allocated, or lazily, page by page,
+ * as it is first touched. Guard pages, which are never mapped, can be placed
+ * on either side of an allocation to catch overruns (such as stack overflows.)
+ *
+ * Device memory is mapped into a separate arena with vmalloc_map_phys.
+ */
+typedef enum {
+	// leave an unmapped page before and after the allocation
+	kVMAllocGuard = (1 << 0),
+	// only back pages with memory when they are first accessed
+	kVMAllocLazy = (kVMAllocGuard << 1),
+	// take the lowest free range that fits, rather than the smallest
+	kVMAllocFirstFit = (kVMAllocLazy << 1),
+	// don't clear the memory before handing it out
+	kVMAllocNoZero = (kVMAllocFirstFit << 1),
+	// back the memory with physically contiguous frames (not with kVMAllocLazy)
+	kVMAllocContiguous = (kVMAllocNoZero << 1),
+} vmalloc_flags_t;
+
+/**
+ * A snapshot of the usage of the arena vmalloc allocates from.
+ */
+typedef struct {
+	unsigned int allocations;
+
+	// usable bytes of all allocations, not counting guard pages
+	size_t allocated_bytes;
+
+	// free address space, and the largest free range
+	size_t free_bytes;
+	size_t largest_free;
+} vmalloc_stats_t;
+
+/**
+ * Sets up the arenas. This must be called once the kernel heap is available.
+ */
+void vmalloc_init(void);
+
+/**
+ * Allocates size bytes of kernel memory, rounded up to a multiple of the page
+ * size, which is virtually contiguous and zeroed, unless kVMAllocNoZero is
+ * set. Returns NULL if either address space or memory ran out.
+ */
+void *vmalloc(size_t size, vmalloc_flags_t flags);
+
+/**
+ * Maps size bytes of physical memory, such as device registers, starting at
+ * phys, into the kernel's address space with the given flags. The returned
+ * address has the same offset into a page as phys.
+ */
+void *vmalloc_map_phys(phys_addr_t phys, size_t size, platform_page_flags_t flags);
+
+/**
+ * Releases memory allocated with vmalloc, or unmaps memory mapped with
+ * vmalloc_map_phys.
+ */
+void vfree(void *address);
+
+/**
+ * Releases the memory that backs the allocation at the given address, while
+ * keeping its addresses reserved, so that any later access to it faults. The
+ * allocation must still be released with vfree.
+ */
+void vmalloc_decommit(void *address);
+
+/**
+ * Checks whether the address lies in the arena that vmalloc allocates from.
+ * This does not take any locks, so it is cheap enough to use to tell vmalloc
+ * allocations apart from others.
+ */
+bool vmalloc_owns(void *address);
+
+/**
+ * Resizes the allocation at the given address in place, to size bytes rounded
+ * up to a multiple of the page size. It grows into free address space that
+ * directly follows it, and shrinking releases the pages past its new end.
+ * Returns false if it can't be resized in place. Allocations with guard pages
+ * and device mappings are never resized, and physically contiguous allocations
+ * can only shrink.
+ */
+bool vmalloc_resize(void *address, size_t size);
+
+/**
+ * Returns the usable size of the allocation at the given address, or 0 if it
+ * was not allocated with vmalloc.
+ */
+size_t vmalloc_size(void *address);
+
+/**
+ * Takes a snapshot of the usage of the arena vmalloc allocates from.
+ */
+void vmalloc_get_stats(vmalloc_stats_t *stats);
+
+/**
+ * Attempts to resolve a page fault at the given kernel address, by backing a
+ * lazily allocated page. Returns true if the access can be retried.
+ *
+ * Lazily backed memory must not be touched by interrupt handlers.
+ */
+bool vmalloc_fault(uintptr_t address);
+
+#endif
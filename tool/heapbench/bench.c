@@ -0,0 +1,733 @@
+/*
+ * Benchmarks the kernel heap on the host, by replaying traces of allocations
+ * against it: either synthetic ones, generated from a seed, or ones recorded
+ * earlier and read from a file.
+ *
+ * Each trace runs in a child process with a heap of its own, and reports the
+ * time taken per operation, the peak resident set of the process, the peak
+ * physical memory the heap took, and how fragmented the heap was at the end.
+ *
+ * Trace files are text, one operation per line; an id names an allocation,
+ * and may be any number, such as the address the allocation had when it was
+ * recorded:
+ *
+ *   a <id> <size>	allocate size bytes
+ *   c <id> <size>	allocate size bytes of physically contiguous memory
+ *   r <id> <size>	resize the allocation to size bytes
+ *   f <id>			free the allocation
+ *
+ * Blank lines and lines starting with '#' are ignored.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "heapbench.h"
+
+// pattern that the first word of each allocation is stamped with
+#define	STAMP_MAGIC	0xA5A5A5A5
+
+typedef enum {
+	kOpAlloc = 'a',
+	kOpAllocContig = 'c',
+	kOpRealloc = 'r',
+	kOpFree = 'f',
+} op_type_t;
+
+// A single operation of a trace, on a slot that holds one allocation
+typedef struct {
+	uint8_t type;
+	uint32_t slot;
+	uint32_t size;
+} trace_op_t;
+
+typedef struct {
+	const char *name;
+
+	trace_op_t *ops;
+	size_t num_ops;
+	size_t capacity;
+
+	// number of slots the operations refer to
+	uint32_t num_slots;
+} trace_t;
+
+// generates a synthetic trace
+typedef void (*workload_fn_t)(trace_t *trace, size_t ops);
+
+typedef struct {
+	const char *name;
+	const char *description;
+	workload_fn_t generate;
+} workload_t;
+
+// Options
+static size_t num_ops = 1000000;
+static size_t phys_mb = 512;
+static uint32_t seed = 1;
+static bool dump_heap = false;
+
+static uint32_t rng_state;
+
+/*
+ * Returns the next number from a xorshift generator.
+ */
+static uint32_t rng_next(void) {
+	uint32_t x = rng_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return (rng_state = x);
+}
+
+/*
+ * Returns a number between min and max, inclusive.
+ */
+static uint32_t rng_range(uint32_t min, uint32_t max) {
+	return min + (rng_next() % (max - min + 1));
+}
+
+/*
+ * Appends an operation to a trace.
+ */
+static void trace_push(trace_t *trace, op_type_t type, uint32_t slot, uint32_t size) {
+	if(trace->num_ops == trace->capacity) {
+		trace->capacity = trace->capacity ? (trace->capacity * 2) : 0x10000;
+		trace->ops = realloc(trace->ops, trace->capacity * sizeof(trace_op_t));
+
+		if(!trace->ops) {
+			perror("couldn't grow trace");
+			exit(1);
+		}
+	}
+
+	trace_op_t *op = &trace->ops[trace->num_ops++];
+	op->type = type;
+	op->slot = slot;
+	op->size = size;
+
+	if(slot >= trace->num_slots) {
+		trace->num_slots = slot + 1;
+	}
+}
+
+// !Synthetic workloads
+/*
+ * Random churn of small objects, which are all served by the slab caches.
+ */
+static void workload_small(trace_t *trace, size_t ops) {
+	bool *live = calloc(4096, sizeof(bool));
+
+	for(size_t i = 0; i < ops; i++) {
+		uint32_t slot = rng_next() % 4096;
+
+		if(live[slot]) {
+			trace_push(trace, kOpFree, slot, 0);
+		} else {
+			trace_push(trace, kOpAlloc, slot, rng_range(8, 512));
+		}
+
+		live[slot] = !live[slot];
+	}
+
+	free(live);
+}
+
+/*
+ * Random churn of objects of all sizes: mostly small, some that go to
+ * liballoc, and a few of a page or more that go to vmalloc.
+ */
+static void workload_mixed(trace_t *trace, size_t ops) {
+	bool *live = calloc(2048, sizeof(bool));
+
+	for(size_t i = 0; i < ops; i++) {
+		uint32_t slot = rng_next() % 2048;
+
+		if(live[slot]) {
+			trace_push(trace, kOpFree, slot, 0);
+		} else {
+			uint32_t kind = rng_next() % 100;
+			uint32_t size;
+
+			if(kind < 75) {
+				size = rng_range(8, 256);
+			} else if(kind < 95) {
+				size = rng_range(257, 4095);
+			} else {
+				size = rng_range(4096, 65536);
+			}
+
+			trace_push(trace, kOpAlloc, slot, size);
+		}
+
+		live[slot] = !live[slot];
+	}
+
+	free(live);
+}
+
+/*
+ * Batches of allocations that are freed in the reverse order, like the
+ * temporary buffers of a call chain.
+ */
+static void workload_lifo(trace_t *trace, size_t ops) {
+	while(trace->num_ops < ops) {
+		uint32_t batch = rng_range(1, 512);
+
+		for(uint32_t slot = 0; slot < batch; slot++) {
+			trace_push(trace, kOpAlloc, slot, rng_range(16, 2048));
+		}
+
+		for(uint32_t slot = batch; slot > 0; slot--) {
+			trace_push(trace, kOpFree, slot - 1, 0);
+		}
+	}
+}
+
+/*
+ * A queue of allocations that are freed in the order they were made, like
+ * packets or messages passed between a producer and a consumer.
+ */
+static void workload_fifo(trace_t *trace, size_t ops) {
+	const uint32_t depth = 1024;
+
+	for(uint32_t slot = 0; slot < depth && trace->num_ops < ops; slot++) {
+		trace_push(trace, kOpAlloc, slot, rng_range(64, 1536));
+	}
+
+	for(uint32_t slot = 0; trace->num_ops < ops; slot = (slot + 1) % depth) {
+		trace_push(trace, kOpFree, slot, 0);
+		trace_push(trace, kOpAlloc, slot, rng_range(64, 1536));
+	}
+}
+
+/*
+ * Buffers that grow by doubling until they are released, like strings and
+ * arrays that are appended to.
+ */
+static void workload_realloc(trace_t *trace, size_t ops) {
+	uint32_t *sizes = calloc(256, sizeof(uint32_t));
+
+	for(size_t i = 0; i < ops; i++) {
+		uint32_t slot = rng_next() % 256;
+
+		if(!sizes[slot]) {
+			sizes[slot] = rng_range(8, 64);
+			trace_push(trace, kOpAlloc, slot, sizes[slot]);
+		} else if(sizes[slot] >= 0x10000) {
+			sizes[slot] = 0;
+			trace_push(trace, kOpFree, slot, 0);
+		} else {
+			sizes[slot] *= 2;
+			trace_push(trace, kOpRealloc, slot, sizes[slot]);
+		}
+	}
+
+	free(sizes);
+}
+
+/*
+ * Sizes right around the points where the heap hands a request to vmalloc or
+ * the slab caches rather than liballoc, both for plain and for physically
+ * contiguous memory. In hardened builds, these are where the header and
+ * redzone push a request over the edge.
+ */
+static void workload_edge(trace_t *trace, size_t ops) {
+	bool *live = calloc(256, sizeof(bool));
+
+	for(size_t i = 0; i < ops; i++) {
+		uint32_t slot = rng_next() % 256;
+
+		if(live[slot]) {
+			trace_push(trace, kOpFree, slot, 0);
+		} else if(rng_next() % 2) {
+			trace_push(trace, kOpAlloc, slot, rng_range(4060, 4096));
+		} else {
+			trace_push(trace, kOpAllocContig, slot, rng_range(480, 512));
+		}
+
+		live[slot] = !live[slot];
+	}
+
+	free(live);
+}
+
+static const workload_t workloads[] = {
+	{"small", "churn of slab-sized objects", workload_small},
+	{"mixed", "churn of objects of all sizes", workload_mixed},
+	{"lifo", "batches freed in reverse order", workload_lifo},
+	{"fifo", "queue freed in allocation order", workload_fifo},
+	{"realloc", "buffers grown by doubling", workload_realloc},
+	{"edge", "sizes at the heap's routing limits", workload_edge},
+
+	{NULL, NULL, NULL}
+};
+
+// !Trace files
+/*
+ * Maps the ids in a trace file to dense slot numbers, with an open addressing
+ * hash table.
+ */
+typedef struct {
+	uint64_t *keys;
+	uint32_t *slots;
+	size_t capacity;
+	size_t count;
+} id_map_t;
+
+/*
+ * Doubles the size of the table, and reinserts every id.
+ */
+static void id_map_grow(id_map_t *map) {
+	id_map_t old = *map;
+
+	map->capacity = old.capacity ? (old.capacity * 2) : 0x1000;
+	map->keys = calloc(map->capacity, sizeof(uint64_t));
+	map->slots = calloc(map->capacity, sizeof(uint32_t));
+	map->count = 0;
+
+	if(!map->keys || !map->slots) {
+		perror("couldn't grow id map");
+		exit(1);
+	}
+
+	for(size_t i = 0; i < old.capacity; i++) {
+		if(old.slots[i]) {
+			size_t j = (old.keys[i] * 0x9E3779B97F4A7C15ULL) >> 32;
+
+			for(j &= (map->capacity - 1); map->slots[j]; j = (j + 1) & (map->capacity - 1));
+
+			map->keys[j] = old.keys[i];
+			map->slots[j] = old.slots[i];
+			map->count++;
+		}
+	}
+
+	free(old.keys);
+	free(old.slots);
+}
+
+/*
+ * Returns the slot for an id, assigning the next free one if it is new.
+ */
+static uint32_t id_map_get(id_map_t *map, uint64_t id) {
+	if((map->count + 1) * 2 > map->capacity) {
+		id_map_grow(map);
+	}
+
+	size_t i = ((id * 0x9E3779B97F4A7C15ULL) >> 32) & (map->capacity - 1);
+
+	// slots are stored plus one, so that 0 marks an empty entry
+	for(; map->slots[i]; i = (i + 1) & (map->capacity - 1)) {
+		if(map->keys[i] == id) {
+			return map->slots[i] - 1;
+		}
+	}
+
+	map->keys[i] = id;
+	map->slots[i] = ++map->count;
+
+	return map->count - 1;
+}
+
+/*
+ * Reads a trace from a file.
+ */
+static bool trace_load(trace_t *trace, const char *path) {
+	FILE *file = fopen(path, "r");
+	char line[128];
+	id_map_t ids = {0};
+	size_t lineno = 0;
+
+	if(!file) {
+		perror(path);
+		return false;
+	}
+
+	while(fgets(line, sizeof(line), file)) {
+		char type;
+		long long id;
+		long size = 0;
+
+		lineno++;
+
+		if(line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+
+		int fields = sscanf(line, "%c %lli %li", &type, &id, &size);
+
+		if(fields < 2 || (type != kOpAlloc && type != kOpAllocContig &&
+						  type != kOpRealloc && type != kOpFree) ||
+		   (type != kOpFree && fields != 3)) {
+			fprintf(stderr, "%s:%zu: malformed operation\n", path, lineno);
+			fclose(file);
+			return false;
+		}
+
+		trace_push(trace, type, id_map_get(&ids, id), size);
+	}
+
+	fclose(file);
+	free(ids.keys);
+	free(ids.slots);
+
+	return true;
+}
+
+/*
+ * Writes a trace to a file.
+ */
+static bool trace_save(trace_t *trace, const char *path) {
+	FILE *file = fopen(path, "w");
+
+	if(!file) {
+		perror(path);
+		return false;
+	}
+
+	fprintf(file, "# %s, seed %u\n", trace->name, seed);
+
+	for(size_t i = 0; i < trace->num_ops; i++) {
+		trace_op_t *op = &trace->ops[i];
+
+		if(op->type == kOpFree) {
+			fprintf(file, "f %u\n", op->slot);
+		} else {
+			fprintf(file, "%c %u %u\n", op->type, op->slot, op->size);
+		}
+	}
+
+	return (fclose(file) == 0);
+}
+
+// !Replaying
+/*
+ * Stamps an allocation with the slot it belongs to, at either end.
+ */
+static inline void stamp(void *ptr, uint32_t slot, uint32_t size) {
+	if(size >= sizeof(uint32_t)) {
+		*((uint32_t *) ptr) = slot ^ STAMP_MAGIC;
+	}
+
+	((uint8_t *) ptr)[size - 1] = (uint8_t) slot;
+}
+
+/*
+ * Checks that an allocation still carries its stamp.
+ */
+static inline bool stamp_ok(void *ptr, uint32_t slot, uint32_t size) {
+	if(size >= sizeof(uint32_t) && *((uint32_t *) ptr) != (slot ^ STAMP_MAGIC)) {
+		return false;
+	}
+
+	return (((uint8_t *) ptr)[size - 1] == (uint8_t) slot);
+}
+
+/*
+ * Returns the current time, in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Replays a trace against the heap, and prints a line of results.
+ */
+static void trace_run(trace_t *trace) {
+	void **ptrs = calloc(trace->num_slots, sizeof(void *));
+	uint32_t *sizes = calloc(trace->num_slots, sizeof(uint32_t));
+
+	size_t live = 0, peak_live = 0;
+	size_t failed = 0, corrupt = 0;
+
+	if(!ptrs || !sizes) {
+		perror("couldn't allocate slots");
+		exit(1);
+	}
+
+	uint64_t start = now_ns();
+
+	for(size_t i = 0; i < trace->num_ops; i++) {
+		trace_op_t *op = &trace->ops[i];
+		void *ptr = ptrs[op->slot];
+		uint32_t size = op->size ? op->size : 1;
+
+		switch(op->type) {
+			case kOpAlloc:
+				// a recorded trace may have missed the free
+				if(ptr) {
+					kfree(ptr);
+					live -= sizes[op->slot];
+				}
+
+				ptr = kmalloc(size);
+				break;
+
+			case kOpAllocContig:
+				if(ptr) {
+					kfree(ptr);
+					live -= sizes[op->slot];
+				}
+
+				ptr = bench_kmalloc_contig(size);
+				break;
+
+			case kOpRealloc:
+				if(ptr) {
+					corrupt += !stamp_ok(ptr, op->slot, sizes[op->slot]);
+					live -= sizes[op->slot];
+				}
+
+				ptr = krealloc(ptr, size);
+				break;
+
+			case kOpFree:
+				if(ptr) {
+					corrupt += !stamp_ok(ptr, op->slot, sizes[op->slot]);
+					live -= sizes[op->slot];
+
+					kfree(ptr);
+				}
+
+				ptrs[op->slot] = NULL;
+				continue;
+		}
+
+		if(!ptr) {
+			failed++;
+			ptrs[op->slot] = NULL;
+			continue;
+		}
+
+		stamp(ptr, op->slot, size);
+
+		ptrs[op->slot] = ptr;
+		sizes[op->slot] = size;
+
+		live += size;
+
+		if(live > peak_live) {
+			peak_live = live;
+		}
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	// measure the heap as the trace left it, then empty it
+	bench_heap_stats_t end, empty;
+	bench_heap_stats(&end);
+
+	if(dump_heap) {
+		bench_heap_dump();
+	}
+
+	for(uint32_t slot = 0; slot < trace->num_slots; slot++) {
+		if(ptrs[slot]) {
+			kfree(ptrs[slot]);
+		}
+	}
+
+	bench_heap_stats(&empty);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	// physical memory per byte that is still allocated
+	size_t held = end.phys_pages * 0x1000;
+	double overhead = live ? ((double) held / live) : 0;
+
+	printf("%-10s %10zu %8.1f %9zuK %9zuK %9liK %7.2fx %5u.%u%% %8zuK",
+		   trace->name, trace->num_ops, (double) elapsed / trace->num_ops,
+		   peak_live / 1024, end.phys_peak * 4, usage.ru_maxrss, overhead,
+		   end.fragmentation / 10, end.fragmentation % 10, empty.phys_pages * 4);
+
+	if(failed || corrupt) {
+		printf("  (%zu failed, %zu corrupt)", failed, corrupt);
+	}
+
+	// only the hardened heap counts these
+	if(empty.corruptions || empty.bad_frees) {
+		printf("  (heap: %u damaged, %u bad frees)", empty.corruptions, empty.bad_frees);
+	}
+
+	printf("\n");
+
+	free(ptrs);
+	free(sizes);
+}
+
+/*
+ * Runs a trace in a child process with a heap of its own. The trace is
+ * either generated by a workload, or read from a file.
+ */
+static bool run_isolated(const workload_t *workload, const char *path) {
+	fflush(stdout);
+	pid_t pid = fork();
+
+	if(pid < 0) {
+		perror("fork");
+		return false;
+	} else if(pid == 0) {
+		trace_t trace = {0};
+
+		// reserve the kernel's window before the trace takes any memory
+		if(!bench_heap_init(phys_mb * 256)) {
+			exit(1);
+		}
+
+		if(workload) {
+			trace.name = workload->name;
+
+			rng_state = seed;
+			workload->generate(&trace, num_ops);
+		} else {
+			const char *name = strrchr(path, '/');
+			trace.name = name ? (name + 1) : path;
+
+			if(!trace_load(&trace, path)) {
+				exit(1);
+			}
+		}
+
+		trace_run(&trace);
+		exit(0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: benchmark failed\n", workload ? workload->name : path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Prints usage information.
+ */
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-n ops] [-s seed] [-m phys MB] [-w workload] "
+			"[-o trace] [-d] [-v] [trace ...]\n\n", name);
+	fprintf(stderr, "  -n  operations per synthetic workload (default %zu)\n", num_ops);
+	fprintf(stderr, "  -s  seed for synthetic workloads (default %u)\n", seed);
+	fprintf(stderr, "  -m  physical memory of the heap, in megabytes (default %zu)\n", phys_mb);
+	fprintf(stderr, "  -w  only run the given workload\n");
+	fprintf(stderr, "  -o  write the workload given with -w to a trace file, rather than running it\n");
+	fprintf(stderr, "  -d  dump the heap's statistics after each run\n");
+	fprintf(stderr, "  -v  print all messages the kernel logs\n\n");
+	fprintf(stderr, "Traces given as arguments are run instead of the workloads, which are:\n");
+
+	for(const workload_t *w = workloads; w->name; w++) {
+		fprintf(stderr, "  %-10s %s\n", w->name, w->description);
+	}
+}
+
+/*
+ * Main entry point
+ */
+int main(int argc, char *argv[]) {
+	const char *only = NULL, *output = NULL;
+	int opt;
+	bool ok = true;
+
+	while((opt = getopt(argc, argv, "n:s:m:w:o:dvh")) != -1) {
+		switch(opt) {
+			case 'n':
+				num_ops = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				phys_mb = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				only = optarg;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'd':
+				dump_heap = true;
+				break;
+			case 'v':
+				host_verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return (opt == 'h') ? 0 : -1;
+		}
+	}
+
+	// xorshift gets stuck at zero
+	if(!seed) {
+		seed = 1;
+	}
+
+	const workload_t *selected = NULL;
+
+	if(only) {
+		for(const workload_t *w = workloads; w->name; w++) {
+			if(strcmp(w->name, only) == 0) {
+				selected = w;
+			}
+		}
+
+		if(!selected) {
+			fprintf(stderr, "unknown workload '%s'\n", only);
+			return -1;
+		}
+	}
+
+	// record a workload to a file
+	if(output) {
+		trace_t trace = {0};
+
+		if(!selected) {
+			fprintf(stderr, "-o needs a workload given with -w\n");
+			return -1;
+		}
+
+		trace.name = selected->name;
+
+		rng_state = seed;
+		selected->generate(&trace, num_ops);
+
+		return trace_save(&trace, output) ? 0 : -1;
+	}
+
+	printf("%-10s %10s %8s %10s %10s %10s %8s %7s %9s\n", "trace", "ops",
+		   "ns/op", "peak live", "peak phys", "peak rss", "overhead", "frag",
+		   "retained");
+
+	if(optind < argc) {
+		for(int i = optind; i < argc; i++) {
+			ok &= run_isolated(NULL, argv[i]);
+		}
+	} else {
+		for(const workload_t *w = workloads; w->name; w++) {
+			if(!selected || selected == w) {
+				ok &= run_isolated(w, NULL);
+			}
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+/*
+ * Interface between the two halves of the host build of the kernel heap.
+ *
+ * The heap itself, and the shim that stands in for the platform and physical
+ * memory manager beneath it, are compiled against the kernel's headers; the
+ * benchmark and the code that talks to the host OS are compiled against the
+ * host's C library. The two sets of headers can't be mixed, so they only meet
+ * through the plain C declarations in this file.
+ */
+#ifndef HEAPBENCH_H
+#define HEAPBENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+/*
+ * The window of the kernel's address space that the heap and vmalloc use.
+ * This is reserved in the benchmark's own address space, so kernel addresses
+ * can be used as they are: this only works for 32-bit processes.
+ */
+#define	HOST_KERNEL_VIRT_BASE	0xC8000000
+#define	HOST_KERNEL_VIRT_END	0xF0000000
+
+// physical addresses handed out by the shim start here, so 0 is never valid
+#define	HOST_PHYS_BASE			0x00100000
+
+// !Host side (host.c)
+/*
+ * Reserves the kernel's address window and creates the arena that serves as
+ * physical memory, with the given number of pages. Returns false on failure.
+ */
+bool host_init(size_t pages);
+
+/*
+ * Maps pages of the physical arena, starting at the given offset into it, at
+ * virt. The memory is read/write.
+ */
+void host_map(uintptr_t virt, size_t offset, size_t pages);
+
+/*
+ * Unmaps pages at virt, leaving the address range reserved.
+ */
+void host_unmap(uintptr_t virt, size_t pages);
+
+/*
+ * Gives the memory of pages of the physical arena, starting at the given
+ * offset, back to the host. They read as zero the next time they're mapped.
+ */
+void host_discard(size_t offset, size_t pages);
+
+/*
+ * Prints a message logged by the kernel, if verbose logging is on.
+ */
+void host_log(int level, const char *format, va_list ap);
+
+/*
+ * Reports a failed assertion in the kernel and aborts.
+ */
+void host_panic(const char *file, int line, const char *message) __attribute__((noreturn));
+
+/*
+ * Whether messages below the error level are printed.
+ */
+extern bool host_verbose;
+
+// !Kernel side (shim.c)
+/*
+ * A snapshot of the heap, and of the physical memory beneath it.
+ */
+typedef struct {
+	// physical pages in use, and the most that were in use at once
+	size_t phys_pages;
+	size_t phys_peak;
+
+	// pages of the heap region in use
+	size_t heap_pages;
+
+	// liballoc: block bytes, bytes handed out, and fragmentation in per mille
+	size_t major_bytes;
+	size_t major_inuse;
+	unsigned int fragmentation;
+
+	// vmalloc: number and bytes of large allocations
+	unsigned int large_allocations;
+	size_t large_bytes;
+
+	// objects handed out, and held in slabs, by the small object caches
+	size_t slab_inuse_bytes;
+	size_t slab_total_bytes;
+
+	// hardened heap: damaged objects, and frees of objects that weren't live
+	unsigned int corruptions;
+	unsigned int bad_frees;
+} bench_heap_stats_t;
+
+/*
+ * Sets up physical memory with the given number of pages, then creates the
+ * kernel heap on top of it.
+ */
+bool bench_heap_init(size_t pages);
+
+/*
+ * Takes a snapshot of the heap.
+ */
+void bench_heap_stats(bench_heap_stats_t *stats);
+
+/*
+ * Prints the heap's own statistics, as the kernel would.
+ */
+void bench_heap_dump(void);
+
+/*
+ * The kernel heap's entry points.
+ */
+void *kmalloc(size_t size);
+void *krealloc(void *address, size_t size);
+void kfree(void *address);
+
+/*
+ * Allocates physically contiguous memory, through kmalloc_ext.
+ */
+void *bench_kmalloc_contig(size_t size);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Host side of the physical memory shim: the arena that serves as physical
+ * memory is a memfd, whose pages are mapped into the kernel's address window
+ * as the heap maps them.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "heapbench.h"
+
+bool host_verbose = false;
+
+// file descriptor of the physical memory arena
+static int arena_fd = -1;
+
+/*
+ * Reserves the kernel's address window and creates the arena that serves as
+ * physical memory, with the given number of pages.
+ */
+bool host_init(size_t pages) {
+	void *window = mmap((void *) HOST_KERNEL_VIRT_BASE,
+						HOST_KERNEL_VIRT_END - HOST_KERNEL_VIRT_BASE, PROT_NONE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+						-1, 0);
+
+	if(window == MAP_FAILED || window != (void *) HOST_KERNEL_VIRT_BASE) {
+		fprintf(stderr, "couldn't reserve kernel window at 0x%08X: %s\n",
+				HOST_KERNEL_VIRT_BASE, strerror(errno));
+		return false;
+	}
+
+	arena_fd = memfd_create("heapbench-phys", MFD_CLOEXEC);
+
+	if(arena_fd < 0 || ftruncate(arena_fd, (off_t) pages * 0x1000) != 0) {
+		perror("couldn't create physical memory arena");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Maps pages of the physical arena, starting at the given offset into it, at
+ * virt.
+ */
+void host_map(uintptr_t virt, size_t offset, size_t pages) {
+	void *ptr = mmap((void *) virt, pages * 0x1000, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_FIXED, arena_fd, (off_t) offset);
+
+	if(ptr == MAP_FAILED) {
+		fprintf(stderr, "couldn't map 0x%zX pages at 0x%08zX: %s\n", pages,
+				(size_t) virt, strerror(errno));
+		abort();
+	}
+}
+
+/*
+ * Unmaps pages at virt, by putting the reservation back over them.
+ */
+void host_unmap(uintptr_t virt, size_t pages) {
+	void *ptr = mmap((void *) virt, pages * 0x1000, PROT_NONE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+					 -1, 0);
+
+	if(ptr == MAP_FAILED) {
+		fprintf(stderr, "couldn't unmap 0x%zX pages at 0x%08zX: %s\n", pages,
+				(size_t) virt, strerror(errno));
+		abort();
+	}
+}
+
+/*
+ * Gives the memory of pages of the arena back to the host.
+ */
+void host_discard(size_t offset, size_t pages) {
+	if(fallocate(arena_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				 (off_t) offset, (off_t) pages * 0x1000) != 0) {
+		perror("couldn't discard physical memory");
+		abort();
+	}
+}
+
+/*
+ * Prints a message logged by the kernel. Errors and worse are always printed;
+ * the rest only if verbose logging is on.
+ */
+void host_log(int level, const char *format, va_list ap) {
+	// kLogLevelError
+	if(level < 4 && !host_verbose) {
+		return;
+	}
+
+	vfprintf(stderr, format, ap);
+}
+
+/*
+ * Reports a failed assertion in the kernel and aborts.
+ */
+void host_panic(const char *file, int line, const char *message) {
+	fprintf(stderr, "kernel panic: %s:%i %s\n", file, line, message);
+	abort();
+}
@@ -0,0 +1,360 @@
+/*
+ * Stands in for the parts of the kernel that the heap sits on: the physical
+ * memory manager, the pagetable functions of the platform, and the bits of
+ * the platform expert it uses for logging, interrupts and CPU numbers.
+ *
+ * Physical memory is a file in memory, handed out a page at a time by a free
+ * list; mapping a physical page maps that page of the file into the kernel's
+ * address window, which is reserved in the benchmark's own address space.
+ * Freed pages are given back to the host, so the resident set of the process
+ * follows the memory the heap holds on to.
+ *
+ * There is only one CPU, and no interrupts ever arrive.
+ */
+#include <types.h>
+#include "pexpert/platform.h"
+#include "vm/vm.h"
+#include "vm/physical.h"
+#include "vm/kheap.h"
+#include "vm/kmalloc.h"
+
+#include "heapbench.h"
+
+// most physical memory the shim can manage: 1G
+#define	SHIM_MAX_PAGES	(0x40000000 / 0x1000)
+
+// pages in the kernel's address window
+#define	SHIM_VIRT_PAGES	((HOST_KERNEL_VIRT_END - HOST_KERNEL_VIRT_BASE) / 0x1000)
+
+/*
+ * Stands in for the end of the kernel's image. Allocations made before the
+ * heap is installed are placed after it.
+ */
+char __kern_end[0x100000] __attribute__((aligned(0x1000)));
+
+/*
+ * State of the physical memory shim.
+ */
+static struct {
+	// pages in the arena, and the first page that was never handed out
+	size_t pages;
+	size_t next;
+
+	// pages that were handed out, then released
+	uint32_t free[SHIM_MAX_PAGES];
+	size_t num_free;
+
+	// pages in use, and the most that were in use at once
+	size_t in_use;
+	size_t peak;
+
+	// physical page, plus one, mapped at each page of the window; 0 if none
+	uint32_t mapped[SHIM_VIRT_PAGES];
+} phys;
+
+static bool int_enabled = true;
+
+// !Physical memory manager
+/*
+ * Counts pages as handed out.
+ */
+static inline void shim_phys_take(size_t pages) {
+	phys.in_use += pages;
+
+	if(phys.in_use > phys.peak) {
+		phys.peak = phys.in_use;
+	}
+}
+
+/*
+ * Allocates a single page of physical memory.
+ */
+phys_addr_t vm_allocate_phys(void) {
+	size_t page;
+
+	if(phys.num_free) {
+		page = phys.free[--phys.num_free];
+	} else if(phys.next < phys.pages) {
+		page = phys.next++;
+	} else {
+		return 0;
+	}
+
+	shim_phys_take(1);
+	return HOST_PHYS_BASE + (phys_addr_t) page * 0x1000;
+}
+
+/*
+ * Released pages are discarded, so every page reads as zero when it is handed
+ * out again.
+ */
+phys_addr_t vm_allocate_phys_zeroed(void) {
+	return vm_allocate_phys();
+}
+
+/*
+ * Allocates physically contiguous pages, aligned to align. A single page may
+ * be any free page; longer runs are always carved from pages that were never
+ * handed out, and pages skipped to align the run go on the free list.
+ */
+phys_addr_t vm_allocate_phys_contig(size_t pages, phys_addr_t align, phys_addr_t limit) {
+	size_t count = (align > 0x1000) ? (align / 0x1000) : 1;
+
+	if(pages == 1 && count == 1 && !limit) {
+		return vm_allocate_phys();
+	}
+	size_t page = (phys.next + count - 1) & ~(count - 1);
+
+	phys_addr_t address = HOST_PHYS_BASE + (phys_addr_t) page * 0x1000;
+
+	if(page + pages > phys.pages ||
+	   (limit && address + (phys_addr_t) pages * 0x1000 > limit)) {
+		return 0;
+	}
+
+	while(phys.next < page) {
+		phys.free[phys.num_free++] = phys.next++;
+	}
+
+	phys.next += pages;
+
+	shim_phys_take(pages);
+	return address;
+}
+
+/*
+ * Releases a page of physical memory, and gives its memory back to the host.
+ */
+void vm_deallocate_phys(phys_addr_t address) {
+	size_t page = (address - HOST_PHYS_BASE) / 0x1000;
+
+	ASSERT(address >= HOST_PHYS_BASE && page < phys.next);
+
+	host_discard(page * 0x1000, 1);
+
+	phys.free[phys.num_free++] = page;
+	phys.in_use--;
+}
+
+// !Pagetables
+/*
+ * There is only the kernel's pagetable, which is never looked into.
+ */
+platform_pagetable_t vm_get_pagetable(void) {
+	return (platform_pagetable_t) &phys;
+}
+
+/*
+ * The early heap is bounded by the array that stands in for the kernel's end.
+ */
+uintptr_t platform_pm_boot_map_end(void) {
+	return (uintptr_t) __kern_end + sizeof(__kern_end);
+}
+
+/*
+ * Returns the index into the mapping table of a page in the kernel's window.
+ */
+static inline size_t shim_virt_index(uintptr_t virt) {
+	ASSERT(virt >= HOST_KERNEL_VIRT_BASE && virt < HOST_KERNEL_VIRT_END);
+	return (virt - HOST_KERNEL_VIRT_BASE) / 0x1000;
+}
+
+/*
+ * Maps pages contiguous pages, starting at virt, to the physically contiguous
+ * memory starting at phys.
+ */
+void platform_pm_map_range(platform_pagetable_t table, uintptr_t virt,
+						   phys_addr_t address, size_t pages,
+						   platform_page_flags_t flags) {
+	size_t index = shim_virt_index(virt);
+	size_t page = (address - HOST_PHYS_BASE) / 0x1000;
+
+	ASSERT(index + pages <= SHIM_VIRT_PAGES);
+	ASSERT(page + pages <= phys.pages);
+
+	host_map(virt, page * 0x1000, pages);
+
+	for(size_t i = 0; i < pages; i++) {
+		phys.mapped[index + i] = page + i + 1;
+	}
+}
+
+/*
+ * Maps a single page.
+ */
+void platform_pm_map(platform_pagetable_t table, uintptr_t virt, phys_addr_t address,
+					 platform_page_flags_t flags) {
+	platform_pm_map_range(table, virt, address, 1, flags);
+}
+
+/*
+ * Unmaps pages contiguous pages, starting at virt.
+ */
+void platform_pm_unmap_range(platform_pagetable_t table, uintptr_t virt,
+							 size_t pages) {
+	size_t index = shim_virt_index(virt);
+
+	ASSERT(index + pages <= SHIM_VIRT_PAGES);
+
+	host_unmap(virt, pages);
+	memclr(&phys.mapped[index], pages * sizeof(uint32_t));
+}
+
+/*
+ * Translates a virtual address to a physical address, or 0 if it isn't mapped.
+ */
+phys_addr_t platform_pm_virt_to_phys(platform_pagetable_t table, uintptr_t virt) {
+	uint32_t page = phys.mapped[shim_virt_index(virt)];
+
+	if(!page) {
+		return 0;
+	}
+
+	return HOST_PHYS_BASE + (phys_addr_t) (page - 1) * 0x1000 + (virt & 0xFFF);
+}
+
+/*
+ * Translates size bytes, starting at virt, into a list of physically
+ * contiguous extents.
+ */
+size_t platform_pm_translate(platform_pagetable_t table, uintptr_t virt,
+							 size_t size, platform_pm_extent_t *extents,
+							 size_t max) {
+	uintptr_t end = virt + size;
+	size_t num = 0;
+
+	for(virt &= ~0xFFF; virt < end; virt += 0x1000) {
+		phys_addr_t address = platform_pm_virt_to_phys(table, virt);
+
+		if(!address) {
+			continue;
+		}
+
+		platform_pm_extent_t *last = num ? &extents[num - 1] : NULL;
+
+		// extend the last extent if both addresses follow on from it
+		if(last && (last->virt + last->length) == virt &&
+		   (last->phys + last->length) == address) {
+			last->length += 0x1000;
+			continue;
+		}
+
+		if(num == max) {
+			break;
+		}
+
+		extents[num].virt = virt;
+		extents[num].phys = address;
+		extents[num].length = 0x1000;
+		num++;
+	}
+
+	return num;
+}
+
+/*
+ * Kernel addresses are valid if they're mapped; user addresses never are.
+ */
+bool platform_pm_is_valid(platform_pagetable_t table, uintptr_t virt, bool user) {
+	if(user || virt < HOST_KERNEL_VIRT_BASE || virt >= HOST_KERNEL_VIRT_END) {
+		return false;
+	}
+
+	return (platform_pm_virt_to_phys(table, virt) != 0);
+}
+
+// !Platform expert
+unsigned int platform_cpu_id(void) {
+	return 0;
+}
+
+bool platform_int_enabled(void) {
+	return int_enabled;
+}
+
+void platform_int_set_mask(bool m) {
+	int_enabled = m;
+}
+
+void pexpert_log(pexpert_log_level_t level, const char* format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	host_log(level, format, ap);
+	va_end(ap);
+}
+
+void pexpert_panic(const char *file, const int line, const char *message) {
+	host_panic(file, line, message);
+}
+
+/*
+ * The C library provides the rest of the kernel's string functions.
+ */
+void* memclr(void* start, size_t count) {
+	return memset(start, 0, count);
+}
+
+// !Benchmark interface
+/*
+ * Sets up physical memory with the given number of pages, then creates the
+ * kernel heap on top of it.
+ */
+bool bench_heap_init(size_t pages) {
+	if(pages > SHIM_MAX_PAGES || !host_init(pages)) {
+		return false;
+	}
+
+	phys.pages = pages;
+
+	kheap_install();
+	return true;
+}
+
+/*
+ * Takes a snapshot of the heap, and of the physical memory beneath it.
+ */
+void bench_heap_stats(bench_heap_stats_t *stats) {
+	kheap_stats_t heap;
+
+	kheap_get_stats(&heap);
+	memclr(stats, sizeof(bench_heap_stats_t));
+
+	stats->phys_pages = phys.in_use;
+	stats->phys_peak = phys.peak;
+
+	stats->heap_pages = heap.heap_pages;
+
+	stats->major_bytes = heap.major_bytes;
+	stats->major_inuse = heap.major_inuse;
+	stats->fragmentation = heap.fragmentation;
+
+	stats->large_allocations = heap.large.allocations;
+	stats->large_bytes = heap.large.allocated_bytes;
+
+	for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+		stats->slab_inuse_bytes += heap.classes[i].obj_size * heap.classes[i].objs_inuse;
+		stats->slab_total_bytes += heap.classes[i].obj_size * heap.classes[i].objs_total;
+	}
+
+	stats->corruptions = heap.corruptions;
+	stats->bad_frees = heap.bad_frees;
+}
+
+/*
+ * Allocates physically contiguous memory, as drivers do for DMA buffers.
+ */
+void *bench_kmalloc_contig(size_t size) {
+	return kmalloc_ext(size, kMallocZero | kMallocContiguous, NULL);
+}
+
+/*
+ * Prints the heap's own statistics, as the kernel would.
+ */
+void bench_heap_dump(void) {
+	bool verbose = host_verbose;
+
+	host_verbose = true;
+	kheap_dump_stats();
+	host_verbose = verbose;
+}